@@ -3,6 +3,7 @@
 extern char *contents_cipher;
 extern char *filename_cipher;
 extern unsigned padding;
+extern unsigned policy_version;
 
 #ifndef EXT4_CRYPT_H
 #define EXT4_CRYPT_H
@@ -13,6 +14,13 @@ extern unsigned padding;
 #include <asm-generic/ioctl.h>
 #include <keyutils.h>
 
+#include "libe2crypt.h"
+
+extern bool drop_caches;
+extern unsigned cache_ttl;
+extern const char *key_family;
+extern const char *key_file;
+
 #define NAME "e2crypt"
 #define EXT4_KEY_DESCRIPTOR_SIZE 8
 #define EXT4_ENCRYPTION_CONTEXT_FORMAT_V1 1
@@ -30,6 +38,12 @@ extern unsigned padding;
 #define EXT4_ENCRYPTION_MODE_AES_256_GCM 2
 #define EXT4_ENCRYPTION_MODE_AES_256_CBC 3
 #define EXT4_ENCRYPTION_MODE_AES_256_CTS 4
+#define EXT4_ENCRYPTION_MODE_AES_128_CBC 5
+#define EXT4_ENCRYPTION_MODE_AES_128_CTS 6
+#define EXT4_ENCRYPTION_MODE_SM4_XTS 7
+#define EXT4_ENCRYPTION_MODE_SM4_CTS 8
+#define EXT4_ENCRYPTION_MODE_ADIANTUM 9
+#define EXT4_ENCRYPTION_MODE_AES_256_HCTR2 10
 
 #define EXT4_XTS_TWEAK_SIZE 16
 #define EXT4_AES_128_ECB_KEY_SIZE 16
@@ -37,6 +51,12 @@ extern unsigned padding;
 #define EXT4_AES_256_CBC_KEY_SIZE 32
 #define EXT4_AES_256_CTS_KEY_SIZE 32
 #define EXT4_AES_256_XTS_KEY_SIZE 64
+#define EXT4_AES_128_CBC_KEY_SIZE 16
+#define EXT4_AES_128_CTS_KEY_SIZE 16
+#define EXT4_SM4_XTS_KEY_SIZE 32
+#define EXT4_SM4_CTS_KEY_SIZE 16
+#define EXT4_ADIANTUM_KEY_SIZE 32
+#define EXT4_AES_256_HCTR2_KEY_SIZE 32
 #define EXT4_MAX_KEY_SIZE 64
 #define EXT4_KEY_DESC_PREFIX "ext4:"
 #define EXT4_KEY_DESC_PREFIX_SIZE 5
@@ -45,12 +65,53 @@ extern unsigned padding;
 #define EXT4_IOC_GET_ENCRYPTION_PWSALT _IOW('f', 20, __u8[16])
 #define EXT4_IOC_GET_ENCRYPTION_POLICY _IOW('f', 21, struct ext4_encryption_policy)
 
+// Policy version 2: the key is added to the filesystem instead of a keyring,
+// under an identifier the kernel derives from it, and removing it evicts the
+// inodes of the vault
+#define EXT4_POLICY_V1 0
+#define EXT4_POLICY_V2 2
+// New vaults get v2 when the kernel supports it
+#define EXT4_POLICY_AUTO 0x7f
+#define EXT4_KEY_IDENTIFIER_SIZE 16
+#define EXT4_KEY_SPEC_TYPE_IDENTIFIER 2
+#define EXT4_KEY_STATUS_ABSENT 1
+#define EXT4_KEY_STATUS_PRESENT 2
+#define EXT4_KEY_STATUS_INCOMPLETELY_REMOVED 3
+#define EXT4_KEY_REMOVAL_STATUS_FLAG_FILES_BUSY 0x01
+
+#define EXT4_IOC_GET_ENCRYPTION_POLICY_EX _IOWR('f', 22, uint8_t[9])
+#define EXT4_IOC_ADD_ENCRYPTION_KEY _IOWR('f', 23, struct ext4_add_key_arg)
+#define EXT4_IOC_REMOVE_ENCRYPTION_KEY _IOWR('f', 24, struct ext4_remove_key_arg)
+#define EXT4_IOC_GET_ENCRYPTION_KEY_STATUS _IOWR('f', 26, struct ext4_key_status_arg)
+
 #define EXT4_MAX_PASSPHRASE_SZ 128
+#define AGENT_DEFAULT_TTL 900
+#define SCRYPT_N (1 << 14)
+#define SCRYPT_R 8
+#define SCRYPT_P 16
+#define KDF_SALT_SZ 16
+#define KDF_SALT_MAX 32
+#define KDF_LIMIT_LOG2_N 30
+#define KDF_LIMIT_R 64
+#define KDF_LIMIT_P 1024
+#define VAULT_VERIFIER_SZ 16
+#define VAULT_META_VERIFIER 0x01
+#define VAULT_META_FAMILY 0x02
+#define VAULT_META_KEYFILE 0x04
+#define VAULT_NONCE_SZ 16
+#define FAMILY_SECRET_SZ 64
 #define EXT4_ENCRYPTION_KEY_TYPE "logon"
+#define VAULT_KEYRING NAME
+#define LOCK_KEYRING "keyring"
+#define LOCK_DROP_CACHES "drop-caches"
+// Only processes possessing the keyring may use it, everyone of the user may see it
+#define VAULT_KEYRING_PERM (KEY_POS_ALL | KEY_USR_VIEW)
 #define EXT4_FULL_KEY_DESCRIPTOR_SIZE (EXT4_KEY_DESCRIPTOR_SIZE * 2 + EXT4_KEY_DESC_PREFIX_SIZE)
 
 typedef char key_desc_t[EXT4_KEY_DESCRIPTOR_SIZE];
-typedef char full_key_desc_t[EXT4_FULL_KEY_DESCRIPTOR_SIZE];
+typedef char key_id_t[EXT4_KEY_IDENTIFIER_SIZE];
+// Keyring description as a C string, with room for the terminating zero
+typedef char full_key_desc_t[EXT4_FULL_KEY_DESCRIPTOR_SIZE + 1];
 
 // Policy provided via an ioctl on the topmost directory
 struct ext4_encryption_policy {
@@ -62,6 +123,58 @@ struct ext4_encryption_policy {
     key_desc_t master_key_descriptor;
 } __attribute__((__packed__));
 
+struct ext4_encryption_policy_v2 {
+    char version;
+    char contents_encryption_mode;
+    char filenames_encryption_mode;
+    char flags;
+    char reserved[4];
+    key_id_t master_key_identifier;
+} __attribute__((__packed__));
+
+// Argument of EXT4_IOC_GET_ENCRYPTION_POLICY_EX
+struct ext4_policy_ex_arg {
+    uint64_t policy_size;
+    union {
+        char version;
+        struct ext4_encryption_policy v1;
+        struct ext4_encryption_policy_v2 v2;
+    } policy;
+};
+
+// Key of a v2 policy on the filesystem
+struct ext4_key_specifier {
+    uint32_t type;
+    uint32_t reserved;
+    union {
+        uint8_t reserved[32];
+        key_id_t identifier;
+    } u;
+};
+
+struct ext4_add_key_arg {
+    struct ext4_key_specifier key_spec;
+    uint32_t raw_size;
+    uint32_t key_id;
+    uint32_t reserved[8];
+    uint8_t raw[];
+};
+
+struct ext4_remove_key_arg {
+    struct ext4_key_specifier key_spec;
+    uint32_t removal_status_flags;
+    uint32_t reserved[5];
+};
+
+struct ext4_key_status_arg {
+    struct ext4_key_specifier key_spec;
+    uint32_t reserved[6];
+    uint32_t status;
+    uint32_t status_flags;
+    uint32_t user_count;
+    uint32_t out_reserved[13];
+};
+
 struct ext4_encryption_key {
     uint32_t mode;
     unsigned char raw[EXT4_MAX_KEY_SIZE];
@@ -87,18 +200,32 @@ unsigned flags_to_padding_length(char flags)
     return (4 << (flags & EXT4_POLICY_FLAGS_PAD_MASK));
 }
 
+// A contents cipher names the filenames cipher it pairs with by default,
+// and the key length in bits that its security level is judged by
 struct cipher {
     const char *cipher_name;
     size_t cipher_key_size;
+    char filenames_mode;
+    unsigned security_bits;
 };
 
 static
 struct cipher cipher_modes[] = {
-    [EXT4_ENCRYPTION_MODE_INVALID] = { "invalid", 0 },
-    [EXT4_ENCRYPTION_MODE_AES_256_XTS] = { "aes-256-xts", EXT4_AES_256_XTS_KEY_SIZE },
-    [EXT4_ENCRYPTION_MODE_AES_256_GCM] = { "aes-256-gcm", EXT4_AES_256_GCM_KEY_SIZE },
-    [EXT4_ENCRYPTION_MODE_AES_256_CBC] = { "aes-256-cbc", EXT4_AES_256_CBC_KEY_SIZE },
-    [EXT4_ENCRYPTION_MODE_AES_256_CTS] = { "aes-256-cts", EXT4_AES_256_CTS_KEY_SIZE },
+    [EXT4_ENCRYPTION_MODE_INVALID] = { "invalid", 0, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_AES_256_XTS] = { "aes-256-xts", EXT4_AES_256_XTS_KEY_SIZE,
+        EXT4_ENCRYPTION_MODE_AES_256_CTS, 256 },
+    [EXT4_ENCRYPTION_MODE_AES_256_GCM] = { "aes-256-gcm", EXT4_AES_256_GCM_KEY_SIZE, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_AES_256_CBC] = { "aes-256-cbc", EXT4_AES_256_CBC_KEY_SIZE, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_AES_256_CTS] = { "aes-256-cts", EXT4_AES_256_CTS_KEY_SIZE, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_AES_128_CBC] = { "aes-128-cbc", EXT4_AES_128_CBC_KEY_SIZE,
+        EXT4_ENCRYPTION_MODE_AES_128_CTS, 128 },
+    [EXT4_ENCRYPTION_MODE_AES_128_CTS] = { "aes-128-cts", EXT4_AES_128_CTS_KEY_SIZE, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_SM4_XTS] = { "sm4-xts", EXT4_SM4_XTS_KEY_SIZE,
+        EXT4_ENCRYPTION_MODE_SM4_CTS, 128 },
+    [EXT4_ENCRYPTION_MODE_SM4_CTS] = { "sm4-cts", EXT4_SM4_CTS_KEY_SIZE, 0, 0 },
+    [EXT4_ENCRYPTION_MODE_ADIANTUM] = { "adiantum", EXT4_ADIANTUM_KEY_SIZE,
+        EXT4_ENCRYPTION_MODE_ADIANTUM, 256 },
+    [EXT4_ENCRYPTION_MODE_AES_256_HCTR2] = { "aes-256-hctr2", EXT4_AES_256_HCTR2_KEY_SIZE, 0, 0 },
 };
 
 #define NR_EXT4_ENCRYPTION_MODES (sizeof(cipher_modes) / sizeof(cipher_modes[0]))
@@ -119,6 +246,41 @@ char cipher_string_to_mode(const char *cipher)
     abort();
 }
 
+static inline
+size_t cipher_mode_key_size(unsigned char mode)
+{
+    if (mode >= NR_EXT4_ENCRYPTION_MODES) return 0;
+    return cipher_modes[mode].cipher_key_size;
+}
+
+// The kernel only takes these pairs of contents and filenames ciphers
+static inline
+bool cipher_pair_valid(unsigned char contents, unsigned char filenames)
+{
+    switch (contents) {
+        case EXT4_ENCRYPTION_MODE_AES_256_XTS:
+            return filenames == EXT4_ENCRYPTION_MODE_AES_256_CTS
+                || filenames == EXT4_ENCRYPTION_MODE_AES_256_HCTR2;
+        case EXT4_ENCRYPTION_MODE_AES_128_CBC:
+            return filenames == EXT4_ENCRYPTION_MODE_AES_128_CTS;
+        case EXT4_ENCRYPTION_MODE_SM4_XTS:
+            return filenames == EXT4_ENCRYPTION_MODE_SM4_CTS;
+        case EXT4_ENCRYPTION_MODE_ADIANTUM:
+            return filenames == EXT4_ENCRYPTION_MODE_ADIANTUM;
+        default:
+            return false;
+    }
+}
+
+// Size of the master key of a policy: a v2 key is the input of a KDF and
+// always gets the maximum, a v1 key is used by the contents cipher as it is
+static inline
+size_t policy_key_size(const struct ext4_encryption_policy *policy)
+{
+    if (policy->version == EXT4_POLICY_V2) return EXT4_MAX_KEY_SIZE;
+    return cipher_mode_key_size(policy->contents_encryption_mode);
+}
+
 static inline
 size_t cipher_key_size(const char *cipher)
 {
@@ -129,15 +291,250 @@ size_t cipher_key_size(const char *cipher)
     abort();
 }
 
+// Cost and salt of the passphrase KDF of a vault
+struct kdf_params {
+    uint64_t N;
+    uint32_t r;
+    uint32_t p;
+    uint8_t salt[KDF_SALT_MAX];
+    size_t salt_sz;
+};
+
+// Measurements of --calibrate and the cost it selected
+struct kdf_calibration {
+    unsigned cpus;
+    double bandwidth_mib_s;
+    double lane_ms;
+    uint64_t N;
+    uint32_t r;
+    uint32_t p;
+    unsigned long long mem_mib;
+    double unlock_ms;
+    char path[4096];
+};
+
+// Metadata recorded on a vault directory
+struct vault_meta {
+    uint8_t flags;
+    struct kdf_params kdf;
+    uint8_t verifier[VAULT_VERIFIER_SZ];
+    uint8_t family_nonce[VAULT_NONCE_SZ];
+};
+
+// Locks held on the key of a vault while it is added or removed, -1 when not held
+struct vault_lock {
+    int keyring;
+    int descriptor;
+};
+
+// Callbacks of a parallel directory walk
+// dir is called for every directory, a non-zero return skips its contents;
+// entry is called for every entry found in a directory;
+// dir_done is called on the same thread once the entries of a directory are done
+struct walk_ops {
+    int (*dir)(int dirfd, const char *path, unsigned depth, void *arg);
+    void (*entry)(int dirfd, const char *dir_path, const char *name, unsigned char type,
+            unsigned depth, void *arg);
+    void (*dir_done)(const char *path, unsigned depth, void *arg);
+    void *arg;
+    unsigned threads;
+    unsigned max_depth;
+    bool cross_mounts;
+};
+
+struct walk_stats {
+    unsigned long dirs;
+    unsigned long errors;
+};
+
+// Result of evicting the cached pages of a directory tree
+struct cache_stats {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long skipped;
+    unsigned long long pages;
+};
+
+// Scratch memory of the key derivation kept across derivations
+struct arena_stats {
+    unsigned long maps;
+    unsigned long reuses;
+    unsigned long long bytes;
+    unsigned long long huge_bytes;
+    unsigned long long locked_bytes;
+    unsigned long long faults_saved;
+};
+
+// Files of a padding benchmark: count names of min_len to max_len bytes
+struct name_spec {
+    unsigned count;
+    unsigned min_len;
+    unsigned max_len;
+};
+
+// Parameters of an I/O benchmark of a decrypted vault, see iobench.c
+#define MAX_BLOCK_SIZES 8
+struct io_bench_spec {
+    const char *vault;
+    unsigned block_kib[MAX_BLOCK_SIZES];
+    size_t nblocks;
+    unsigned size_mib;
+    unsigned threads;
+    bool direct;
+    bool fsync;
+};
+
+// Timed phases of one traced operation, see trace.c
+#define TRACE_MAX_PHASES 256
+
+struct trace_phase {
+    const char *name;
+    unsigned long thread;
+    double start_us;
+    double end_us;
+};
+
+struct trace_record {
+    const char *op;
+    const char *path;
+    double total_us;
+    unsigned nphases;
+    unsigned dropped;
+    struct trace_phase phases[TRACE_MAX_PHASES];
+};
+
+// The phases are also static USDT probes e2crypt:<phase>__begin and
+// e2crypt:<phase>__end when built with <sys/sdt.h>
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name) DTRACE_PROBE(e2crypt, name)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(e2crypt, name, a, b)
+#else
+#define TRACE_PROBE(name) do { } while (0)
+#define TRACE_PROBE2(name, a, b) do { (void) (a); (void) (b); } while (0)
+#endif
+#define TRACE_BEGIN(phase) do { TRACE_PROBE(phase##__begin); trace_begin(#phase); } while (0)
+#define TRACE_END(phase) do { TRACE_PROBE(phase##__end); trace_end(#phase); } while (0)
+
+// Salsa20/8 BlockMix over lanes scrypt lanes interleaved row by row
+struct romix_kernel {
+    const char *name;
+    unsigned lanes;
+    bool (*supported)();
+    void (*blockmix)(const uint32_t *, uint32_t *, uint32_t);
+};
+
 int crypto_init();
 int container_status(const char *);
+int container_status_to(FILE *, const char *);
 int container_create(const char *);
 int container_attach(const char *);
 int container_detach(const char *);
+int container_policy(const char *, struct ext4_encryption_policy *);
+int vault_status(const char *, struct e2crypt_status *);
+int vault_policy(const char *, struct ext4_encryption_policy *);
+int vault_policy_fd(int, struct ext4_encryption_policy *, key_id_t *);
+int vault_key_status(const char *);
+int vault_key_status_fd(int, const struct ext4_encryption_policy *, key_id_t *, key_serial_t *);
+int vault_create(const char *, const struct ext4_encryption_policy *, const char *, size_t, unsigned,
+        struct ext4_encryption_key *);
+int vault_create_family(const char *, const struct ext4_encryption_policy *, const char *, const char *,
+        size_t, unsigned, struct ext4_encryption_key *);
+int vault_create_raw(const char *, const struct ext4_encryption_policy *, const struct ext4_encryption_key *,
+        struct ext4_encryption_key *);
+int vault_derive_key(const char *, const char *, size_t, unsigned, struct ext4_encryption_key *);
+int vault_attach_key(const char *, const struct ext4_encryption_key *);
+int vault_detach(const char *);
+int batch_attach(char **, size_t, unsigned);
+int batch_detach(char **, size_t);
+int agent_socket_path(char *, size_t);
+int agent_run(const char *, unsigned);
+int agent_request(const char *, char, const char *);
+int autolock_run(char **, size_t, unsigned, unsigned);
 void generate_random_name(char *, size_t, bool);
+void build_full_key_descriptor(key_desc_t *, full_key_desc_t *);
+key_serial_t vault_keyring(bool);
 int find_key_by_descriptor(key_desc_t *, key_serial_t *);
-int request_key_for_descriptor(key_desc_t *, bool);
+int request_key_for_descriptor(const char *, const struct ext4_encryption_policy *, const struct vault_meta *);
+ssize_t prompt_passphrase(const char *, bool, char *, size_t);
+int derive_passphrase_to_key(const char *, size_t, const struct kdf_params *,
+        struct ext4_encryption_key *, unsigned);
+int install_key_for_descriptor(key_desc_t *, const struct ext4_encryption_key *);
+int keycache_attach(const char *);
+int keycache_store(key_desc_t *, char, const struct ext4_encryption_key *);
+int keycache_flush();
+int derive_key_checked(key_desc_t *, const char *, size_t, const struct vault_meta *,
+        struct ext4_encryption_key *, unsigned);
+int family_secret(const char *, size_t, const struct vault_meta *, struct ext4_encryption_key *, unsigned);
+void family_key(const struct ext4_encryption_key *, const struct vault_meta *, struct ext4_encryption_key *);
+bool family_same(const struct vault_meta *, const struct vault_meta *);
+int derive_meta_key(const char *, size_t, const struct vault_meta *, struct ext4_encryption_key *, unsigned);
+void kdf_legacy_params(struct kdf_params *);
+bool kdf_params_sane(uint64_t, uint32_t, uint32_t);
+void kdf_host_params(struct kdf_params *);
+void kdf_vault_params(struct kdf_params *);
+int kdf_calibrate(unsigned, struct kdf_calibration *);
+int calibrate_host(unsigned);
+int vault_meta_read(const char *, struct vault_meta *);
+int vault_meta_write(int, const struct vault_meta *);
+void vault_verifier_set(struct vault_meta *, key_desc_t *, const struct ext4_encryption_key *);
+bool vault_verifier_check(const struct vault_meta *, key_desc_t *, const struct ext4_encryption_key *);
 int remove_key_for_descriptor(key_desc_t *);
+int lock_take(const char *, int);
+void lock_release(int);
+int lock_descriptor(const key_desc_t *, int);
+void lock_descriptors(key_desc_t *, size_t, int *);
+void vault_lock(const struct ext4_encryption_policy *, struct vault_lock *);
+void vault_unlock(struct vault_lock *);
+size_t remove_keys_for_descriptors(key_desc_t *, size_t, bool *);
+int keyring_quota_left(unsigned *, unsigned *);
 void error(bool, const char *, ...);
+int fail(int, const char *, ...);
+void error_set_handler(void (*)(bool, const char *));
+int walk_tree(const char *, const struct walk_ops *, struct walk_stats *);
+int scan_tree(const char *, unsigned);
+int ingest_tree(const char *, const char *, unsigned);
+int cache_invalidate_tree(const char *, struct cache_stats *);
+int cache_drop_global();
+int cache_drop_global_to(FILE *);
+void keyring_make_room(size_t);
+void keyring_make_room_to(FILE *, size_t);
+int cipher_bench(unsigned);
+int cipher_select(unsigned, char **, char **);
+int padding_bench(const char *, const struct name_spec *, size_t);
+int keyfile_read(const char *, struct ext4_encryption_key *);
+int keyfile_create(const char *, struct ext4_encryption_key *, bool *);
+int keyfile_attach(char **, size_t, const char *);
+int io_bench(const struct io_bench_spec *);
+int prewarm_vaults(char **, size_t, unsigned, unsigned long long, unsigned);
+void status_index_update(const char *);
+void status_index_update_batch(char **, size_t);
+int status_cached(char **, size_t);
+int flush_caches_for(const char *, const struct ext4_encryption_policy *);
+int flush_caches_to(FILE *, const char *, const struct ext4_encryption_policy *);
+int flush_caches_batch(char **, size_t);
+void warn_stale_v1(FILE *, size_t);
+unsigned available_cpus();
+unsigned long long available_memory();
+bool scrypt_params_ok(uint64_t, uint32_t, uint32_t);
+unsigned scrypt_threads(uint64_t, uint32_t, uint32_t);
+int scrypt_parallel(const uint8_t *, size_t, const uint8_t *, size_t,
+        uint64_t, uint32_t, uint32_t, unsigned, uint8_t *, size_t);
+void *arena_acquire(size_t);
+void arena_release(void *);
+void arena_trim();
+void arena_get_stats(struct arena_stats *);
+const struct romix_kernel *romix_kernel(unsigned);
+void romix_lanes(const struct romix_kernel *, uint8_t **, uint64_t, uint32_t, uint32_t **, uint32_t *);
+const struct romix_kernel *scrypt_kernel();
+int scrypt_use_kernel(const char *);
+void trace_enable(bool);
+bool trace_enabled();
+void trace_start(const char *, const char *);
+void trace_begin(const char *);
+void trace_end(const char *);
+const struct trace_record *trace_stop();
+void trace_report(FILE *);
+size_t json_string(char *, size_t, size_t, const char *);
 
 #endif
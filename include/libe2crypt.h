@@ -0,0 +1,113 @@
+// libe2crypt.h
+//
+// Manage ext4 encrypted directories (vaults) from a program without running
+// the e2crypt tool. All functions are reentrant and may be called from many
+// threads at once, on the same or on different vaults. Nothing is printed and
+// nothing is read from the terminal: passphrases and keys come from buffers
+// owned by the caller, which the library never keeps.
+//
+// Functions return E2CRYPT_OK or a negative enum e2crypt_error code;
+// e2crypt_last_error() describes the last failure of the calling thread.
+
+#ifndef LIBE2CRYPT_H
+#define LIBE2CRYPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define E2CRYPT_API __attribute__((visibility("default")))
+#else
+#define E2CRYPT_API
+#endif
+
+#define E2CRYPT_KEY_MAX 64
+#define E2CRYPT_DESCRIPTOR_SZ 8
+#define E2CRYPT_IDENTIFIER_SZ 16
+
+enum e2crypt_error {
+    E2CRYPT_OK = 0,
+    E2CRYPT_ERR_SYSTEM = -1,            // A system call failed, errno tells why
+    E2CRYPT_ERR_INVALID = -2,           // Invalid argument
+    E2CRYPT_ERR_NOT_EXT4 = -3,          // Not on an ext4 filesystem
+    E2CRYPT_ERR_UNSUPPORTED = -4,       // Filesystem or kernel without encryption
+    E2CRYPT_ERR_NOT_ENCRYPTED = -5,     // Regular directory
+    E2CRYPT_ERR_ENCRYPTED = -6,         // Already encrypted
+    E2CRYPT_ERR_NOT_EMPTY = -7,         // Only empty directories can be encrypted
+    E2CRYPT_ERR_WRONG_PASSPHRASE = -8,  // Rejected by the verifier of the vault
+    E2CRYPT_ERR_NO_KEY = -9,            // Key of the vault not in the keyring
+    E2CRYPT_ERR_KEYRING = -10,          // Keyring refused the key
+    E2CRYPT_ERR_CRYPTO = -11,           // Cryptography library failed
+    E2CRYPT_ERR_METADATA = -12,         // Vault metadata unreadable or unwritable
+    E2CRYPT_ERR_BUSY = -13,             // Key removed, but files of the vault still open
+    E2CRYPT_ERR_QUOTA = -14,            // Key quota of the user reached
+};
+
+// Settings of a new vault; zero or NULL fields take the defaults
+struct e2crypt_options {
+    const char *contents_cipher;        // Default "aes-256-xts", or "aes-128-cbc", "adiantum"...
+    const char *filenames_cipher;       // Default: the one paired with the contents cipher
+    unsigned padding;                   // Filename padding 4, 8, 16 or 32, default 4
+    unsigned kdf_threads;               // Default: as many as CPU and memory limits allow
+    unsigned policy_version;            // 1 or 2, default 2 when the kernel supports it
+};
+
+// State of a directory
+struct e2crypt_status {
+    bool encrypted;                     // The other fields are only set when true
+    int policy_version;                 // As the kernel reports it: 0 for v1, 2 for v2
+    const char *contents_cipher;
+    const char *filenames_cipher;
+    unsigned padding;
+    uint8_t descriptor[E2CRYPT_DESCRIPTOR_SZ];     // Policy version 1
+    uint8_t identifier[E2CRYPT_IDENTIFIER_SZ];     // Policy version 2
+    bool key_present;                   // Key usable: v1 in the e2crypt keyring with serial
+    int32_t key_serial;                 // key_serial, v2 on the filesystem
+    bool key_busy;                      // v2 key removed while files were still open
+    bool legacy_kdf;                    // Created before KDF parameters were recorded
+    uint64_t kdf_n;
+    uint32_t kdf_r;
+    uint32_t kdf_p;
+    bool verifier;                      // Wrong passphrases are detected
+};
+
+// Initialize the cryptography library; the other functions do so when needed
+E2CRYPT_API int e2crypt_init(void);
+
+// Describe an error code, or the last failure of the calling thread in detail
+E2CRYPT_API const char *e2crypt_strerror(int error);
+E2CRYPT_API const char *e2crypt_last_error(void);
+
+// Read the state of the directory at path
+E2CRYPT_API int e2crypt_status(const char *path, struct e2crypt_status *status);
+
+// Encrypt the empty directory at path with a key derived from the passphrase
+// and add the key to the keyring; options may be NULL
+E2CRYPT_API int e2crypt_create(const char *path, const char *pass, size_t pass_sz,
+        const struct e2crypt_options *options);
+
+// Derive the key of the vault at path from the passphrase into key, which
+// holds *key_sz bytes; on return *key_sz is the size of the key
+E2CRYPT_API int e2crypt_derive_key(const char *path, const char *pass, size_t pass_sz,
+        unsigned threads, uint8_t *key, size_t *key_sz);
+
+// Decrypt the vault at path with a passphrase or an already derived key
+E2CRYPT_API int e2crypt_attach(const char *path, const char *pass, size_t pass_sz, unsigned threads);
+E2CRYPT_API int e2crypt_attach_key(const char *path, const uint8_t *key, size_t key_sz);
+
+// Remove the key of the vault at path from the keyring
+E2CRYPT_API int e2crypt_detach(const char *path);
+
+// Evict the cached pages of the files below path; pages may be NULL
+E2CRYPT_API int e2crypt_evict(const char *path, uint64_t *pages);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,485 @@
+// agent.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define AGENT_MAX_KEYS 256
+#define AGENT_LINE_SZ (PATH_MAX + 16)
+#define AGENT_TIMEOUT 120
+
+// A derived key held by the agent until it expires
+struct agent_key {
+    bool used;
+    time_t expires;
+    key_desc_t descriptor;
+    struct ext4_encryption_key key;
+};
+
+static struct agent_key *agent_keys;
+static unsigned agent_ttl;
+static pthread_mutex_t agent_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t agent_stop;
+
+// Default socket: $XDG_RUNTIME_DIR/e2crypt.sock, else a private directory in /tmp
+// Return -1 when the directory in /tmp is not one of the user with mode 0700,
+// as whoever owns it could replace the socket
+int agent_socket_path(char *path, size_t n)
+{
+    const char *env = getenv("E2CRYPT_AGENT_SOCK");
+    if (env && *env) {
+        snprintf(path, n, "%s", env);
+        return 0;
+    }
+
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime) {
+        snprintf(path, n, "%s/%s.sock", runtime, NAME);
+        return 0;
+    }
+
+    struct stat st;
+    snprintf(path, n, "/tmp/%s-%u", NAME, (unsigned) getuid());
+    if ((mkdir(path, S_IRWXU) != 0 && errno != EEXIST) || lstat(path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+            st.st_uid != getuid() || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+        return -1;
+    snprintf(path + strlen(path), n - strlen(path), "/agent.sock");
+    return 0;
+}
+
+// Wipe keys whose time is up; agent_lock must be held
+static
+void agent_expire()
+{
+    time_t now = time(NULL);
+    for (int i = 0; i < AGENT_MAX_KEYS; i++)
+        if (agent_keys[i].used && agent_keys[i].expires <= now)
+            sodium_memzero(&agent_keys[i], sizeof(agent_keys[i]));
+}
+
+// Find the cached key of a descriptor; agent_lock must be held
+static
+struct agent_key *agent_lookup(key_desc_t *key_desc)
+{
+    agent_expire();
+    for (int i = 0; i < AGENT_MAX_KEYS; i++)
+        if (agent_keys[i].used &&
+                memcmp(agent_keys[i].descriptor, *key_desc, sizeof(key_desc_t)) == 0)
+            return &agent_keys[i];
+    return NULL;
+}
+
+// Cache a key for a descriptor, replacing an older one; agent_lock must be held
+static
+void agent_store(key_desc_t *key_desc, const struct ext4_encryption_key *key)
+{
+    struct agent_key *slot = agent_lookup(key_desc);
+    for (int i = 0; !slot && i < AGENT_MAX_KEYS; i++)
+        if (!agent_keys[i].used) slot = &agent_keys[i];
+
+    // Full: evict the key that expires first
+    if (!slot) {
+        slot = &agent_keys[0];
+        for (int i = 1; i < AGENT_MAX_KEYS; i++)
+            if (agent_keys[i].expires < slot->expires) slot = &agent_keys[i];
+    }
+
+    slot->used = true;
+    slot->expires = time(NULL) + agent_ttl;
+    memcpy(slot->descriptor, *key_desc, sizeof(key_desc_t));
+    memcpy(&slot->key, key, sizeof(*key));
+}
+
+// Read one newline-terminated line from a socket
+static
+ssize_t read_line(int fd, char *line, size_t n)
+{
+    size_t len = 0;
+    while (len + 1 < n) {
+        ssize_t got = read(fd, &line[len], 1);
+        if (got <= 0) return -1;
+        if (line[len] == '\n') break;
+        len++;
+    }
+    line[len] = 0;
+    return len;
+}
+
+// Send a formatted line over a socket
+static
+void send_line(int fd, const char *fmt, ...)
+{
+    char line[AGENT_LINE_SZ + 64];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line) - 1, fmt, args);
+    va_end(args);
+    if (len < 0) return;
+    if ((size_t) len > sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    if (write(fd, line, len) != len) return;
+}
+
+// Send the lines of a text written to a memory stream over a socket, and free it
+static
+void send_text(int fd, char *text)
+{
+    char *save;
+    for (char *line = text ? strtok_r(text, "\n", &save) : NULL; line; line = strtok_r(NULL, "\n", &save))
+        send_line(fd, "> %s", line);
+    free(text);
+}
+
+// Serve an attach request, asking the client for a passphrase when no key is cached
+static
+void agent_attach(int fd, const char *dir_path)
+{
+    struct ext4_encryption_policy policy;
+    struct vault_meta meta;
+    if (container_policy(dir_path, &policy) != 0 || vault_meta_read(dir_path, &meta) < 0) {
+        send_line(fd, "ERR Cannot decrypt: %s not an encrypted directory", dir_path);
+        return;
+    }
+    if (meta.flags & VAULT_META_KEYFILE) {
+        send_line(fd, "ERR Cannot decrypt: %s is bound to a key file", dir_path);
+        return;
+    }
+
+    struct ext4_encryption_key *key = sodium_malloc(sizeof(*key));
+    if (!key) {
+        send_line(fd, "ERR Out of memory");
+        return;
+    }
+
+    pthread_mutex_lock(&agent_lock);
+    struct agent_key *cached = agent_lookup(&policy.master_key_descriptor);
+    if (cached) memcpy(key, &cached->key, sizeof(*key));
+    pthread_mutex_unlock(&agent_lock);
+
+    if (!cached) {
+        char *passphrase = sodium_malloc(EXT4_MAX_PASSPHRASE_SZ + 2);
+        int ret, retries = 3;
+
+        // A key the vault's verifier rejects is not attached: ask the client again
+        do {
+            send_line(fd, "PASS");
+            ssize_t pass_sz = passphrase ? read_line(fd, passphrase, EXT4_MAX_PASSPHRASE_SZ + 2) : -1;
+
+            memset(key, 0, sizeof(*key));
+            key->size = policy_key_size(&policy);
+            ret = (pass_sz > 0) ? derive_meta_key(passphrase, pass_sz, &meta, key, 0) : -1;
+            if (ret == 0 && !vault_verifier_check(&meta, &policy.master_key_descriptor, key)) {
+                ret = -2;
+                if (retries > 1) send_line(fd, "> Wrong passphrase");
+            }
+        } while (ret == -2 && --retries > 0);
+        sodium_free(passphrase);
+
+        if (ret == -2) {
+            send_line(fd, "ERR Wrong passphrase for %s", dir_path);
+            sodium_free(key);
+            return;
+        }
+        if (ret < 0) {
+            send_line(fd, "ERR Cannot derive key for %s", dir_path);
+            sodium_free(key);
+            return;
+        }
+    }
+
+    // The vault lock of the descriptor orders runs on the same vault, other
+    // requests go on meanwhile; what the run reports goes to the client
+    char *text = NULL;
+    size_t text_sz = 0;
+    FILE *out = open_memstream(&text, &text_sz);
+    if (out) keyring_make_room_to(out, 1);
+    int ret = vault_attach_key(dir_path, key);
+    if (ret == 0) {
+        status_index_update(dir_path);
+        pthread_mutex_lock(&agent_lock);
+        agent_store(&policy.master_key_descriptor, key);
+        pthread_mutex_unlock(&agent_lock);
+    }
+    sodium_free(key);
+    if (out) fclose(out);
+    send_text(fd, text);
+
+    if (ret < 0) send_line(fd, "ERR Error in decrypting directory %s: %s", dir_path, e2crypt_strerror(ret));
+    else send_line(fd, "OK Directory %s now decrypted%s", dir_path, cached ? " (cached key)" : "");
+}
+
+// Serve a detach request, flushing the caches of the vault afterwards
+static
+void agent_detach(int fd, const char *dir_path)
+{
+    struct ext4_encryption_policy policy;
+    if (container_policy(dir_path, &policy) != 0) {
+        send_line(fd, "ERR Cannot recrypt: %s not an encrypted directory", dir_path);
+        return;
+    }
+
+    int ret = vault_detach(dir_path);
+    if (ret < 0) {
+        send_line(fd, "ERR Cannot recrypt directory %s: %s", dir_path, e2crypt_strerror(ret));
+        return;
+    }
+    status_index_update(dir_path);
+
+    char *text = NULL;
+    size_t text_sz = 0;
+    FILE *out = open_memstream(&text, &text_sz);
+    send_line(fd, "> Directory %s now recrypted", dir_path);
+    if (out) {
+        flush_caches_to(out, dir_path, &policy);
+        warn_stale_v1(out, policy.version != EXT4_POLICY_V2);
+        fclose(out);
+    }
+    send_text(fd, text);
+    send_line(fd, "OK");
+}
+
+// Serve a status request: the status text plus how long the key stays cached
+static
+void agent_status(int fd, const char *dir_path)
+{
+    char *text = NULL;
+    size_t text_sz = 0;
+    FILE *out = open_memstream(&text, &text_sz);
+    if (!out) {
+        send_line(fd, "ERR Out of memory");
+        return;
+    }
+
+    int ret = container_status_to(out, dir_path);
+    fclose(out);
+    send_text(fd, text);
+
+    struct ext4_encryption_policy policy;
+    if (ret == 0 && container_policy(dir_path, &policy) == 0) {
+        pthread_mutex_lock(&agent_lock);
+        struct agent_key *cached = agent_lookup(&policy.master_key_descriptor);
+        long left = cached ? (long) (cached->expires - time(NULL)) : -1;
+        pthread_mutex_unlock(&agent_lock);
+
+        if (left >= 0) send_line(fd, "> Agent key cache:    %lds left", left);
+        else send_line(fd, "> Agent key cache:    [not cached]");
+    }
+
+    if (ret == 0) send_line(fd, "OK");
+    else send_line(fd, "ERR");
+}
+
+// Handle one client connection: a single request per connection
+static
+void *agent_serve(void *arg)
+{
+    int fd = (int) (long) arg;
+
+    struct ucred cred;
+    socklen_t cred_sz = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_sz) != 0 || cred.uid != getuid()) {
+        send_line(fd, "ERR Permission denied");
+        close(fd);
+        return NULL;
+    }
+
+    struct timeval timeout = { .tv_sec = AGENT_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char line[AGENT_LINE_SZ];
+    if (read_line(fd, line, sizeof(line)) <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    char *dir_path = strchr(line, ' ');
+    if (dir_path) *dir_path++ = 0;
+
+    if (!dir_path || *dir_path != '/') send_line(fd, "ERR Invalid request");
+    else if (strcmp(line, "attach") == 0) agent_attach(fd, dir_path);
+    else if (strcmp(line, "status") == 0) agent_status(fd, dir_path);
+    else if (strcmp(line, "detach") == 0) agent_detach(fd, dir_path);
+    else send_line(fd, "ERR Unknown request %s", line);
+
+    close(fd);
+    return NULL;
+}
+
+static
+void agent_signal(int sig)
+{
+    (void) sig;
+    agent_stop = 1;
+}
+
+// Run the agent: serve attach/detach/status requests on a Unix socket,
+// keeping derived keys in locked memory for ttl seconds
+int agent_run(const char *sock_path, unsigned ttl)
+{
+    if (crypto_init() == -1) {
+        error(0, "Cannot access cryptography system");
+        return -1;
+    }
+
+    // sodium_allocarray memory is mlock'd and guarded, the process is not dumpable
+    agent_keys = sodium_allocarray(AGENT_MAX_KEYS, sizeof(*agent_keys));
+    if (!agent_keys) {
+        error(0, "Cannot allocate locked memory for keys");
+        return -1;
+    }
+    memset(agent_keys, 0, AGENT_MAX_KEYS * sizeof(*agent_keys));
+    agent_ttl = ttl;
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(sock_path) >= sizeof(addr.sun_path)) {
+        error(0, "Socket path too long: %s", sock_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, sock_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        error(0, "Cannot create socket: %s", strerror(errno));
+        return -1;
+    }
+
+    // Replace a stale socket, but not one a running agent still listens on
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+        error(0, "Agent already running on %s", sock_path);
+        close(sock);
+        return -1;
+    }
+    unlink(sock_path);
+
+    mode_t old_umask = umask(S_IRWXG | S_IRWXO);
+    int ret = bind(sock, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_umask);
+    if (ret != 0 || listen(sock, 16) != 0) {
+        error(0, "Cannot listen on %s: %s", sock_path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_handler = agent_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("Agent listening on %s, keys cached for %us\n", sock_path, ttl);
+    fflush(stdout);
+
+    while (!agent_stop) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        if (poll(&pfd, 1, 1000) <= 0) {
+            pthread_mutex_lock(&agent_lock);
+            agent_expire();
+            pthread_mutex_unlock(&agent_lock);
+            continue;
+        }
+
+        int fd = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) continue;
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, agent_serve, (void *) (long) fd) != 0) {
+            send_line(fd, "ERR Agent busy");
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    close(sock);
+    unlink(sock_path);
+
+    pthread_mutex_lock(&agent_lock);
+    sodium_free(agent_keys);
+    agent_keys = NULL;
+    printf("Agent stopped, keys wiped\n");
+    return 0;
+}
+
+// Send one request to the agent and relay its answer
+// Return -2 when no agent is listening on sock_path
+int agent_request(const char *sock_path, char command, const char *dir_path)
+{
+    char abs_path[PATH_MAX];
+    if (!realpath(dir_path, abs_path)) {
+        error(0, "Cannot resolve %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+    if (strchr(abs_path, '\n')) {
+        error(0, "Cannot pass %s to the agent", dir_path);
+        return -1;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sock_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        if (fd != -1) close(fd);
+        return -2;
+    }
+
+    // The passphrase only goes to an agent of the same user
+    struct ucred cred;
+    socklen_t cred_sz = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_sz) != 0 || cred.uid != getuid()) {
+        error(0, "Agent on %s does not run as this user", sock_path);
+        close(fd);
+        return -1;
+    }
+
+    const char *request = (command == 'd') ? "attach" : (command == 'e') ? "detach" : "status";
+    send_line(fd, "%s %s", request, abs_path);
+
+    int ret = -1;
+    char line[AGENT_LINE_SZ + 64];
+    while (read_line(fd, line, sizeof(line)) >= 0) {
+        if (strncmp(line, "> ", 2) == 0) {
+            printf("%s\n", line + 2);
+        }
+        else if (strcmp(line, "PASS") == 0) {
+            char passphrase[EXT4_MAX_PASSPHRASE_SZ];
+            ssize_t pass_sz = prompt_passphrase("Enter passphrase: ", false,
+                    passphrase, sizeof(passphrase));
+            if (pass_sz < 0) break;
+            passphrase[pass_sz] = '\n';
+            ssize_t sent = write(fd, passphrase, pass_sz + 1);
+            sodium_memzero(passphrase, sizeof(passphrase));
+            if (sent != pass_sz + 1) break;
+        }
+        else if (strncmp(line, "OK", 2) == 0) {
+            if (line[2]) printf("%s\n", line + 3);
+            ret = 0;
+            break;
+        }
+        else {
+            if (line[3]) error(0, "%s", line + 4);
+            ret = (command == 0) ? 1 : -1;
+            break;
+        }
+    }
+
+    close(fd);
+    return ret;
+}
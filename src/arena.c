@@ -0,0 +1,165 @@
+// arena.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define ARENA_HUGE_PAGE (2UL << 20)
+#define ARENA_SMALL_PAGE 4096UL
+// Idle scratch memory kept for later derivations, beyond it regions are unmapped
+#define ARENA_KEEP (256ULL << 20)
+
+// Scratch memory of the key derivation: mapped once, faulted in up front,
+// locked when the limits allow, and handed out again to later derivations
+struct arena_region {
+    uint8_t *base;
+    size_t size;
+    size_t used;
+    bool busy;
+    bool huge;
+    bool locked;
+    struct arena_region *next;
+};
+
+static struct arena_region *regions;
+static struct arena_stats totals;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Map size bytes, from reserved huge pages if there are any, otherwise
+// from normal pages that the kernel may back by transparent huge pages
+static
+struct arena_region *arena_map(size_t size)
+{
+    struct arena_region *region = calloc(1, sizeof(*region));
+    if (!region) return NULL;
+
+    size = (size + ARENA_HUGE_PAGE - 1) & ~(ARENA_HUGE_PAGE - 1);
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    region->huge = (base != MAP_FAILED);
+
+    if (base == MAP_FAILED) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            free(region);
+            return NULL;
+        }
+        madvise(base, size, MADV_HUGEPAGE);
+        // Fault the pages in now rather than 4 KiB at a time inside ROMix
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(base, size, MADV_POPULATE_WRITE) != 0)
+#endif
+            memset(base, 0, size);
+    }
+
+    // Keep derived state out of swap and core dumps; without the privilege
+    // or the RLIMIT_MEMLOCK for it the region is still used, just not locked
+    region->locked = (mlock(base, size) == 0);
+    madvise(base, size, MADV_DONTDUMP);
+
+    region->base = base;
+    region->size = size;
+    return region;
+}
+
+// Get at least size bytes of scratch memory, aligned to 64 bytes
+void *arena_acquire(size_t size)
+{
+    pthread_mutex_lock(&arena_lock);
+
+    // Smallest free region that is large enough
+    struct arena_region *best = NULL;
+    for (struct arena_region *region = regions; region; region = region->next)
+        if (!region->busy && region->size >= size && (!best || region->size < best->size))
+            best = region;
+
+    if (best) {
+        totals.reuses++;
+        totals.faults_saved += (size + ARENA_SMALL_PAGE - 1) / ARENA_SMALL_PAGE;
+    }
+    else if ((best = arena_map(size))) {
+        best->next = regions;
+        regions = best;
+        totals.maps++;
+        totals.bytes += best->size;
+        if (best->huge) totals.huge_bytes += best->size;
+        if (best->locked) totals.locked_bytes += best->size;
+    }
+
+    if (best) {
+        best->busy = true;
+        best->used = size;
+    }
+    pthread_mutex_unlock(&arena_lock);
+    return best ? best->base : NULL;
+}
+
+// Unlink and unmap a region, with arena_lock held
+static
+void arena_unmap(struct arena_region **link)
+{
+    struct arena_region *region = *link;
+    *link = region->next;
+    totals.bytes -= region->size;
+    if (region->huge) totals.huge_bytes -= region->size;
+    if (region->locked) totals.locked_bytes -= region->size;
+    munmap(region->base, region->size);
+    free(region);
+}
+
+// Wipe the scratch memory at base and hand it to the next derivation
+void arena_release(void *base)
+{
+    if (!base) return;
+
+    pthread_mutex_lock(&arena_lock);
+    struct arena_region *found = NULL;
+    for (struct arena_region *region = regions; region; region = region->next)
+        if (region->base == base) found = region;
+    pthread_mutex_unlock(&arena_lock);
+    if (!found) return;
+
+    // The region stays busy while it is wiped, so other threads need not wait
+    sodium_memzero(found->base, found->used);
+
+    pthread_mutex_lock(&arena_lock);
+    found->busy = false;
+    unsigned long long idle = 0;
+    struct arena_region **link = &regions;
+    while (*link) {
+        if (!(*link)->busy && (idle += (*link)->size) > ARENA_KEEP) arena_unmap(link);
+        else link = &(*link)->next;
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
+
+// Unmap the scratch memory nobody uses
+void arena_trim()
+{
+    pthread_mutex_lock(&arena_lock);
+    struct arena_region **link = &regions;
+    while (*link) {
+        if ((*link)->busy) link = &(*link)->next;
+        else arena_unmap(link);
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
+
+void arena_get_stats(struct arena_stats *stats)
+{
+    pthread_mutex_lock(&arena_lock);
+    *stats = totals;
+    pthread_mutex_unlock(&arena_lock);
+}
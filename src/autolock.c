@@ -0,0 +1,436 @@
+// autolock.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#ifndef FAN_MARK_EVICTABLE
+#define FAN_MARK_EVICTABLE 0x00000200
+#endif
+
+#define AUTOLOCK_BUCKETS 4096
+#define AUTOLOCK_HANDLE_MAX 128
+// Seconds between checks for vaults decrypted or recrypted by hand
+#define AUTOLOCK_POLL 5
+#define AUTOLOCK_EVENTS (FAN_ACCESS | FAN_MODIFY | FAN_OPEN | FAN_CLOSE | FAN_CREATE | FAN_MOVED_TO \
+        | FAN_ONDIR | FAN_EVENT_ON_CHILD)
+
+// A marked directory, found again by the filesystem id and handle events carry
+struct autolock_dir {
+    unsigned char id[sizeof(fsid_t) + sizeof(struct file_handle) + AUTOLOCK_HANDLE_MAX];
+    size_t id_sz;
+    size_t vault;
+    char *path;
+    struct autolock_dir *next;
+};
+
+struct autolock_vault {
+    const char *path;
+    bool watched;
+    bool locking;
+    double last_access;
+};
+
+struct autolock_state {
+    int fan;
+    unsigned mark_flags;
+    unsigned threads;
+    struct autolock_vault *vaults;
+    size_t nvaults;
+    size_t marking;
+    struct autolock_dir *buckets[AUTOLOCK_BUCKETS];
+    pthread_mutex_t lock;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static
+void autolock_stop(int sig)
+{
+    (void) sig;
+    stopping = 1;
+}
+
+// Time that includes suspend, so a vault left over a suspend counts as idle
+static
+double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+unsigned id_hash(const unsigned char *id, size_t id_sz)
+{
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < id_sz; i++) h = (h ^ id[i]) * 16777619u;
+    return h % AUTOLOCK_BUCKETS;
+}
+
+// Find a marked directory by id, with state->lock held
+static
+struct autolock_dir *autolock_find(struct autolock_state *state, const unsigned char *id, size_t id_sz)
+{
+    struct autolock_dir *dir = state->buckets[id_hash(id, id_sz)];
+    while (dir && (dir->id_sz != id_sz || memcmp(dir->id, id, id_sz) != 0)) dir = dir->next;
+    return dir;
+}
+
+// Walk callback: mark a directory of the vault being marked and remember its id
+static
+int autolock_mark_dir(int dirfd, const char *path, unsigned depth, void *arg)
+{
+    (void) depth;
+    struct autolock_state *state = arg;
+
+    struct {
+        struct file_handle fh;
+        unsigned char bytes[AUTOLOCK_HANDLE_MAX];
+    } handle = { .fh.handle_bytes = AUTOLOCK_HANDLE_MAX };
+    int mount_id;
+    struct statfs fs;
+    if (fstatfs(dirfd, &fs) != 0 || name_to_handle_at(dirfd, "", &handle.fh, &mount_id, AT_EMPTY_PATH) != 0)
+        return 0;
+    if (fanotify_mark(state->fan, FAN_MARK_ADD | state->mark_flags, AUTOLOCK_EVENTS, dirfd, NULL) != 0)
+        return 0;
+
+    struct autolock_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir || !(dir->path = strdup(path))) {
+        free(dir);
+        return 0;
+    }
+    memcpy(dir->id, &fs.f_fsid, sizeof(fsid_t));
+    memcpy(dir->id + sizeof(fsid_t), &handle, sizeof(struct file_handle) + handle.fh.handle_bytes);
+    dir->id_sz = sizeof(fsid_t) + sizeof(struct file_handle) + handle.fh.handle_bytes;
+    dir->vault = state->marking;
+
+    pthread_mutex_lock(&state->lock);
+    struct autolock_dir *known = autolock_find(state, dir->id, dir->id_sz);
+    if (known) {
+        known->vault = dir->vault;
+        free(known->path);
+        known->path = dir->path;
+        free(dir);
+    }
+    else {
+        unsigned h = id_hash(dir->id, dir->id_sz);
+        dir->next = state->buckets[h];
+        state->buckets[h] = dir;
+    }
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+// Mark every directory of the tree at path as part of vault v
+static
+void autolock_mark_tree(struct autolock_state *state, size_t v, const char *path)
+{
+    struct walk_ops ops = {
+        .dir = autolock_mark_dir,
+        .arg = state,
+        .threads = state->threads,
+    };
+    struct walk_stats stats;
+    state->marking = v;
+    walk_tree(path, &ops, &stats);
+}
+
+// Forget all marks and start over with a new group; without evictable marks
+// the kernel holds the marked inodes, which would keep a recrypted vault cached
+static
+int autolock_reset(struct autolock_state *state)
+{
+    if (state->fan != -1) close(state->fan);
+    for (size_t h = 0; h < AUTOLOCK_BUCKETS; h++) {
+        while (state->buckets[h]) {
+            struct autolock_dir *dir = state->buckets[h];
+            state->buckets[h] = dir->next;
+            free(dir->path);
+            free(dir);
+        }
+    }
+
+    state->fan = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY);
+    if (state->fan == -1) {
+        error(0, "Cannot watch vaults: %s (fanotify needs kernel 5.13, or 5.9 as root)", strerror(errno));
+        return -1;
+    }
+
+    for (size_t v = 0; v < state->nvaults; v++)
+        if (state->vaults[v].watched) autolock_mark_tree(state, v, state->vaults[v].path);
+    return 0;
+}
+
+// Is a file of the vault at path open, or the working directory of a process
+static
+bool autolock_in_use(const char *path)
+{
+    size_t len = strlen(path);
+    DIR *proc = opendir("/proc");
+    if (!proc) return false;
+
+    bool used = false;
+    struct dirent *pid;
+    while (!used && (pid = readdir(proc))) {
+        if (pid->d_name[0] < '1' || pid->d_name[0] > '9') continue;
+
+        char link[PATH_MAX], target[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/%s/cwd", pid->d_name);
+        ssize_t n = readlink(link, target, sizeof(target) - 1);
+        if (n > 0 && (size_t) n >= len && strncmp(target, path, len) == 0
+                && (target[len] == '/' || (size_t) n == len))
+            used = true;
+
+        snprintf(link, sizeof(link), "/proc/%s/fd", pid->d_name);
+        DIR *fds = opendir(link);
+        struct dirent *fd;
+        while (fds && !used && (fd = readdir(fds))) {
+            if (fd->d_name[0] == '.') continue;
+            char fd_link[PATH_MAX + 300];
+            snprintf(fd_link, sizeof(fd_link), "%s/%s", link, fd->d_name);
+            n = readlink(fd_link, target, sizeof(target) - 1);
+            if (n > 0 && (size_t) n >= len && strncmp(target, path, len) == 0
+                    && (target[len] == '/' || (size_t) n == len))
+                used = true;
+        }
+        if (fds) closedir(fds);
+    }
+
+    closedir(proc);
+    return used;
+}
+
+// Note the access an event reports, and mark directories created or moved into a vault
+static
+void autolock_read_events(struct autolock_state *state, double now)
+{
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    ssize_t len;
+    while ((len = read(state->fan, buf, sizeof(buf))) > 0) {
+        struct fanotify_event_metadata *m = (struct fanotify_event_metadata *) buf;
+        for (; FAN_EVENT_OK(m, len); m = FAN_EVENT_NEXT(m, len)) {
+            // Events were lost: any vault may have been used
+            if (m->mask & FAN_Q_OVERFLOW) {
+                for (size_t v = 0; v < state->nvaults; v++) state->vaults[v].last_access = now;
+                continue;
+            }
+            // The walks of autolock_reset read the vaults too, which is no use of them
+            if (m->pid == getpid()) continue;
+            if (m->event_len < sizeof(*m) + sizeof(struct fanotify_event_info_fid)) continue;
+
+            struct fanotify_event_info_fid *info = (struct fanotify_event_info_fid *) (m + 1);
+            if (info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME
+                    && info->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+                continue;
+            struct file_handle *fh = (struct file_handle *) info->handle;
+            if (fh->handle_bytes > AUTOLOCK_HANDLE_MAX) continue;
+
+            unsigned char id[sizeof(fsid_t) + sizeof(struct file_handle) + AUTOLOCK_HANDLE_MAX];
+            size_t id_sz = sizeof(fsid_t) + sizeof(struct file_handle) + fh->handle_bytes;
+            memcpy(id, &info->fsid, sizeof(fsid_t));
+            memcpy(id + sizeof(fsid_t), fh, sizeof(struct file_handle) + fh->handle_bytes);
+
+            pthread_mutex_lock(&state->lock);
+            struct autolock_dir *dir = autolock_find(state, id, id_sz);
+            size_t v = dir ? dir->vault : 0;
+            char *sub = NULL;
+            const char *name = (const char *) fh->f_handle + fh->handle_bytes;
+            if (dir && (m->mask & (FAN_CREATE | FAN_MOVED_TO)) && (m->mask & FAN_ONDIR)
+                    && info->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME
+                    && asprintf(&sub, "%s/%s", dir->path, name) < 0)
+                sub = NULL;
+            pthread_mutex_unlock(&state->lock);
+
+            if (!dir) continue;
+            state->vaults[v].last_access = now;
+            if (sub) autolock_mark_tree(state, v, sub);
+            free(sub);
+        }
+    }
+}
+
+// Start watching vaults decrypted since the last check, stop watching those
+// recrypted by hand
+static
+void autolock_poll(struct autolock_state *state, double now)
+{
+    bool reset = false;
+    for (size_t v = 0; v < state->nvaults; v++) {
+        struct autolock_vault *vault = &state->vaults[v];
+        bool present = (vault_key_status(vault->path) == EXT4_KEY_STATUS_PRESENT);
+
+        if (present && !vault->watched) {
+            vault->watched = true;
+            vault->last_access = now;
+            autolock_mark_tree(state, v, vault->path);
+            printf("Watching %s\n", vault->path);
+        }
+        else if (!present && vault->watched) {
+            vault->watched = false;
+            reset = true;
+            printf("Directory %s was recrypted\n", vault->path);
+        }
+    }
+
+    if (reset && !(state->mark_flags & FAN_MARK_EVICTABLE)) autolock_reset(state);
+    fflush(stdout);
+}
+
+// Recrypt all vaults idle by now, and invalidate the caches once for all of them
+static
+void autolock_lock(struct autolock_state *state, double now, unsigned idle)
+{
+    char **done = calloc(state->nvaults, sizeof(*done));
+    size_t nlocked = 0, ndone = 0;
+
+    for (size_t v = 0; v < state->nvaults; v++) {
+        struct autolock_vault *vault = &state->vaults[v];
+        if (!vault->watched || now < vault->last_access + idle) continue;
+
+        if (autolock_in_use(vault->path)) {
+            vault->last_access = now;
+            continue;
+        }
+        vault->watched = false;
+        vault->locking = true;
+        nlocked++;
+    }
+    if (nlocked == 0) {
+        free(done);
+        return;
+    }
+
+    // The marks go before the keys, so that nothing holds the inodes of the vaults
+    if (!(state->mark_flags & FAN_MARK_EVICTABLE)) {
+        close(state->fan);
+        state->fan = -1;
+    }
+
+    for (size_t v = 0; v < state->nvaults; v++) {
+        struct autolock_vault *vault = &state->vaults[v];
+        if (!vault->locking) continue;
+        vault->locking = false;
+
+        struct ext4_encryption_policy policy;
+        if (vault_policy(vault->path, &policy) < 0 || vault_key_status(vault->path) != EXT4_KEY_STATUS_PRESENT)
+            continue;
+        int ret = vault_detach(vault->path);
+        if (ret < 0 && ret != E2CRYPT_ERR_BUSY) continue;
+
+        status_index_update(vault->path);
+        printf("Directory %s idle for %us, now recrypted\n", vault->path, idle);
+        // The kernel evicts v2 vaults itself, see flush_caches_for
+        if (done && (policy.version != EXT4_POLICY_V2 || drop_caches)) done[ndone++] = (char *) vault->path;
+    }
+
+    flush_caches_batch(done, ndone);
+    warn_stale_v1(stderr, ndone);
+    fflush(stdout);
+    free(done);
+
+    if (state->fan == -1) autolock_reset(state);
+}
+
+// Watch the vaults at paths and recrypt each after idle seconds without access
+// Vaults that become idle within the same window are recrypted together, with
+// one cache invalidation; vaults decrypted later are picked up as they come
+int autolock_run(char **paths, size_t n, unsigned idle, unsigned threads)
+{
+    struct autolock_state state = { .fan = -1, .threads = threads, .nvaults = n };
+    state.vaults = calloc(n, sizeof(*state.vaults));
+    if (!state.vaults) {
+        error(0, "Cannot allocate memory for %zu vaults", n);
+        return -1;
+    }
+    for (size_t v = 0; v < n; v++) {
+        struct ext4_encryption_policy policy;
+        if (vault_policy(paths[v], &policy) < 0) {
+            free(state.vaults);
+            return -1;
+        }
+        state.vaults[v].path = paths[v];
+    }
+    pthread_mutex_init(&state.lock, NULL);
+
+    if (autolock_reset(&state) < 0) {
+        pthread_mutex_destroy(&state.lock);
+        free(state.vaults);
+        return -1;
+    }
+
+    // Marks that do not pin the inodes: kernel 5.19
+    int probe = fanotify_mark(state.fan, FAN_MARK_ADD | FAN_MARK_EVICTABLE, FAN_ACCESS, AT_FDCWD, "/");
+    if (probe == 0) {
+        fanotify_mark(state.fan, FAN_MARK_REMOVE, FAN_ACCESS, AT_FDCWD, "/");
+        state.mark_flags = FAN_MARK_EVICTABLE;
+    }
+
+    struct sigaction sa = { .sa_handler = autolock_stop };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Locks due within a tenth of the idle time, but at most a minute, share one flush
+    unsigned window = idle / 10;
+    if (window < 1) window = 1;
+    if (window > 60) window = 60;
+
+    printf("Recrypting vaults after %us without access\n", idle);
+    double now = now_s(), next_poll = now, batch_end = 0;
+    while (!stopping) {
+        if (now >= next_poll) {
+            autolock_poll(&state, now);
+            next_poll = now + AUTOLOCK_POLL;
+        }
+
+        double next = next_poll;
+        for (size_t v = 0; v < n; v++) {
+            if (!state.vaults[v].watched) continue;
+            double due = state.vaults[v].last_access + idle;
+            if (due <= now && batch_end == 0) batch_end = now + window;
+            if (due < next) next = due;
+        }
+        if (batch_end != 0 && now >= batch_end) {
+            autolock_lock(&state, now, idle);
+            batch_end = 0;
+            continue;
+        }
+        if (batch_end != 0) next = batch_end;
+
+        int timeout = (next > now) ? (int) ((next - now) * 1000) + 1 : 0;
+        struct pollfd pfd = { .fd = state.fan, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) > 0) autolock_read_events(&state, now_s());
+        now = now_s();
+    }
+
+    close(state.fan);
+    for (size_t h = 0; h < AUTOLOCK_BUCKETS; h++) {
+        while (state.buckets[h]) {
+            struct autolock_dir *dir = state.buckets[h];
+            state.buckets[h] = dir->next;
+            free(dir->path);
+            free(dir);
+        }
+    }
+    pthread_mutex_destroy(&state.lock);
+    free(state.vaults);
+    return 0;
+}
@@ -0,0 +1,428 @@
+// batch.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define BATCH_PASS_ROUNDS 3
+
+// One distinct key descriptor shared by one or more directories
+struct batch_key {
+    key_desc_t descriptor;
+    char version;
+    size_t key_size;
+    struct vault_meta meta;
+    size_t first_dir;
+    size_t dirs;
+    ssize_t family;
+    size_t family_dirs;
+    bool present;
+    bool cached;
+    bool installed;
+    bool failed;
+    bool wrong;
+    ssize_t pass_sz;
+    char passphrase[EXT4_MAX_PASSPHRASE_SZ];
+    struct ext4_encryption_key key;
+};
+
+struct batch_pool {
+    struct batch_key *keys;
+    size_t nkeys;
+    size_t next;
+    unsigned kdf_threads;
+    pthread_mutex_t lock;
+};
+
+// Collect the distinct descriptors of the directories
+// Return the number of distinct descriptors, key_of[i] indexes keys for directory i
+static
+ssize_t collect_descriptors(char **dir_paths, size_t n, struct batch_key *keys, ssize_t *key_of)
+{
+    size_t nkeys = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct ext4_encryption_policy policy;
+        key_of[i] = -1;
+
+        int ret = container_policy(dir_paths[i], &policy);
+        if (ret < 0) continue;
+        if (ret > 0) {
+            error(0, "Cannot process: %s not an encrypted directory", dir_paths[i]);
+            continue;
+        }
+
+        size_t k = 0;
+        while (k < nkeys && memcmp(keys[k].descriptor, policy.master_key_descriptor,
+                    sizeof(key_desc_t)) != 0)
+            k++;
+
+        if (k == nkeys) {
+            if (vault_meta_read(dir_paths[i], &keys[k].meta) < 0) continue;
+            memcpy(keys[k].descriptor, policy.master_key_descriptor, sizeof(key_desc_t));
+            keys[k].version = policy.version;
+            keys[k].key_size = policy_key_size(&policy);
+            keys[k].first_dir = i;
+            nkeys++;
+        }
+
+        keys[k].dirs++;
+        key_of[i] = k;
+    }
+
+    return nkeys;
+}
+
+// Link the missing keys of a key family to the first of them, which alone asks
+// for the passphrase; family is -1 for keys outside any family
+static
+void link_families(struct batch_key *keys, size_t nkeys)
+{
+    for (size_t k = 0; k < nkeys; k++) keys[k].family = -1;
+
+    for (size_t k = 0; k < nkeys; k++) {
+        if (keys[k].present || keys[k].cached || !(keys[k].meta.flags & VAULT_META_FAMILY)) continue;
+
+        size_t f = 0;
+        while (f < k && !(keys[f].family == (ssize_t) f && family_same(&keys[f].meta, &keys[k].meta)))
+            f++;
+        keys[k].family = f;
+        keys[f].family_dirs += keys[k].dirs;
+    }
+}
+
+// Derive the keys of the family led by key k from one run of the KDF
+// The first key is checked first, a mismatch there is a wrong passphrase
+static
+void derive_family(struct batch_pool *pool, size_t k)
+{
+    struct batch_key *lead = &pool->keys[k];
+    struct ext4_encryption_key *secret = sodium_malloc(sizeof(*secret));
+    int ret = secret ? family_secret(lead->passphrase, lead->pass_sz, &lead->meta, secret,
+            pool->kdf_threads) : -1;
+
+    for (size_t m = k; m < pool->nkeys; m++) {
+        struct batch_key *key = &pool->keys[m];
+        if (key->family != (ssize_t) k || key->failed) continue;
+        if (ret < 0) {
+            key->failed = true;
+            continue;
+        }
+
+        key->key.size = key->key_size;
+        family_key(secret, &key->meta, &key->key);
+        if (vault_verifier_check(&key->meta, &key->descriptor, &key->key))
+            continue;
+
+        sodium_memzero(key->key.raw, sizeof(key->key.raw));
+        if (m == k) {
+            key->wrong = true;
+            break;
+        }
+        key->failed = true;
+    }
+
+    sodium_free(secret);
+}
+
+// Worker: derive keys for pending descriptors until none are left
+static
+void *derive_worker(void *arg)
+{
+    struct batch_pool *pool = arg;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        size_t k = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (k >= pool->nkeys) break;
+
+        struct batch_key *key = &pool->keys[k];
+        if (key->present || key->failed || key->pass_sz == 0) continue;
+
+        if (key->family == (ssize_t) k) derive_family(pool, k);
+        else {
+            key->key.size = key->key_size;
+            int ret = derive_key_checked(&key->descriptor, key->passphrase, key->pass_sz, &key->meta,
+                    &key->key, pool->kdf_threads);
+            if (ret == -2) key->wrong = true;
+            else if (ret < 0) key->failed = true;
+        }
+        key->pass_sz = 0;
+        sodium_memzero(key->passphrase, sizeof(key->passphrase));
+    }
+
+    return NULL;
+}
+
+// Derive all requested keys on a bounded pool of workers
+static
+void derive_keys(struct batch_key *keys, size_t nkeys, unsigned jobs)
+{
+    size_t pending = 0;
+    uint64_t N = 0;
+    uint32_t r = 0, p = 0;
+    for (size_t k = 0; k < nkeys; k++) {
+        if (keys[k].present || keys[k].failed || keys[k].pass_sz == 0) continue;
+        if (keys[k].meta.kdf.N > N) N = keys[k].meta.kdf.N;
+        if (keys[k].meta.kdf.r > r) r = keys[k].meta.kdf.r;
+        p += keys[k].meta.kdf.p;
+        pending++;
+    }
+    if (pending == 0) return;
+
+    // Split the CPU and memory budget of all lanes between the workers
+    unsigned budget = scrypt_threads(N, r, p);
+    if (jobs == 0 || jobs > budget) jobs = budget;
+    if (jobs > pending) jobs = pending;
+
+    struct batch_pool pool = {
+        .keys = keys, .nkeys = nkeys, .next = 0,
+        .kdf_threads = budget / jobs,
+    };
+    pthread_mutex_init(&pool.lock, NULL);
+
+    pthread_t tids[jobs];
+    unsigned started = 0;
+    for (; started < jobs - 1; started++)
+        if (pthread_create(&tids[started], NULL, derive_worker, &pool) != 0) break;
+
+    derive_worker(&pool);
+    for (unsigned i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+// Ask for the passphrase of a descriptor, or of the key family it leads,
+// naming the directories it unlocks
+static
+void prompt_key(struct batch_key *key, char **dir_paths)
+{
+    size_t dirs = (key->family >= 0) ? key->family_dirs : key->dirs;
+    char prompt[64 + EXT4_KEY_DESCRIPTOR_SIZE * 2];
+    char hex[EXT4_KEY_DESCRIPTOR_SIZE * 2 + 1];
+    for (int i = 0; i < EXT4_KEY_DESCRIPTOR_SIZE; i++)
+        sprintf(hex + i * 2, "%02x", key->descriptor[i] & 0xff);
+    fprintf(stderr, "Key %s%s: %s", (key->family >= 0) ? "family " : "", hex, dir_paths[key->first_dir]);
+    if (dirs > 1) fprintf(stderr, " and %zu more", dirs - 1);
+    fprintf(stderr, "\n");
+    snprintf(prompt, sizeof(prompt), "Enter passphrase for %s: ", hex);
+
+    key->pass_sz = prompt_passphrase(prompt, false, key->passphrase, sizeof(key->passphrase));
+    if (key->pass_sz < 0) {
+        key->pass_sz = 0;
+        key->failed = true;
+    }
+}
+
+// Decrypt many directories, asking once per distinct key descriptor or key family
+// Run the KDFs on at most jobs workers and flush caches once at the end
+int batch_attach(char **dir_paths, size_t n, unsigned jobs)
+{
+    if (crypto_init() == -1) {
+        error(0, "Cannot access cryptography system");
+        return -1;
+    }
+
+    // Passphrases and keys of all descriptors live in locked memory
+    struct batch_key *keys = sodium_allocarray(n, sizeof(*keys));
+    ssize_t *key_of = calloc(n, sizeof(*key_of));
+    char **done = calloc(n, sizeof(*done));
+    if (!keys || !key_of || !done) {
+        error(0, "Cannot allocate memory for %zu directories", n);
+        sodium_free(keys);
+        free(key_of);
+        free(done);
+        return -1;
+    }
+    memset(keys, 0, n * sizeof(*keys));
+
+    int ret = 0;
+    ssize_t nkeys = collect_descriptors(dir_paths, n, keys, key_of);
+    for (size_t i = 0; i < n; i++)
+        if (key_of[i] < 0) ret = -1;
+
+    // A v2 key is added to each filesystem: it is only present when all its directories have it
+    for (ssize_t k = 0; k < nkeys; k++) keys[k].present = true;
+    for (size_t i = 0; i < n; i++)
+        if (key_of[i] >= 0 && vault_key_status(dir_paths[i]) != EXT4_KEY_STATUS_PRESENT)
+            keys[key_of[i]].present = false;
+
+    // Keys cached by -T|--cache are added without a passphrase: a v1 key once
+    // for all its directories, a v2 key to each of them
+    for (ssize_t k = 0; cache_ttl && k < nkeys; k++)
+        keys[k].cached = !keys[k].present && !(keys[k].meta.flags & VAULT_META_KEYFILE);
+    for (size_t i = 0; cache_ttl && i < n; i++) {
+        if (key_of[i] < 0) continue;
+        struct batch_key *key = &keys[key_of[i]];
+        if (!key->cached || (key->version != EXT4_POLICY_V2 && i != key->first_dir)) continue;
+        if (keycache_attach(dir_paths[i]) < 0) key->cached = false;
+    }
+
+    // Vaults of one key family share a passphrase and a single run of the KDF
+    link_families(keys, nkeys);
+    size_t missing = 0;
+    for (ssize_t k = 0; k < nkeys; k++)
+        if (!keys[k].present && (keys[k].meta.flags & VAULT_META_KEYFILE)) {
+            error(0, "Cannot decrypt %s with a passphrase: it is bound to a key file, use -k|--key-file",
+                    dir_paths[keys[k].first_dir]);
+            keys[k].failed = true;
+        }
+        else if (!keys[k].present && !keys[k].cached) {
+            if (keys[k].family < 0 || keys[k].family == k) prompt_key(&keys[k], dir_paths);
+            missing += (keys[k].version == EXT4_POLICY_V2) ? keys[k].dirs : 1;
+        }
+    keyring_make_room(missing);
+
+    // Keys rejected by their vault's verifier never reach the keyring: ask again for those
+    for (int round = 1; ; round++) {
+        derive_keys(keys, nkeys, jobs);
+
+        bool again = false;
+        for (ssize_t k = 0; k < nkeys; k++) {
+            if (!keys[k].wrong) continue;
+            keys[k].wrong = false;
+            error(0, "Wrong passphrase for %s", dir_paths[keys[k].first_dir]);
+            if (round < BATCH_PASS_ROUNDS) {
+                prompt_key(&keys[k], dir_paths);
+                again = true;
+            }
+            else keys[k].failed = true;
+        }
+        if (!again) break;
+    }
+
+    // The other keys of a family fail with the key that asked for its passphrase
+    for (ssize_t k = 0; k < nkeys; k++)
+        if (keys[k].family >= 0 && keys[keys[k].family].failed) keys[k].failed = true;
+
+    size_t ndone = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (key_of[i] < 0) continue;
+        struct batch_key *key = &keys[key_of[i]];
+
+        if (key->present) {
+            printf("Directory %s already decrypted\n", dir_paths[i]);
+            continue;
+        }
+        if (key->cached) {
+            printf("Directory %s now decrypted (cached key)\n", dir_paths[i]);
+            done[ndone++] = dir_paths[i];
+            continue;
+        }
+
+        // Later directories sharing a v1 descriptor use the key installed here in the
+        // keyring, a v2 key is added for each directory and wiped by sodium_free
+        if (!key->failed && !key->installed) {
+            if (vault_attach_key(dir_paths[i], &key->key) < 0) key->failed = true;
+            else if (cache_ttl && i == key->first_dir) keycache_store(&key->descriptor, key->version, &key->key);
+            if (!key->failed && key->version != EXT4_POLICY_V2) {
+                key->installed = true;
+                sodium_memzero(&key->key, sizeof(key->key));
+            }
+        }
+
+        if (key->failed) {
+            error(0, "Error in decrypting directory %s", dir_paths[i]);
+            ret = -1;
+            continue;
+        }
+
+        printf("Directory %s now decrypted\n", dir_paths[i]);
+        done[ndone++] = dir_paths[i];
+    }
+
+    status_index_update_batch(done, ndone);
+    sodium_free(keys);
+    free(key_of);
+    free(done);
+    return ret;
+}
+
+// Recrypt many directories, flushing caches once at the end
+int batch_detach(char **dir_paths, size_t n)
+{
+    struct batch_key *keys = calloc(n, sizeof(*keys));
+    ssize_t *key_of = calloc(n, sizeof(*key_of));
+    char **done = calloc(n, sizeof(*done));
+    if (!keys || !key_of || !done) {
+        error(0, "Cannot allocate memory for %zu directories", n);
+        free(keys);
+        free(key_of);
+        free(done);
+        return -1;
+    }
+
+    int ret = 0;
+    ssize_t nkeys = collect_descriptors(dir_paths, n, keys, key_of);
+
+    // The v1 keys leave the keyring in one go, the v2 keys per filesystem below
+    key_desc_t *descs = calloc(nkeys > 0 ? nkeys : 1, sizeof(*descs));
+    bool *failed = calloc(nkeys > 0 ? nkeys : 1, sizeof(*failed));
+    size_t ndescs = 0;
+    if (descs && failed) {
+        for (ssize_t k = 0; k < nkeys; k++)
+            if (keys[k].version != EXT4_POLICY_V2) memcpy(descs[ndescs++], keys[k].descriptor, sizeof(key_desc_t));
+        remove_keys_for_descriptors(descs, ndescs, failed);
+        for (ssize_t k = 0, d = 0; k < nkeys; k++) {
+            if (keys[k].version == EXT4_POLICY_V2) continue;
+            keys[k].failed = failed[d++];
+            keys[k].present = true;
+        }
+    }
+    free(descs);
+    free(failed);
+
+    size_t ndone = 0, nv1 = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (key_of[i] < 0) {
+            ret = -1;
+            continue;
+        }
+
+        // Directories sharing a descriptor lose their key together, for v2 those
+        // on the same filesystem: present marks a key removed before; a v1 key
+        // is only removed here when the allocation above failed
+        struct batch_key *key = &keys[key_of[i]];
+        if (key->version == EXT4_POLICY_V2 && !key->failed) {
+            if (!key->present || vault_key_status(dir_paths[i]) != EXT4_KEY_STATUS_ABSENT) {
+                int detached = vault_detach(dir_paths[i]);
+                if (detached < 0 && detached != E2CRYPT_ERR_BUSY) key->failed = true;
+                else key->present = true;
+            }
+        }
+        else if (!key->present && !key->failed) {
+            int keyring_lock = lock_take(LOCK_KEYRING, LOCK_SH);
+            int lock = lock_descriptor(&key->descriptor, LOCK_EX);
+            if (remove_key_for_descriptor(&key->descriptor) < 0) key->failed = true;
+            else key->present = true;
+            lock_release(lock);
+            lock_release(keyring_lock);
+        }
+
+        if (key->failed) {
+            error(0, "Cannot recrypt, directory %s not decrypted", dir_paths[i]);
+            ret = -1;
+            continue;
+        }
+
+        printf("Directory %s now recrypted\n", dir_paths[i]);
+        done[ndone++] = dir_paths[i];
+        if (key->version != EXT4_POLICY_V2) nv1++;
+    }
+
+    status_index_update_batch(done, ndone);
+    flush_caches_batch(done, ndone);
+    warn_stale_v1(stderr, nv1);
+    free(keys);
+    free(key_of);
+    free(done);
+    return ret;
+}
@@ -0,0 +1,501 @@
+// bench.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <sys/resource.h>
+#include <keyutils.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define BENCH_KEYRING NAME "-bench"
+
+static bool json = false;
+static bool json_first = true;
+static unsigned scale = 1;
+
+static
+void usage(FILE *std)
+{
+    fprintf(std, "%s-bench - time the operations of %s one by one\n\n", NAME, NAME);
+    fprintf(std, "USAGE: %s-bench [-J] [-n <scale>] [-d <dir>]\n", NAME);
+    fprintf(std, "    -J|--json:           Print one JSON record per operation\n");
+    fprintf(std, "    -n|--scale <n>:      Multiply the number of iterations by <n> (default 1)\n");
+    fprintf(std, "    -d|--dir <dir>:      Directory on ext4 for the policy ioctls and the cache flush\n");
+    fprintf(std, "    -k|--keys <max>:     Largest number of keys in the keyring to search (default 10000)\n");
+}
+
+static
+void print_error(bool show_usage, const char *msg)
+{
+    if (show_usage) {
+        usage(stderr);
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%s\n", msg);
+}
+
+static
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Report the latencies of one operation: percentiles over the samples in ns
+static
+void report(const char *op, const char *params, double *samples, size_t n)
+{
+    if (n == 0) return;
+    qsort(samples, n, sizeof(*samples), compare_double);
+
+    double sum = 0;
+    for (size_t i = 0; i < n; i++) sum += samples[i];
+    double p50 = samples[(n * 50 + 99) / 100 - 1] / 1e3;
+    double p99 = samples[(n * 99 + 99) / 100 - 1] / 1e3;
+    double mean = sum / n / 1e3, min = samples[0] / 1e3, max = samples[n - 1] / 1e3;
+
+    if (json) {
+        printf("%s{\"op\":\"%s\",\"params\":\"%s\",\"n\":%zu,\"p50_us\":%.3f,\"p99_us\":%.3f,"
+                "\"mean_us\":%.3f,\"min_us\":%.3f,\"max_us\":%.3f}",
+                json_first ? "" : ",\n", op, params, n, p50, p99, mean, min, max);
+        json_first = false;
+    }
+    else printf("%-28s %-22s %7zu %12.3f %12.3f %12.3f\n", op, params, n, p50, p99, max);
+    fflush(stdout);
+}
+
+static
+void skip(const char *op, const char *why)
+{
+    if (!json) printf("%-28s %s\n", op, why);
+    else fprintf(stderr, "Skipped %s: %s\n", op, why);
+}
+
+static
+void bench_sodium_init()
+{
+    double first = now_ns();
+    sodium_init();
+    first = now_ns() - first;
+    report("sodium_init", "first", &first, 1);
+
+    size_t n = 1000 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    for (size_t i = 0; i < n; i++) {
+        double start = now_ns();
+        sodium_init();
+        samples[i] = now_ns() - start;
+    }
+    report("sodium_init", "again", samples, n);
+    free(samples);
+}
+
+static
+void bench_derive()
+{
+    const char pass[] = "benchmark passphrase";
+    struct ext4_encryption_key key = { .size = EXT4_AES_256_XTS_KEY_SIZE };
+    struct kdf_params params;
+    kdf_legacy_params(&params);
+
+    for (int log2_n = 10; log2_n <= 16; log2_n += 2) {
+        params.N = 1ULL << log2_n;
+        // Fewer runs at the higher costs keep the whole run short
+        size_t n = (log2_n <= 12 ? 20 : log2_n == 14 ? 10 : 5) * scale;
+        double *samples = malloc(n * sizeof(*samples));
+        for (size_t i = 0; i < n; i++) {
+            double start = now_ns();
+            derive_passphrase_to_key(pass, sizeof(pass) - 1, &params, &key, 0);
+            samples[i] = now_ns() - start;
+        }
+
+        char label[64];
+        snprintf(label, sizeof(label), "N=2^%d r=%u p=%u", log2_n, params.r, params.p);
+        report("derive_passphrase_to_key", label, samples, n);
+        free(samples);
+    }
+    sodium_memzero(&key, sizeof(key));
+}
+
+// Minor page faults of this process so far
+static
+long minor_faults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+// Time a derivation on fresh scratch memory against one on reused memory
+static
+void bench_arena()
+{
+    const char pass[] = "benchmark passphrase";
+    struct ext4_encryption_key key = { .size = EXT4_AES_256_XTS_KEY_SIZE };
+    struct kdf_params params;
+    kdf_legacy_params(&params);
+    size_t n = 5 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    char label[64];
+
+    for (int warm = 0; warm <= 1; warm++) {
+        long faults = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (!warm) arena_trim();
+            long before = minor_faults();
+            double start = now_ns();
+            derive_passphrase_to_key(pass, sizeof(pass) - 1, &params, &key, 0);
+            samples[i] = now_ns() - start;
+            faults += minor_faults() - before;
+        }
+        snprintf(label, sizeof(label), "%s %ld faults", warm ? "reused" : "fresh", faults / (long) n);
+        report("derive scratch arena", label, samples, n);
+    }
+
+    struct arena_stats stats;
+    arena_get_stats(&stats);
+    if (!json)
+        printf("%-28s %llu MiB mapped, %llu MiB huge pages, %llu MiB locked, %llu faults saved\n",
+                "scratch arena", stats.bytes >> 20, stats.huge_bytes >> 20, stats.locked_bytes >> 20,
+                stats.faults_saved);
+    sodium_memzero(&key, sizeof(key));
+    free(samples);
+}
+
+// Time scrypt at the default cost on one thread with every Salsa20/8 kernel
+// this CPU runs, and libsodium for reference; all give the same key
+static
+void bench_kernels()
+{
+    const uint8_t pass[] = "benchmark passphrase", salt[] = "benchmark salt";
+    uint8_t want[EXT4_MAX_KEY_SIZE], got[EXT4_MAX_KEY_SIZE];
+    size_t n = 3 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    char label[64];
+    snprintf(label, sizeof(label), "N=2^14 r=%u p=%u 1 thread", SCRYPT_R, SCRYPT_P);
+
+    for (size_t i = 0; i < n; i++) {
+        double start = now_ns();
+        crypto_pwhash_scryptsalsa208sha256_ll(pass, sizeof(pass) - 1, salt, sizeof(salt) - 1,
+                SCRYPT_N, SCRYPT_R, SCRYPT_P, want, sizeof(want));
+        samples[i] = now_ns() - start;
+    }
+    report("scrypt libsodium", label, samples, n);
+
+    const struct romix_kernel *k;
+    for (unsigned i = 0; (k = romix_kernel(i)); i++) {
+        char op[64];
+        snprintf(op, sizeof(op), "scrypt %s", k->name);
+        if (scrypt_use_kernel(k->name) < 0) {
+            skip(op, "not supported by this CPU");
+            continue;
+        }
+
+        // One thread runs all 16 lanes, so a kernel runs as many lanes at once as it has
+        for (size_t j = 0; j < n; j++) {
+            double start = now_ns();
+            scrypt_parallel(pass, sizeof(pass) - 1, salt, sizeof(salt) - 1,
+                    SCRYPT_N, SCRYPT_R, SCRYPT_P, 1, got, sizeof(got));
+            samples[j] = now_ns() - start;
+        }
+        if (sodium_memcmp(want, got, sizeof(want)) != 0) skip(op, "wrong output");
+        else report(op, label, samples, n);
+    }
+
+    scrypt_use_kernel(NULL);
+    free(samples);
+}
+
+static
+void bench_descriptor()
+{
+    size_t n = 100000 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    key_desc_t key_desc;
+    full_key_desc_t full;
+    randombytes_buf(key_desc, sizeof(key_desc));
+
+    for (size_t i = 0; i < n; i++) {
+        double start = now_ns();
+        build_full_key_descriptor(&key_desc, &full);
+        samples[i] = now_ns() - start;
+    }
+    report("build_full_key_descriptor", "", samples, n);
+    free(samples);
+}
+
+// Search for a vault key among count others in the vault keyring, while as
+// many unrelated keys sit in another keyring linked into the user session
+// keyring; then remove the vault keys added in one go
+static
+void bench_search(unsigned max_keys)
+{
+    key_serial_t keyring = add_key("keyring", BENCH_KEYRING, NULL, 0, KEY_SPEC_USER_SESSION_KEYRING);
+    if (keyring == -1 || vault_keyring(true) == -1) {
+        skip("find_key_by_descriptor", strerror(errno));
+        return;
+    }
+
+    struct ext4_encryption_key payload = { .size = EXT4_AES_256_XTS_KEY_SIZE };
+    key_desc_t *added = calloc(max_keys, sizeof(*added));
+    bool *failed = calloc(max_keys, sizeof(*failed));
+    unsigned count = 0;
+    size_t n = 1000 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+
+    for (unsigned want = 10; want <= max_keys && added && failed; want *= 10) {
+        while (count < want) {
+            key_desc_t key_desc;
+            full_key_desc_t desc;
+            randombytes_buf(key_desc, sizeof(key_desc));
+            build_full_key_descriptor(&key_desc, &desc);
+            if (add_key(EXT4_ENCRYPTION_KEY_TYPE, desc, &payload, sizeof(payload), keyring) == -1)
+                break;
+            // The last vault key added is the one searched for
+            randombytes_buf(added[count], sizeof(key_desc_t));
+            if (install_key_for_descriptor(&added[count], &payload) < 0)
+                break;
+            count++;
+        }
+        if (count < want) {
+            char why[128];
+            snprintf(why, sizeof(why), "stopped at %u keys: %s (see /proc/sys/kernel/keys)",
+                    count, strerror(errno));
+            skip("find_key_by_descriptor", why);
+            break;
+        }
+
+        size_t done = 0;
+        for (; done < n; done++) {
+            key_serial_t serial;
+            double start = now_ns();
+            if (find_key_by_descriptor(&added[count - 1], &serial) < 0) break;
+            samples[done] = now_ns() - start;
+        }
+        if (done < n) {
+            skip("find_key_by_descriptor", "key added for the search not found");
+            break;
+        }
+
+        char label[64];
+        snprintf(label, sizeof(label), "%u keys", count);
+        report("find_key_by_descriptor", label, samples, n);
+
+        // A vault whose key is absent, as status and scan mostly see
+        key_desc_t absent;
+        randombytes_buf(absent, sizeof(absent));
+        for (done = 0; done < n; done++) {
+            key_serial_t serial;
+            double start = now_ns();
+            find_key_by_descriptor(&absent, &serial);
+            samples[done] = now_ns() - start;
+        }
+        snprintf(label, sizeof(label), "%u keys, absent", count);
+        report("find_key_by_descriptor", label, samples, n);
+    }
+
+    if (count > 0) {
+        char label[64];
+        snprintf(label, sizeof(label), "%u keys", count);
+        double start = now_ns();
+        remove_keys_for_descriptors(added, count, failed);
+        samples[0] = now_ns() - start;
+        report("remove_keys_for_descriptors", label, samples, 1);
+    }
+
+    free(samples);
+    free(added);
+    free(failed);
+    keyctl_clear(keyring);
+    keyctl_unlink(keyring, KEY_SPEC_USER_SESSION_KEYRING);
+}
+
+static
+void bench_add_remove()
+{
+    struct ext4_encryption_key key = { .size = EXT4_AES_256_XTS_KEY_SIZE };
+    key_desc_t key_desc;
+    randombytes_buf(key_desc, sizeof(key_desc));
+    randombytes_buf(key.raw, sizeof(key.raw));
+
+    size_t n = 1000 * scale;
+    double *adds = malloc(n * sizeof(*adds));
+    double *removes = malloc(n * sizeof(*removes));
+    size_t done = 0;
+    for (; done < n; done++) {
+        double start = now_ns();
+        if (install_key_for_descriptor(&key_desc, &key) < 0) break;
+        adds[done] = now_ns() - start;
+
+        start = now_ns();
+        if (remove_key_for_descriptor(&key_desc) < 0) break;
+        removes[done] = now_ns() - start;
+    }
+
+    report("add_key", "", adds, done);
+    report("keyctl_unlink", "", removes, done);
+    free(adds);
+    free(removes);
+    sodium_memzero(&key, sizeof(key));
+}
+
+static
+void bench_ioctls(const char *dir_path)
+{
+    int dirfd = open(dir_path, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        skip("EXT4_IOC_*_ENCRYPTION_POLICY", strerror(errno));
+        return;
+    }
+
+    size_t n = 1000 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    struct ext4_encryption_policy policy;
+    size_t done = 0;
+    for (; done < n; done++) {
+        double start = now_ns();
+        int ret = ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY, &policy);
+        samples[done] = now_ns() - start;
+        // An unencrypted directory answers through the same path
+        if (ret != 0 && errno != ENODATA && errno != ENOENT) break;
+    }
+    if (done < n) skip("EXT4_IOC_GET_ENCRYPTION_POLICY", strerror(errno));
+    else report("EXT4_IOC_GET_ENCRYPTION_POLICY", "", samples, n);
+
+    // Setting a policy needs a fresh empty directory every time
+    policy.version = 0;
+    policy.contents_encryption_mode = EXT4_ENCRYPTION_MODE_AES_256_XTS;
+    policy.filenames_encryption_mode = EXT4_ENCRYPTION_MODE_AES_256_CTS;
+    policy.flags = EXT4_POLICY_FLAGS_PAD_4;
+    randombytes_buf(policy.master_key_descriptor, sizeof(policy.master_key_descriptor));
+
+    char name[64];
+    snprintf(name, sizeof(name), ".%s-bench.%d", NAME, getpid());
+    n = 100 * scale;
+    for (done = 0; done < n; done++) {
+        if (mkdirat(dirfd, name, S_IRWXU) != 0) break;
+        int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY);
+        double start = now_ns();
+        int ret = (fd == -1) ? -1 : ioctl(fd, EXT4_IOC_SET_ENCRYPTION_POLICY, &policy);
+        samples[done] = now_ns() - start;
+        if (fd != -1) close(fd);
+        unlinkat(dirfd, name, AT_REMOVEDIR);
+        if (ret != 0) break;
+    }
+    if (done < n) skip("EXT4_IOC_SET_ENCRYPTION_POLICY", strerror(errno));
+    else report("EXT4_IOC_SET_ENCRYPTION_POLICY", "", samples, n);
+
+    free(samples);
+    close(dirfd);
+}
+
+// Evicting the cache of a tree; the global drop is left out as it would
+// disturb the whole host
+static
+void bench_flush(const char *dir_path)
+{
+    size_t n = 20 * scale;
+    double *samples = malloc(n * sizeof(*samples));
+    struct cache_stats stats;
+    size_t done = 0;
+    for (; done < n; done++) {
+        double start = now_ns();
+        if (cache_invalidate_tree(dir_path, &stats) < 0) break;
+        samples[done] = now_ns() - start;
+    }
+
+    if (done < n) skip("cache_invalidate_tree", "cannot walk directory");
+    else {
+        char label[64];
+        snprintf(label, sizeof(label), "%lu files", stats.files);
+        report("cache_invalidate_tree", label, samples, n);
+    }
+    free(samples);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir_path = NULL;
+    unsigned max_keys = 10000;
+    int c;
+
+    error_set_handler(print_error);
+    static struct option longopts[] = {
+        { "help", no_argument, 0, 'h' },
+        { "json", no_argument, 0, 'J' },
+        { "scale", required_argument, 0, 'n' },
+        { "dir", required_argument, 0, 'd' },
+        { "keys", required_argument, 0, 'k' },
+        { 0, 0, 0, 0 },
+    };
+
+    while ((c = getopt_long(argc, argv, ":hJn:d:k:", longopts, 0)) != -1) {
+        switch (c) {
+            case 'h': usage(stdout); return EXIT_SUCCESS;
+            case 'J': json = true; break;
+            case 'n':
+                if (atoi(optarg) <= 0) {
+                    error(1, "Option -n|--scale requires a positive number");
+                    return EXIT_FAILURE;
+                }
+                scale = atoi(optarg);
+                break;
+            case 'd': dir_path = optarg; break;
+            case 'k':
+                if (atoi(optarg) < 10) {
+                    error(1, "Option -k|--keys requires a number of at least 10");
+                    return EXIT_FAILURE;
+                }
+                max_keys = atoi(optarg);
+                break;
+            case ':': error(1, "Missing argument to -%c", optopt); return EXIT_FAILURE;
+            default: error(1, "Unknown command option -%c", optopt); return EXIT_FAILURE;
+        }
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    if (json)
+        printf("{\"tool\":\"%s-bench\",\"kernel\":\"%s\",\"machine\":\"%s\",\"cpus\":%u,\"results\":[\n",
+                NAME, uts.release, uts.machine, available_cpus());
+    else printf("%-28s %-22s %7s %12s %12s %12s\n", "operation", "parameters", "n", "p50 us", "p99 us", "max us");
+
+    bench_sodium_init();
+    bench_derive();
+    bench_kernels();
+    bench_arena();
+    bench_descriptor();
+    bench_search(max_keys);
+    bench_add_remove();
+    if (dir_path) {
+        bench_ioctls(dir_path);
+        bench_flush(dir_path);
+    }
+    else skip("policy ioctls, cache flush", "no -d|--dir given");
+
+    if (json) printf("\n]}\n");
+    return EXIT_SUCCESS;
+}
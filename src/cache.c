@@ -0,0 +1,97 @@
+// cache.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Maximum number of directories nftw keeps open while walking
+#define CACHE_WALK_FDS 32
+
+// nftw passes no argument to its callback; one walk at a time per thread
+static __thread struct cache_stats *walk_stats;
+
+// Count the pages of an open file that are resident in the page cache
+static
+unsigned long long resident_pages(int fd, off_t size)
+{
+    if (size <= 0) return 0;
+
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return 0;
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (size + page - 1) / page;
+    unsigned char *vec = malloc(pages);
+    unsigned long long count = 0;
+
+    if (vec && mincore(map, size, vec) == 0)
+        for (size_t i = 0; i < pages; i++) count += vec[i] & 1;
+
+    free(vec);
+    munmap(map, size);
+    return count;
+}
+
+// Evict the page cache of one file or directory
+static
+int invalidate_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void) ftw;
+
+    if (type == FTW_D) {
+        walk_stats->dirs++;
+        return 0;
+    }
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+    if (fd == -1) {
+        walk_stats->skipped++;
+        return 0;
+    }
+
+    unsigned long long before = resident_pages(fd, st->st_size);
+    if (before > 0) {
+        // Dirty pages cannot be dropped, so write them back first
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        unsigned long long after = resident_pages(fd, st->st_size);
+        walk_stats->pages += (before > after) ? before - after : 0;
+    }
+
+    walk_stats->files++;
+    close(fd);
+    return 0;
+}
+
+// Evict the cached pages of every file below dir_path
+// Only the vault's subtree is touched, the rest of the cache stays warm
+int cache_invalidate_tree(const char *dir_path, struct cache_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    walk_stats = stats;
+
+    int ret = nftw(dir_path, invalidate_entry, CACHE_WALK_FDS, FTW_PHYS | FTW_MOUNT);
+    walk_stats = NULL;
+
+    if (ret != 0) {
+        error(0, "Cannot walk %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,202 @@
+// cipher.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <linux/if_alg.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+// Contents are encrypted in data units of one filesystem block
+#define CIPHER_UNIT 4096
+#define CIPHER_BENCH_MS 200
+#define CIPHER_SELECT_MS 50
+
+// The contents ciphers of the kernel, by their name in the crypto API
+static const struct {
+    unsigned char mode;
+    const char *alg;
+    size_t iv_size;
+} candidates[] = {
+    { EXT4_ENCRYPTION_MODE_AES_256_XTS, "xts(aes)", 16 },
+    { EXT4_ENCRYPTION_MODE_AES_128_CBC, "essiv(cbc(aes),sha256)", 16 },
+    { EXT4_ENCRYPTION_MODE_ADIANTUM, "adiantum(xchacha12,aes)", 32 },
+    { EXT4_ENCRYPTION_MODE_SM4_XTS, "xts(sm4)", 16 },
+};
+
+#define NR_CANDIDATES (sizeof(candidates) / sizeof(candidates[0]))
+
+static
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Encrypt one data unit through an AF_ALG operation socket, with the IV of its block
+static
+int encrypt_unit(int opfd, uint64_t block, size_t iv_size, uint8_t *buf)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + 32)];
+        struct cmsghdr align;
+    } cbuf = { .buf = { 0 } };
+    struct iovec iov = { .iov_base = buf, .iov_len = CIPHER_UNIT };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + iv_size),
+    };
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_OP;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+    *(uint32_t *) CMSG_DATA(cmsg) = ALG_OP_ENCRYPT;
+
+    // fscrypt uses the block number as IV, zero padded
+    cmsg = CMSG_NXTHDR(&msg, cmsg);
+    cmsg->cmsg_level = SOL_ALG;
+    cmsg->cmsg_type = ALG_SET_IV;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + iv_size);
+    struct af_alg_iv *iv = (struct af_alg_iv *) CMSG_DATA(cmsg);
+    iv->ivlen = iv_size;
+    memset(iv->iv, 0, iv_size);
+    memcpy(iv->iv, &block, sizeof(block));
+
+    if (sendmsg(opfd, &msg, 0) != CIPHER_UNIT)
+        return -1;
+    return (read(opfd, buf, CIPHER_UNIT) == CIPHER_UNIT) ? 0 : -1;
+}
+
+// Throughput of the kernel cipher alg in MiB/s, measured for about ms milliseconds
+// Return -1 with errno set when the kernel cannot run it
+static
+double cipher_throughput(const char *alg, size_t key_size, size_t iv_size, unsigned ms)
+{
+    struct sockaddr_alg sa = { .salg_family = AF_ALG, .salg_type = "skcipher" };
+    snprintf((char *) sa.salg_name, sizeof(sa.salg_name), "%s", alg);
+
+    int tfmfd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (tfmfd == -1)
+        return -1;
+
+    uint8_t key[EXT4_MAX_KEY_SIZE];
+    randombytes_buf(key, key_size);
+    int opfd = -1;
+    if (bind(tfmfd, (struct sockaddr *) &sa, sizeof(sa)) == 0
+            && setsockopt(tfmfd, SOL_ALG, ALG_SET_KEY, key, key_size) == 0)
+        opfd = accept4(tfmfd, NULL, 0, SOCK_CLOEXEC);
+    sodium_memzero(key, sizeof(key));
+
+    double mib_s = -1;
+    uint8_t *buf = malloc(CIPHER_UNIT);
+    if (opfd != -1 && buf) {
+        memset(buf, 0x5a, CIPHER_UNIT);
+
+        // The first units load the module and warm the caches
+        uint64_t block = 0;
+        int ret = 0;
+        while (block < 16 && ret == 0) ret = encrypt_unit(opfd, block++, iv_size, buf);
+
+        double start = now_ms(), elapsed = 0;
+        uint64_t units = 0;
+        while (ret == 0 && elapsed < ms) {
+            for (int i = 0; i < 64 && ret == 0; i++, units++) ret = encrypt_unit(opfd, block++, iv_size, buf);
+            elapsed = now_ms() - start;
+        }
+        if (ret == 0) mib_s = units * CIPHER_UNIT / (1024.0 * 1024.0) / (elapsed / 1e3);
+    }
+
+    int saved = errno;
+    free(buf);
+    if (opfd != -1) close(opfd);
+    close(tfmfd);
+    errno = saved;
+    return mib_s;
+}
+
+// Measure every contents cipher and return the fastest one of at least min_bits,
+// or -1 when the kernel runs none of them; print a line per cipher when verbose
+static
+int cipher_fastest(unsigned min_bits, unsigned ms, bool verbose)
+{
+    int best = -1;
+    double best_mib_s = 0;
+
+    for (size_t i = 0; i < NR_CANDIDATES; i++) {
+        const struct cipher *cipher = &cipher_modes[candidates[i].mode];
+        double mib_s = cipher_throughput(candidates[i].alg, cipher->cipher_key_size, candidates[i].iv_size, ms);
+        bool strong = (cipher->security_bits >= min_bits);
+
+        if (verbose) {
+            printf("%-14s %-25s %4u bits  ", cipher->cipher_name, candidates[i].alg, cipher->security_bits);
+            if (mib_s < 0) printf("[unavailable: %s]\n", strerror(errno));
+            else printf("%8.0f MiB/s%s\n", mib_s, strong ? "" : "  (below minimum)");
+        }
+
+        if (mib_s > best_mib_s && strong) {
+            best = candidates[i].mode;
+            best_mib_s = mib_s;
+        }
+    }
+
+    return best;
+}
+
+// Print the throughput of the contents ciphers on this host, and recommend
+// the fastest one of at least min_bits
+int cipher_bench(unsigned min_bits)
+{
+    if (crypto_init() == -1)
+        return -1;
+
+    printf("Cipher         Kernel algorithm          Security   Throughput\n");
+    int best = cipher_fastest(min_bits, CIPHER_BENCH_MS, true);
+    fflush(stdout);
+    if (best < 0) {
+        error(0, "No contents cipher of at least %u bits available through AF_ALG", min_bits);
+        return -1;
+    }
+
+    printf("Recommended:   -M %s (filenames: %s)\n", cipher_modes[best].cipher_name,
+            cipher_mode_to_string(cipher_modes[best].filenames_mode));
+    return 0;
+}
+
+// Pick the fastest contents cipher of at least min_bits on this host for a
+// new vault, with the filenames cipher it pairs with
+int cipher_select(unsigned min_bits, char **contents, char **filenames)
+{
+    if (crypto_init() == -1)
+        return -1;
+
+    int best = cipher_fastest(min_bits, CIPHER_SELECT_MS, false);
+    if (best < 0) {
+        error(0, "No contents cipher of at least %u bits available through AF_ALG", min_bits);
+        return -1;
+    }
+
+    *contents = (char *) cipher_modes[best].cipher_name;
+    *filenames = (char *) cipher_mode_to_string(cipher_modes[best].filenames_mode);
+    printf("Selected cipher:      %s (fastest of at least %u bits)\n", *contents, min_bits);
+    return 0;
+}
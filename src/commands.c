@@ -0,0 +1,569 @@
+// commands.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Read passphrase from standard input
+static
+ssize_t read_passphrase(const char *prompt, char *key, size_t n)
+{
+    int stdin_fd = fileno(stdin);
+    const bool tty_input = isatty(stdin_fd);
+    struct termios old, new;
+    size_t key_sz = 0;
+
+    // Show prompt, disable echo
+    if (tty_input) {
+        fprintf(stderr, "%s", prompt);
+        fflush(stderr);
+
+        if (tcgetattr(stdin_fd, &old) != 0) {
+            perror("tcgetattr");
+            return -1;
+        }
+
+        new = old;
+        new.c_lflag &= ~ECHO;
+        if (tcsetattr(stdin_fd, TCSAFLUSH, &new) != 0) {
+            perror("tcsetattr");
+            return -1;
+        }
+    }
+
+    if (fgets(key, n, stdin)) key_sz = strlen(key);
+    if (key_sz > 0 && key[key_sz - 1] == '\n') key[--key_sz] = '\0';
+
+    // Restore echo
+    if (tty_input) {
+        tcsetattr(stdin_fd, TCSAFLUSH, &old);
+        fprintf(stderr, "\n");
+    }
+
+    return key_sz;
+}
+
+// Read a passphrase, retrying on empty input and on a failed confirmation
+// Return the passphrase length
+ssize_t prompt_passphrase(const char *prompt, bool confirm, char *passphrase, size_t n)
+{
+    int retries = 5;
+    char confirm_passphrase[EXT4_MAX_PASSPHRASE_SZ];
+    ssize_t pass_sz;
+
+    while (--retries >= 0) {
+        pass_sz = read_passphrase(prompt, passphrase, n);
+        if (pass_sz < 0)
+            return -1;
+
+        if (pass_sz == 0) {
+            error(0, "Passphrase cannot be empty");
+            continue;
+        }
+
+        if (!confirm)
+            break;
+
+        read_passphrase("Confirm passphrase: ", confirm_passphrase, sizeof(confirm_passphrase));
+        if (strcmp(passphrase, confirm_passphrase) == 0)
+            break;
+
+        error(0, "Password mismatch");
+    }
+
+    sodium_memzero(confirm_passphrase, sizeof(confirm_passphrase));
+    if (retries < 0) {
+        sodium_memzero(passphrase, n);
+        error(0, "Cannot read passphrase");
+        return -1;
+    }
+
+    return pass_sz;
+}
+
+// Make room in the key quota of the user for n more vault keys: the keys
+// cached by -T|--cache give way to them, reported to out
+void keyring_make_room_to(FILE *out, size_t n)
+{
+    unsigned keys, bytes;
+    if (keyring_quota_left(&keys, &bytes) < 0)
+        return;
+
+    // A key is charged for its payload and description
+    const size_t key_bytes = sizeof(struct ext4_encryption_key) + sizeof(full_key_desc_t);
+    if (keys >= n && bytes >= n * key_bytes)
+        return;
+
+    int removed = keycache_flush();
+    if (removed > 0) fprintf(out, "Key quota nearly reached: removed %d cached keys\n", removed);
+}
+
+void keyring_make_room(size_t n)
+{
+    keyring_make_room_to(stdout, n);
+}
+
+// Derive the key for descriptor and passphrase and check it against the vault
+// Return -2 when the vault's verifier rejects the key
+int derive_key_checked(key_desc_t *key_desc, const char *pass, size_t pass_sz,
+        const struct vault_meta *meta, struct ext4_encryption_key *key, unsigned threads)
+{
+    if (derive_meta_key(pass, pass_sz, meta, key, threads) < 0)
+        return -1;
+
+    if (!vault_verifier_check(meta, key_desc, key)) {
+        sodium_memzero(key->raw, sizeof(key->raw));
+        return -2;
+    }
+
+    return 0;
+}
+
+// Ask for the passphrase of the vault at dir_path with the given policy and add its key
+// The key is checked against the verifier in meta before it reaches the kernel,
+// and the passphrase asked again when it does not match
+// With -T|--cache a key cached before is used without asking: return 1 then
+int request_key_for_descriptor(const char *dir_path, const struct ext4_encryption_policy *policy,
+        const struct vault_meta *meta)
+{
+    if (cache_ttl && keycache_attach(dir_path) == 0)
+        return 1;
+
+    int retries = 3;
+    int ret;
+    char passphrase[EXT4_MAX_PASSPHRASE_SZ];
+    key_desc_t key_desc;
+    struct ext4_encryption_key master_key = {
+        .mode = 0,
+        .raw = { 0 },
+        .size = policy_key_size(policy),
+    };
+
+    memcpy(key_desc, policy->master_key_descriptor, sizeof(key_desc));
+    do {
+        TRACE_BEGIN(passphrase);
+        ssize_t pass_sz = prompt_passphrase("Enter passphrase: ", false, passphrase, sizeof(passphrase));
+        TRACE_END(passphrase);
+        if (pass_sz < 0)
+            return -1;
+
+        ret = derive_key_checked(&key_desc, passphrase, pass_sz, meta, &master_key, 0);
+        sodium_memzero(passphrase, sizeof(passphrase));
+
+        if (ret == -2) error(0, "Wrong passphrase");
+    } while (ret == -2 && --retries > 0);
+
+    if (ret == 0) {
+        keyring_make_room(1);
+        ret = vault_attach_key(dir_path, &master_key);
+        if (ret == 0 && cache_ttl) keycache_store(&key_desc, policy->version, &master_key);
+    }
+
+    sodium_memzero(&master_key, sizeof(master_key));
+    return (ret == 0) ? 0 : -1;
+}
+
+// Read the encryption policy of the directory at dir_path
+// Return 0 when it has one, 1 for a regular directory
+int container_policy(const char *dir_path, struct ext4_encryption_policy *policy)
+{
+    int ret = vault_policy(dir_path, policy);
+    if (ret == E2CRYPT_ERR_NOT_ENCRYPTED)
+        return 1;
+
+    return (ret == 0) ? 0 : -1;
+}
+
+// Print information about directory container to out
+int container_status_to(FILE *out, const char *dir_path)
+{
+    struct e2crypt_status status;
+
+    int ret = vault_status(dir_path, &status);
+    if (ret < 0 && ret != E2CRYPT_ERR_METADATA) {
+        error(0, "Cannot access directory properties of %s", dir_path);
+        return -1;
+    }
+
+    if (!status.encrypted) {
+        fprintf(out, "Regular directory:    %s\n", dir_path);
+        return 1;
+    }
+
+    fprintf(out, "Encrypted directory:  %s\n", dir_path);
+    fprintf(out, "Policy version:       %d\n", status.policy_version);
+    fprintf(out, "Filename cipher:      %s\n", status.filenames_cipher);
+    fprintf(out, "Contents cipher:      %s\n", status.contents_cipher);
+    fprintf(out, "Filename padding:     %u\n", status.padding);
+    if (status.policy_version == EXT4_POLICY_V2) {
+        fprintf(out, "Key identifier:       ");
+        for (int i=0; i<E2CRYPT_IDENTIFIER_SZ; ++i)
+            fprintf(out, "%02x", status.identifier[i]);
+    }
+    else {
+        fprintf(out, "Key descriptor:       ");
+        for (int i=0; i<EXT4_KEY_DESCRIPTOR_SIZE; ++i)
+            fprintf(out, "%02x", status.descriptor[i]);
+    }
+    fprintf(out, "\n");
+
+    struct vault_meta meta;
+    if (ret == 0 && vault_meta_read(dir_path, &meta) >= 0 && (meta.flags & VAULT_META_KEYFILE))
+        fprintf(out, "Key derivation:       none, key file%s\n", status.verifier ? ", verified" : "");
+    else if (ret == 0)
+        fprintf(out, "Key derivation:       scrypt N=%llu r=%u p=%u%s%s%s\n",
+                (unsigned long long) status.kdf_n, status.kdf_r, status.kdf_p,
+                status.legacy_kdf ? " (legacy salt)" : "",
+                status.verifier ? ", verified" : "",
+                (meta.flags & VAULT_META_FAMILY) ? ", key family" : "");
+
+    if (status.policy_version == EXT4_POLICY_V2)
+        fprintf(out, "Key status:           %s\n", status.key_present ? "present" :
+                status.key_busy ? "incompletely removed (files busy)" : "absent");
+    else if (!status.key_present)
+        fprintf(out, "Key serial:           [not found]\n");
+    else fprintf(out, "Key serial:           %08x\n", status.key_serial);
+
+    return 0;
+}
+
+// Print information about directory container
+int container_status(const char *dir_path)
+{
+    return container_status_to(stdout, dir_path);
+}
+
+// Setup an encrypted directory at dir_path bound to the key of the key file,
+// which is created with a new key when missing
+static
+int create_with_key_file(const char *dir_path, const struct ext4_encryption_policy *template)
+{
+    struct ext4_encryption_key *keys = sodium_malloc(2 * sizeof(*keys));
+    if (!keys) {
+        error(0, "Cannot allocate memory for the key");
+        return -1;
+    }
+
+    bool created;
+    keyring_make_room(1);
+    int ret = keyfile_create(key_file, &keys[0], &created);
+    if (ret == 0) ret = vault_create_raw(dir_path, template, &keys[0], &keys[1]);
+    if (ret < 0 && created) unlink(key_file);
+    sodium_free(keys);
+    if (ret < 0) {
+        error(0, "Error in encrypting directory %s", dir_path);
+        return -1;
+    }
+
+    status_index_update(dir_path);
+    container_status(dir_path);
+    printf("Directory %s now encrypted\n", dir_path);
+    return 0;
+}
+
+// Setup an encrypted directory at dir_path
+int container_create(const char *dir_path)
+{
+    if (crypto_init() == -1)
+        return -1;
+
+    // First check if the directory is not already encrypted, before asking for a passphrase
+    struct ext4_encryption_policy policy;
+    int ret = vault_policy(dir_path, &policy);
+    if (ret == 0) {
+        error(0, "Cannot encrypt directory %s: already encrypted", dir_path);
+        return -1;
+    }
+    if (ret != E2CRYPT_ERR_NOT_ENCRYPTED)
+        return -1;
+
+    // The policy records the cipher, so it is picked once at creation
+    if (strcmp(contents_cipher, "auto") == 0) {
+        TRACE_BEGIN(cipher_select);
+        ret = cipher_select(256, &contents_cipher, &filename_cipher);
+        TRACE_END(cipher_select);
+        if (ret < 0)
+            return -1;
+    }
+
+    struct ext4_encryption_policy template = {
+        .version = !policy_version ? EXT4_POLICY_AUTO :
+                (policy_version == 2) ? EXT4_POLICY_V2 : EXT4_POLICY_V1,
+        .contents_encryption_mode = cipher_string_to_mode(contents_cipher),
+        .filenames_encryption_mode = cipher_string_to_mode(filename_cipher),
+        .flags = padding_length_to_flags(padding),
+    };
+    if (key_file)
+        return create_with_key_file(dir_path, &template);
+
+    // A vault joining a key family takes the passphrase of the family, checked
+    // on the vault named, so it is not asked twice
+    const char *member = (key_family && strcmp(key_family, "new") != 0) ? key_family : NULL;
+    char passphrase[EXT4_MAX_PASSPHRASE_SZ];
+    TRACE_BEGIN(passphrase);
+    ssize_t pass_sz = prompt_passphrase(member ? "Enter passphrase of the key family: " : "Enter passphrase: ",
+            !member, passphrase, sizeof(passphrase));
+    TRACE_END(passphrase);
+    if (pass_sz < 0) {
+        error(0, "Error seting password for encrypted directory %s", dir_path);
+        return -1;
+    }
+
+    struct ext4_encryption_key key;
+    keyring_make_room(1);
+    if (key_family) ret = vault_create_family(dir_path, &template, member, passphrase, pass_sz, 0, &key);
+    else ret = vault_create(dir_path, &template, passphrase, pass_sz, 0, &key);
+    if (ret == 0 && cache_ttl && vault_policy(dir_path, &policy) == 0)
+        keycache_store(&policy.master_key_descriptor, policy.version, &key);
+
+    sodium_memzero(passphrase, sizeof(passphrase));
+    sodium_memzero(&key, sizeof(key));
+    if (ret < 0) {
+        error(0, "Error in encrypting directory %s", dir_path);
+        return -1;
+    }
+
+    status_index_update(dir_path);
+    container_status(dir_path);
+    printf("Directory %s now encrypted\n", dir_path);
+    return 0;
+}
+
+// Use a password on the encrypted directory
+int container_attach(const char *dir_path)
+{
+    if (crypto_init() == -1) {
+        error(0, "Cannot access cryptography system");
+        return -1;
+    }
+
+    // Check that this directory has already been set up for encryption
+    struct ext4_encryption_policy policy;
+    if (vault_policy(dir_path, &policy) < 0) {
+        error(0, "Cannot decrypt %s", dir_path);
+        return -1;
+    }
+
+    struct vault_meta meta;
+    if (vault_meta_read(dir_path, &meta) < 0) {
+        error(0, "Cannot decrypt %s", dir_path);
+        return -1;
+    }
+    if (meta.flags & VAULT_META_KEYFILE) {
+        error(0, "Cannot decrypt %s with a passphrase: it is bound to a key file, use -k|--key-file", dir_path);
+        return -1;
+    }
+
+    int ret = request_key_for_descriptor(dir_path, &policy, &meta);
+    if (ret < 0) {
+        error(0, "Error in decrypting directory %s", dir_path);
+        return -1;
+    }
+    status_index_update(dir_path);
+
+    printf("Directory %s now decrypted%s\n", dir_path, (ret == 1) ? " (cached key)" : "");
+    return 0;
+}
+
+// Recrypt the encrypted directory
+int container_detach(const char *dir_path)
+{
+    struct ext4_encryption_policy policy;
+    if (vault_policy(dir_path, &policy) < 0 || vault_detach(dir_path) < 0)
+        return -1;
+    status_index_update(dir_path);
+
+    printf("Directory %s now recrypted\n", dir_path);
+    flush_caches_for(dir_path, &policy);
+    warn_stale_v1(stderr, policy.version != EXT4_POLICY_V2);
+    return 0;
+}
+
+// Without -C|--drop-caches the kernel keeps showing the names and contents of
+// v1 vaults it cached while decrypted: say so after recrypting n of them
+void warn_stale_v1(FILE *out, size_t n)
+{
+    if (n == 0 || drop_caches)
+        return;
+
+    fprintf(out, "Warning: cached names and contents of %zu v1 vault%s stay readable until the kernel "
+            "reclaims them, -C|--drop-caches drops them\n", n, (n > 1) ? "s" : "");
+}
+
+static
+uint64_t boottime_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Drop the dentry and inode caches of the whole machine (2), not the page cache
+// Write to procfs directly when permitted, otherwise ask sudo
+// Runs asking at the same time drop them once: the lock file records when the
+// last drop started, and one started after this request covers it
+int cache_drop_global_to(FILE *out)
+{
+    uint64_t requested = boottime_ns(), started = 0;
+    int lock = lock_take(LOCK_DROP_CACHES, LOCK_EX);
+    if (lock >= 0 && pread(lock, &started, sizeof(started), 0) == sizeof(started) && started > requested) {
+        lock_release(lock);
+        fprintf(out, "Filesystem cache updated by another run\n");
+        return 0;
+    }
+
+    fprintf(out, "Updating filesystem cache\n");
+    fflush(out);
+
+    started = boottime_ns();
+    TRACE_BEGIN(drop_caches);
+    int ret = -1;
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd != -1) {
+        sync();
+        ssize_t n = write(fd, "2", 1);
+        close(fd);
+        if (n == 1) ret = 0;
+    }
+
+    if (ret != 0 && system("echo 2 |sudo tee /proc/sys/vm/drop_caches >/dev/null") == 0) ret = 0;
+    TRACE_END(drop_caches);
+    // Without the record, a run waiting meanwhile only drops the caches again
+    if (ret == 0 && lock >= 0 && pwrite(lock, &started, sizeof(started), 0) != sizeof(started))
+        error(0, "Cannot record the cache drop: %s", strerror(errno));
+    lock_release(lock);
+    if (ret != 0) {
+        error(0, "Cannot drop filesystem caches");
+        return -1;
+    }
+
+    return 0;
+}
+
+int cache_drop_global()
+{
+    return cache_drop_global_to(stdout);
+}
+
+// Invalidate cached state after the key of the vault at dir_path with policy
+// was added or removed, and report it to out; the kernel itself evicts the
+// inodes of a v2 vault when its key is removed, and revalidates the names
+// cached without it
+int flush_caches_to(FILE *out, const char *dir_path, const struct ext4_encryption_policy *policy)
+{
+    if (policy->version == EXT4_POLICY_V2 && !drop_caches)
+        return 0;
+    if (drop_caches)
+        return cache_drop_global_to(out);
+
+    struct cache_stats stats;
+    TRACE_BEGIN(invalidate);
+    int ret = cache_invalidate_tree(dir_path, &stats);
+    TRACE_END(invalidate);
+    if (ret < 0)
+        return -1;
+
+    long page = sysconf(_SC_PAGESIZE);
+    fprintf(out, "Evicted %llu KiB of cached data from %lu files in %lu directories",
+            stats.pages * page / 1024, stats.files, stats.dirs);
+    if (stats.skipped) fprintf(out, " (%lu files skipped)", stats.skipped);
+    fprintf(out, "\n");
+    return 0;
+}
+
+int flush_caches_for(const char *dir_path, const struct ext4_encryption_policy *policy)
+{
+    return flush_caches_to(stdout, dir_path, policy);
+}
+
+// Invalidate cached state once after keys were added or removed for many directories
+int flush_caches_batch(char **dir_paths, size_t n)
+{
+    if (n == 0)
+        return 0;
+
+    if (drop_caches)
+        return cache_drop_global();
+
+    struct cache_stats total = { 0 };
+    int ret = 0;
+    for (size_t i = 0; i < n; i++) {
+        struct cache_stats stats;
+        TRACE_BEGIN(invalidate);
+        int invalidated = cache_invalidate_tree(dir_paths[i], &stats);
+        TRACE_END(invalidate);
+        if (invalidated < 0) {
+            ret = -1;
+            continue;
+        }
+        total.files += stats.files;
+        total.dirs += stats.dirs;
+        total.skipped += stats.skipped;
+        total.pages += stats.pages;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    printf("Evicted %llu KiB of cached data from %lu files in %zu vaults\n",
+            total.pages * page / 1024, total.files, n);
+    return ret;
+}
+
+// Calibrate the KDF cost of new vaults for target_ms and report the measurements
+int calibrate_host(unsigned target_ms)
+{
+    struct kdf_calibration cal;
+    int ret = kdf_calibrate(target_ms, &cal);
+    if (cal.lane_ms > 0) {
+        printf("Usable CPUs:          %u\n", cal.cpus);
+        printf("Memory bandwidth:     %.0f MiB/s\n", cal.bandwidth_mib_s);
+        printf("Lane time:            %.1f ms (N=%d, r=%u)\n", cal.lane_ms, SCRYPT_N, SCRYPT_R);
+    }
+    if (cal.N) {
+        printf("Selected cost:        N=%llu r=%u p=%u (%llu MiB)\n",
+                (unsigned long long) cal.N, cal.r, cal.p, cal.mem_mib);
+        printf("Unlock time:          %.0f ms (target %u ms)\n", cal.unlock_ms, target_ms);
+        if (cal.unlock_ms > target_ms)
+            printf("Target cannot be reached on this host, using the lowest cost\n");
+    }
+    if (ret == 0)
+        printf("Recorded in %s for new vaults\n", cal.path);
+    return ret;
+}
+
+// Print the phases of the traced operation as one JSON line to out, with
+// microseconds since the start of the operation
+void trace_report(FILE *out)
+{
+    const struct trace_record *record = trace_stop();
+    if (!record)
+        return;
+
+    char line[TRACE_MAX_PHASES * 96 + PATH_MAX * 2];
+    size_t len = snprintf(line, sizeof(line), "{\"op\":\"%s\",\"path\":", record->op);
+    if (record->path) len = json_string(line, sizeof(line), len, record->path);
+    else len += snprintf(line + len, sizeof(line) - len, "null");
+    len += snprintf(line + len, sizeof(line) - len, ",\"total_us\":%.0f,\"phases\":[", record->total_us);
+
+    for (unsigned i = 0; i < record->nphases && len < sizeof(line); i++) {
+        const struct trace_phase *phase = &record->phases[i];
+        double us = (phase->end_us < 0) ? record->total_us - phase->start_us : phase->end_us - phase->start_us;
+        len += snprintf(line + len, sizeof(line) - len, "%s{\"phase\":\"%s\",\"start_us\":%.0f,\"us\":%.0f}",
+                i ? "," : "", phase->name, phase->start_us, us);
+    }
+    if (len < sizeof(line))
+        len += snprintf(line + len, sizeof(line) - len, "],\"dropped\":%u}", record->dropped);
+
+    if (len >= sizeof(line)) len = sizeof(line) - 1;
+    fprintf(out, "%.*s\n", (int) len, line);
+}
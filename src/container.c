@@ -10,310 +10,599 @@
 #include <sys/vfs.h>
 #include <sys/ioctl.h>
 #include <asm-generic/ioctl.h>
-#include <assert.h>
+#include <sodium.h>
 #include <errno.h>
 
 #include "e2crypt.h"
 
-// Check if the given file path is on an ext4 filesystem
+// Open an existing directory on an ext4 filesystem
+// Return a file descriptor of the directory
 static
-bool is_ext4_filesystem(const char *path)
+int open_ext4_directory(const char *dir_path)
 {
     struct statfs fs;
 
-    if (statfs(path, &fs) != 0) {
-        error(0, "Cannot get filesystem information for %s: %s", path, strerror(errno));
-        return false;
+    if (statfs(dir_path, &fs) != 0)
+        return fail(E2CRYPT_ERR_SYSTEM, "Cannot get filesystem information for %s: %s",
+                dir_path, strerror(errno));
+
+    if (fs.f_type != EXT4_SUPER_MAGIC)
+        return fail(E2CRYPT_ERR_NOT_EXT4, "Error: %s not found on ext4 filesystem", dir_path);
+
+    int fd = open(dir_path, O_RDONLY | O_NONBLOCK | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOTDIR)
+            return fail(E2CRYPT_ERR_INVALID, "Invalid argument: %s not a directory", dir_path);
+
+        return fail(E2CRYPT_ERR_SYSTEM, "Cannot open %s: %s", dir_path, strerror(errno));
     }
 
-    return (fs.f_type == EXT4_SUPER_MAGIC);
+    return fd;
 }
 
-// Open an existing file on an ext4 filesystem
-// Return a read-only file descriptor
+// Read the encryption policy of either version of an open directory, without
+// reporting errors; for v2 the descriptor of policy holds the first bytes of
+// the key identifier, identifier (may be NULL) all of it
+// Return 1 with a policy, 0 without one, -1 with errno set on failure
+int vault_policy_fd(int dirfd, struct ext4_encryption_policy *policy, key_id_t *identifier)
+{
+    struct ext4_policy_ex_arg arg = { .policy_size = sizeof(arg.policy) };
+
+    if (ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY_EX, &arg) == 0) {
+        if (arg.policy.version == EXT4_POLICY_V2) {
+            policy->version = EXT4_POLICY_V2;
+            policy->contents_encryption_mode = arg.policy.v2.contents_encryption_mode;
+            policy->filenames_encryption_mode = arg.policy.v2.filenames_encryption_mode;
+            policy->flags = arg.policy.v2.flags;
+            memcpy(policy->master_key_descriptor, arg.policy.v2.master_key_identifier,
+                    sizeof(policy->master_key_descriptor));
+            if (identifier) memcpy(*identifier, arg.policy.v2.master_key_identifier, sizeof(key_id_t));
+        }
+        else {
+            *policy = arg.policy.v1;
+            if (identifier) memset(*identifier, 0, sizeof(key_id_t));
+        }
+        return 1;
+    }
+
+    // Kernels before 5.4 only know v1 policies
+    if (errno == ENOTTY && ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY, policy) == 0) {
+        if (identifier) memset(*identifier, 0, sizeof(key_id_t));
+        return 1;
+    }
+
+    return (errno == ENOENT || errno == ENODATA) ? 0 : -1;
+}
+
+// Query the kernel for inode encryption policy
 static
-int open_ext4_path(const char *path, int flags)
+int get_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy, key_id_t *identifier,
+        bool *has_policy)
 {
-    if (!is_ext4_filesystem(path)) {
-        error(0, "Error: %s not found on ext4 filesystem", path);
-        return -1;
+    TRACE_BEGIN(get_policy);
+    int ret = vault_policy_fd(dirfd, policy, identifier);
+    TRACE_END(get_policy);
+    *has_policy = (ret > 0);
+    if (ret >= 0)
+        return 0;
+
+    switch (errno) {
+        case ENOTSUP:
+            return fail(E2CRYPT_ERR_UNSUPPORTED, "This filesystem does not support encryption: "
+                    "make sure the kernel supports CONFIG_EXT4_ENCRYPTION");
+
+        case EOVERFLOW:
+        case EINVAL:
+            return fail(E2CRYPT_ERR_UNSUPPORTED, "Encryption policy of an unknown version");
+
+        default:
+            return fail(E2CRYPT_ERR_SYSTEM, "Cannot access ext4 encryption policy: %s",
+                    strerror(errno));
     }
+}
 
-    int open_flags = O_RDONLY | O_NONBLOCK | flags;
-    int fd = open(path, open_flags);
-    if (fd == -1) {
-        if (errno == ENOTDIR)
-            error(0, "Invalid argument: %s not a directory", path);
-        else
-            error(0, "Cannot open %s: %s", path, strerror(errno));
+// State of the key of the vault open at dirfd: EXT4_KEY_STATUS_*, or an E2CRYPT_ERR
+// code; serial (may be NULL) gets the keyring serial of a v1 key
+int vault_key_status_fd(int dirfd, const struct ext4_encryption_policy *policy, key_id_t *identifier,
+        key_serial_t *serial)
+{
+    if (policy->version != EXT4_POLICY_V2) {
+        key_serial_t key_serial;
+        key_desc_t key_desc;
+        memcpy(key_desc, policy->master_key_descriptor, sizeof(key_desc));
+        TRACE_BEGIN(key_status);
+        int ret = find_key_by_descriptor(&key_desc, &key_serial);
+        TRACE_END(key_status);
+        if (ret < 0)
+            return EXT4_KEY_STATUS_ABSENT;
+        if (serial) *serial = key_serial;
+        return EXT4_KEY_STATUS_PRESENT;
+    }
+
+    struct ext4_key_status_arg arg = { .key_spec.type = EXT4_KEY_SPEC_TYPE_IDENTIFIER };
+    memcpy(arg.key_spec.u.identifier, *identifier, sizeof(key_id_t));
+    TRACE_BEGIN(key_status);
+    int ret = ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_KEY_STATUS, &arg);
+    TRACE_END(key_status);
+    if (ret != 0)
+        return E2CRYPT_ERR_SYSTEM;
 
-        return -1;
+    return arg.status;
+}
+
+// Add the key of a v2 policy to the filesystem of dirfd
+// Return the identifier the kernel derived from it in identifier
+static
+int add_key_to_filesystem(int dirfd, const struct ext4_encryption_key *key, key_id_t *identifier)
+{
+    struct {
+        struct ext4_add_key_arg arg;
+        uint8_t raw[EXT4_MAX_KEY_SIZE];
+    } add = { .arg = { .key_spec.type = EXT4_KEY_SPEC_TYPE_IDENTIFIER, .raw_size = key->size } };
+    memcpy(add.arg.raw, key->raw, key->size);
+
+    TRACE_BEGIN(add_key);
+    int ret = ioctl(dirfd, EXT4_IOC_ADD_ENCRYPTION_KEY, &add);
+    int saved = errno;
+    TRACE_END(add_key);
+    sodium_memzero(&add.raw, sizeof(add.raw));
+    if (ret != 0) {
+        errno = saved;
+        if (errno == ENOTTY || errno == EOPNOTSUPP)
+            return fail(E2CRYPT_ERR_UNSUPPORTED, "This kernel does not support v2 encryption policies");
+        if (errno == EDQUOT)
+            return fail(E2CRYPT_ERR_QUOTA, "Cannot add key to the filesystem: key quota of the user reached, "
+                    "recrypt unused vaults or raise /proc/sys/kernel/keys/maxkeys and maxbytes");
+        return fail(E2CRYPT_ERR_KEYRING, "Cannot add key to the filesystem: %s", strerror(errno));
     }
 
-    return fd;
+    memcpy(*identifier, add.arg.key_spec.u.identifier, sizeof(key_id_t));
+    return 0;
 }
 
-// Open an existing directory on an ext4 filesystem
-// Return a file descriptor of the directory
+// Remove the key of a v2 policy from the filesystem of dirfd, which evicts
+// the inodes that use it; files still open keep it partly in place
 static
-int open_ext4_directory(const char *dir_path)
+int remove_key_from_filesystem(int dirfd, key_id_t *identifier)
 {
-    return open_ext4_path(dir_path, O_DIRECTORY);
+    struct ext4_remove_key_arg arg = { .key_spec.type = EXT4_KEY_SPEC_TYPE_IDENTIFIER };
+    memcpy(arg.key_spec.u.identifier, *identifier, sizeof(key_id_t));
+
+    TRACE_BEGIN(remove_key);
+    int ret = ioctl(dirfd, EXT4_IOC_REMOVE_ENCRYPTION_KEY, &arg);
+    TRACE_END(remove_key);
+    if (ret != 0) {
+        if (errno == ENOKEY)
+            return fail(E2CRYPT_ERR_NO_KEY, "Key not on the filesystem");
+        return fail(E2CRYPT_ERR_KEYRING, "Cannot remove key from the filesystem: %s", strerror(errno));
+    }
+
+    if (arg.removal_status_flags & EXT4_KEY_REMOVAL_STATUS_FLAG_FILES_BUSY)
+        return fail(E2CRYPT_ERR_BUSY, "Files are still in use: close them and recrypt again");
+
+    return 0;
 }
 
-// Query the kernel for inode encryption policy
+// Add key for the vault open at dirfd: v1 to the keyring, v2 to the filesystem
+// A v2 key whose identifier is not the one of the policy is a wrong key
 static
-int get_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy, bool *has_policy)
+int install_vault_key(int dirfd, const struct ext4_encryption_policy *policy, key_id_t *identifier,
+        const struct ext4_encryption_key *key)
 {
-    if (ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY, policy) < 0) {
-        switch (errno) {
-            case ENOENT:
-                *has_policy = false;
-                return 0;
+    if (policy->version != EXT4_POLICY_V2) {
+        key_desc_t key_desc;
+        memcpy(key_desc, policy->master_key_descriptor, sizeof(key_desc));
+        return install_key_for_descriptor(&key_desc, key);
+    }
 
-            case ENOTSUP:
-                error(0, "This filesystem does not support encryption");
-                error(0, "Make sure the kernel supports CONFIG_EXT4_ENCRYPTION");
-                return -1;
+    key_id_t added;
+    int ret = add_key_to_filesystem(dirfd, key, &added);
+    if (ret < 0)
+        return ret;
 
-            default:
-                error(0, "Cannot access ext4 encryption policy: %s", strerror(errno));
-                return -1;
-        }
+    if (memcmp(added, *identifier, sizeof(key_id_t)) != 0) {
+        remove_key_from_filesystem(dirfd, &added);
+        return fail(E2CRYPT_ERR_WRONG_PASSPHRASE, "Key does not match the vault");
     }
 
-    *has_policy = true;
     return 0;
 }
 
-// Apply the specified ext4 encryption policy to directory
+// Apply the specified ext4 encryption policy to directory, for v2 with
+// the key identifier instead of the descriptor
 static
-int set_ext4_encryption_policy(int dirfd, struct ext4_encryption_policy *policy)
+int set_ext4_encryption_policy(int dirfd, const struct ext4_encryption_policy *policy, key_id_t *identifier)
 {
-    if (ioctl(dirfd, EXT4_IOC_SET_ENCRYPTION_POLICY, policy) < 0) {
+    struct ext4_encryption_policy_v2 v2 = {
+        .version = EXT4_POLICY_V2,
+        .contents_encryption_mode = policy->contents_encryption_mode,
+        .filenames_encryption_mode = policy->filenames_encryption_mode,
+        .flags = policy->flags,
+    };
+    const void *arg = policy;
+    if (policy->version == EXT4_POLICY_V2) {
+        memcpy(v2.master_key_identifier, *identifier, sizeof(key_id_t));
+        arg = &v2;
+    }
+
+    TRACE_BEGIN(set_policy);
+    int ret = ioctl(dirfd, EXT4_IOC_SET_ENCRYPTION_POLICY, arg);
+    TRACE_END(set_policy);
+    if (ret < 0) {
         switch (errno) {
             case ENOTSUP:
-                error(0, "This filesystem does not support encryption");
-                error(0, "Make sure rhe kernel supports CONFIG_EXT4_ENCRYPTION");
-                return -1;
+                return fail(E2CRYPT_ERR_UNSUPPORTED, "This filesystem does not support encryption: "
+                        "make sure the kernel supports CONFIG_EXT4_ENCRYPTION");
 
             case EINVAL:
-                error(0, "Encryption parameters do not match the ones already set");
-                return -1;
+                return fail(E2CRYPT_ERR_UNSUPPORTED, "Ciphers %s and %s or policy version not supported "
+                        "by this kernel", cipher_mode_to_string(policy->contents_encryption_mode),
+                        cipher_mode_to_string(policy->filenames_encryption_mode));
+
+            case EEXIST:
+                return fail(E2CRYPT_ERR_ENCRYPTED,
+                        "Encryption parameters do not match the ones already set");
 
             case ENOTEMPTY:
-                error(0, "Cannot setup encrypted directory: not empty");
-                return -1;
+                return fail(E2CRYPT_ERR_NOT_EMPTY, "Cannot setup encrypted directory: not empty");
 
             default:
-                error(0, "Cannot set ext4 encryption policy: %s", strerror(errno));
-                return -1;
+                return fail(E2CRYPT_ERR_SYSTEM, "Cannot set ext4 encryption policy: %s",
+                        strerror(errno));
         }
     }
 
     return 0;
 }
 
-// Setup a new encryption policy for the specified directory
+// BUG? when the block is unmounted but no encrypted inode was created
+// Create dummy inode file here and unlink it immediately
 static
-int setup_ext4_encryption(const char *dir_path, int dirfd)
+int create_dummy_inode(int dirfd)
 {
-    struct ext4_encryption_policy policy;
-
-    // Current policy version
-    policy.version = 0;
+    char dummy_name[EXT4_KEY_DERIVATION_NONCE_SIZE+1];
+    generate_random_name(dummy_name, EXT4_KEY_DERIVATION_NONCE_SIZE, 1);
 
-    policy.contents_encryption_mode = cipher_string_to_mode(contents_cipher);
-    policy.filenames_encryption_mode = cipher_string_to_mode(filename_cipher);
-    policy.flags = padding_length_to_flags(padding);
+    int fd = openat(dirfd, dummy_name, O_NONBLOCK|O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, S_IRUSR|S_IWUSR);
+    if (fd == -1)
+        return fail(E2CRYPT_ERR_SYSTEM, "Cannot create nonce in directory: %s", strerror(errno));
 
-    generate_random_name(policy.master_key_descriptor, EXT4_KEY_DESCRIPTOR_SIZE, 0);
+    close(fd);
+    if (unlinkat(dirfd, dummy_name, 0) != 0)
+        return fail(E2CRYPT_ERR_SYSTEM, "Cannot unlink nonce in directory: %s", strerror(errno));
 
-    int ret = set_ext4_encryption_policy(dirfd, &policy);
-    container_status(dir_path);
-		return ret;
+    return 0;
 }
 
-// Print information about directory container
-int container_status(const char *dir_path)
+// Open the directory at dir_path and read its encryption policy
+// Return a file descriptor of the directory
+static
+int open_vault(const char *dir_path, struct ext4_encryption_policy *policy, key_id_t *identifier,
+        bool *has_policy)
 {
     int dirfd = open_ext4_directory(dir_path);
-    if (dirfd == -1) {
-        error(0, "Cannot open %s", dir_path);
-        return -1;
+    if (dirfd < 0)
+        return dirfd;
+
+    int ret = get_ext4_encryption_policy(dirfd, policy, identifier, has_policy);
+    if (ret < 0) {
+        close(dirfd);
+        return ret;
     }
 
-    struct ext4_encryption_policy policy;
-    bool has_policy;
+    return dirfd;
+}
 
-    if (get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0) {
-        error(0, "Cannot access directory properties of %s", dir_path);
-        return -1;
-    }
+// Open the vault at dir_path, failing for a regular directory
+static
+int open_encrypted_vault(const char *dir_path, struct ext4_encryption_policy *policy, key_id_t *identifier)
+{
+    bool has_policy;
+    int dirfd = open_vault(dir_path, policy, identifier, &has_policy);
+    if (dirfd < 0)
+        return dirfd;
 
     if (!has_policy) {
-        printf("Regular directory:    %s\n", dir_path);
-        return 1;
+        close(dirfd);
+        return fail(E2CRYPT_ERR_NOT_ENCRYPTED, "%s not an encrypted directory", dir_path);
     }
 
-    printf("Encrypted directory:  %s\n", dir_path);
-    printf("Policy version:       %d\n", policy.version);
-    printf("Filename cipher:      %s\n", cipher_mode_to_string(policy.filenames_encryption_mode));
-    printf("Contents cipher:      %s\n", cipher_mode_to_string(policy.contents_encryption_mode));
-    printf("Filename padding:     %d\n", flags_to_padding_length(policy.flags));
-    printf("Key descriptor:       ");
-    for (int i=0; i<EXT4_KEY_DESCRIPTOR_SIZE; ++i)
-        printf("%02x", policy.master_key_descriptor[i] & 0xff);
-    printf("\n");
-
-    key_serial_t key_serial;
-    if (find_key_by_descriptor(&policy.master_key_descriptor, &key_serial) == -1)
-        printf("Key serial:           [not found]\n");
-    else printf("Key serial:           %08x\n", key_serial);
+    return dirfd;
+}
+
+// Read the encryption policy of the directory at dir_path
+// Return E2CRYPT_ERR_NOT_ENCRYPTED for a regular directory
+int vault_policy(const char *dir_path, struct ext4_encryption_policy *policy)
+{
+    int dirfd = open_encrypted_vault(dir_path, policy, NULL);
+    if (dirfd < 0)
+        return dirfd;
 
+    close(dirfd);
     return 0;
 }
 
-// BUG? when the block is unmounted but no encrypted inode was created
-// Create dummy inode file here and unlink it immediately
-static
-int create_dummy_inode(int dirfd)
+// State of the key of the vault at dir_path: EXT4_KEY_STATUS_*, or an E2CRYPT_ERR code
+int vault_key_status(const char *dir_path)
 {
-    char dummy_name[EXT4_KEY_DERIVATION_NONCE_SIZE+1];
-    generate_random_name(dummy_name, EXT4_KEY_DERIVATION_NONCE_SIZE, 1);
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+    int dirfd = open_encrypted_vault(dir_path, &policy, &identifier);
+    if (dirfd < 0)
+        return dirfd;
 
-    int fd = openat(dirfd, dummy_name, O_NONBLOCK|O_CREAT|O_TRUNC|O_RDWR, S_IRUSR|S_IWUSR);
-    if (fd == -1) {
-        error(0, "Cannot create nonce in directory: %s", strerror(errno));
-        return -1;
-    }
+    int ret = vault_key_status_fd(dirfd, &policy, &identifier, NULL);
+    close(dirfd);
+    return ret;
+}
+
+// Gather information about the directory at dir_path
+int vault_status(const char *dir_path, struct e2crypt_status *status)
+{
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+    memset(status, 0, sizeof(*status));
 
-    if (unlinkat(dirfd, dummy_name, 0) != 0) {
-        error(0, "Cannot unlink nonce in directory: %s", strerror(errno));
-        return -1;
+    bool has_policy;
+    int dirfd = open_vault(dir_path, &policy, &identifier, &has_policy);
+    if (dirfd < 0) return dirfd;
+    if (!has_policy) {
+        close(dirfd);
+        return 0;
     }
 
-    close(fd);
+    status->encrypted = true;
+    status->policy_version = policy.version;
+    status->contents_cipher = cipher_mode_to_string(policy.contents_encryption_mode);
+    status->filenames_cipher = cipher_mode_to_string(policy.filenames_encryption_mode);
+    status->padding = flags_to_padding_length(policy.flags);
+    memcpy(status->descriptor, policy.master_key_descriptor, sizeof(status->descriptor));
+    memcpy(status->identifier, identifier, sizeof(status->identifier));
+
+    key_serial_t key_serial = 0;
+    int key_status = vault_key_status_fd(dirfd, &policy, &identifier, &key_serial);
+    close(dirfd);
+    status->key_present = (key_status == EXT4_KEY_STATUS_PRESENT);
+    status->key_busy = (key_status == EXT4_KEY_STATUS_INCOMPLETELY_REMOVED);
+    status->key_serial = key_serial;
+
+    struct vault_meta meta;
+    int ret = vault_meta_read(dir_path, &meta);
+    if (ret < 0)
+        return E2CRYPT_ERR_METADATA;
+
+    status->legacy_kdf = (ret > 0);
+    status->kdf_n = meta.kdf.N;
+    status->kdf_r = meta.kdf.r;
+    status->kdf_p = meta.kdf.p;
+    status->verifier = (meta.flags & VAULT_META_VERIFIER) != 0;
     return 0;
 }
 
-// Setup an encrypted directory at dir_path
-int container_create(const char *dir_path)
+// Setup an encrypted directory at dir_path with the template policy and the
+// metadata meta; its key is the start of the raw key in secret for a vault
+// bound to a key file, else derived from the family secret when given, else
+// from the passphrase
+static
+int create_vault(const char *dir_path, const struct ext4_encryption_policy *template,
+        struct vault_meta *meta, const struct ext4_encryption_key *secret,
+        const char *pass, size_t pass_sz, unsigned threads, struct ext4_encryption_key *key)
 {
-    if (crypto_init() == -1)
-        return -1;
-
-    int dirfd = open_ext4_directory(dir_path);
-    if (dirfd == -1)
-        return -1;
-
     struct ext4_encryption_policy policy;
     bool has_policy;
 
     // First check if the directory is not already encrypted
-    if (get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0) {
-        error(0, "Cannot access directory properties of %s", dir_path);
-        return -1;
-    }
+    int dirfd = open_vault(dir_path, &policy, NULL, &has_policy);
+    if (dirfd < 0)
+        return dirfd;
 
     if (has_policy) {
-        error(0, "Cannot encrypt directory %s: already encrypted", dir_path);
-        return -1;
-    }
-    else {
-        error(0, "Encrypting directory %s failed", dir_path);
-        return -1;
+        close(dirfd);
+        return fail(E2CRYPT_ERR_ENCRYPTED, "Cannot encrypt directory %s: already encrypted", dir_path);
     }
 
-    // Sets up the encryption policy
-    if (setup_ext4_encryption(dir_path, dirfd) < 0) {
-        error(0, "Error in encrypting directory %s", dir_path);
-        return -1;
+    policy = *template;
+    if (policy.version == EXT4_POLICY_AUTO) {
+        struct ext4_policy_ex_arg arg = { .policy_size = sizeof(arg.policy) };
+        bool v2 = (ioctl(dirfd, EXT4_IOC_GET_ENCRYPTION_POLICY_EX, &arg) == 0 || errno != ENOTTY);
+        policy.version = v2 ? EXT4_POLICY_V2 : EXT4_POLICY_V1;
+    }
+    randombytes_buf(policy.master_key_descriptor, sizeof(policy.master_key_descriptor));
+
+    // Derive the key before touching the directory, so that a failure leaves it as it was
+    memset(key, 0, sizeof(*key));
+    key->size = policy_key_size(&policy);
+    if ((meta->flags & VAULT_META_KEYFILE) && secret->size < key->size) {
+        close(dirfd);
+        return fail(E2CRYPT_ERR_INVALID, "Key of %u bytes too short for the policy of %s", secret->size, dir_path);
+    }
+    if (meta->flags & VAULT_META_KEYFILE) memcpy(key->raw, secret->raw, key->size);
+    else if (secret) family_key(secret, meta, key);
+    else if (derive_passphrase_to_key(pass, pass_sz, &meta->kdf, key, threads) < 0) {
+        close(dirfd);
+        return fail(E2CRYPT_ERR_CRYPTO, "Failed to derive key from passphrase");
     }
 
-    // Attach a key to the directory
-    if (request_key_for_descriptor(&policy.master_key_descriptor, true) < 0) {
-        error(0, "Error seting password for encrypted directory %s", dir_path);
-        return -1;
+    // The kernel names a v2 key by a hash of it, which is known only once it was added
+    key_id_t identifier;
+    bool added = false;
+    int ret = 0;
+    if (policy.version == EXT4_POLICY_V2) {
+        ret = add_key_to_filesystem(dirfd, key, &identifier);
+        added = (ret == 0);
+        memcpy(policy.master_key_descriptor, identifier, sizeof(policy.master_key_descriptor));
     }
+    vault_verifier_set(meta, &policy.master_key_descriptor, key);
+
+    if (ret == 0)
+        ret = set_ext4_encryption_policy(dirfd, &policy, &identifier);
+    if (ret == 0 && vault_meta_write(dirfd, meta) < 0)
+        ret = E2CRYPT_ERR_METADATA;
+    if (ret == 0 && policy.version != EXT4_POLICY_V2)
+        ret = install_key_for_descriptor(&policy.master_key_descriptor, key);
 
     // The directory is left in an inconsistent state if the superblock is unmounted before any inode is created
-    if (create_dummy_inode(dirfd) < 0) return -1;
+    if (ret == 0)
+        ret = create_dummy_inode(dirfd);
+
+    // Take the key off the filesystem again, keeping the message of the first failure
+    if (ret < 0 && added) {
+        struct ext4_remove_key_arg arg = { .key_spec.type = EXT4_KEY_SPEC_TYPE_IDENTIFIER };
+        memcpy(arg.key_spec.u.identifier, identifier, sizeof(key_id_t));
+        ioctl(dirfd, EXT4_IOC_REMOVE_ENCRYPTION_KEY, &arg);
+    }
 
-    printf("Directory %s now encrypted\n", dir_path);
     close(dirfd);
-    return 0;
+    return ret;
 }
 
-// Use a password on the encrypted directory
-int container_attach(const char *dir_path)
+// Setup an encrypted directory at dir_path with the version, ciphers and
+// padding of the template policy, and add the key derived from the passphrase
+// The key is returned in key for the caller to cache
+int vault_create(const char *dir_path, const struct ext4_encryption_policy *template,
+        const char *pass, size_t pass_sz, unsigned threads, struct ext4_encryption_key *key)
 {
-    if (crypto_init() == -1) {
-        error(0, "Cannot access cryptography system");
-        return -1;
-    }
-
-    int dirfd = open_ext4_directory(dir_path);
-    if (dirfd == -1) {
-        error(0, "Cannot open directory %s", dir_path);
-        return -1;
-    }
-
-    struct ext4_encryption_policy policy;
-    bool has_policy;
+    struct vault_meta meta = { .flags = 0 };
+    kdf_vault_params(&meta.kdf);
+    return create_vault(dir_path, template, &meta, NULL, pass, pass_sz, threads, key);
+}
 
-    // Check that this directory has already been set up for encryption
-    if (get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0) {
-        error(0, "Not an encrypted directory: %s", dir_path);
-        return -1;
+// Setup an encrypted directory at dir_path like vault_create, as a vault of
+// the key family of the vault member, or of a new family when member is NULL
+// Its key comes from the family secret and a nonce of its own, so that one
+// run of the KDF unlocks every vault of the family
+int vault_create_family(const char *dir_path, const struct ext4_encryption_policy *template,
+        const char *member, const char *pass, size_t pass_sz, unsigned threads,
+        struct ext4_encryption_key *key)
+{
+    struct vault_meta meta = { .flags = VAULT_META_FAMILY };
+    struct vault_meta member_meta;
+    struct ext4_encryption_policy member_policy;
+
+    if (member) {
+        int ret = vault_policy(member, &member_policy);
+        if (ret < 0)
+            return ret;
+        ret = vault_meta_read(member, &member_meta);
+        if (ret < 0)
+            return E2CRYPT_ERR_METADATA;
+        if (ret > 0 || !(member_meta.flags & VAULT_META_FAMILY))
+            return fail(E2CRYPT_ERR_INVALID, "Vault %s is not part of a key family", member);
+        meta.kdf = member_meta.kdf;
     }
-
-    if (!has_policy) {
-        error(0, "Cannot decrypt: %s not an encrypted directory", dir_path);
-        return -1;
+    else kdf_vault_params(&meta.kdf);
+    randombytes_buf(meta.family_nonce, sizeof(meta.family_nonce));
+
+    struct ext4_encryption_key *secret = sodium_malloc(sizeof(*secret));
+    if (!secret)
+        return fail(E2CRYPT_ERR_SYSTEM, "Cannot allocate memory for the family secret");
+    if (family_secret(pass, pass_sz, &meta, secret, threads) < 0) {
+        sodium_free(secret);
+        return fail(E2CRYPT_ERR_CRYPTO, "Failed to derive key from passphrase");
     }
 
-    if (request_key_for_descriptor(&policy.master_key_descriptor, false) < 0) {
-        error(0, "Error in decrypting directory %s", dir_path);
-        return -1;
+    // A vault joining a family must share its passphrase: check it on the member
+    if (member) {
+        struct ext4_encryption_key member_key = { .size = policy_key_size(&member_policy) };
+        family_key(secret, &member_meta, &member_key);
+        bool same = vault_verifier_check(&member_meta, &member_policy.master_key_descriptor, &member_key);
+        sodium_memzero(&member_key, sizeof(member_key));
+        if (!same) {
+            sodium_free(secret);
+            return fail(E2CRYPT_ERR_WRONG_PASSPHRASE, "Wrong passphrase for the family of %s", member);
+        }
     }
 
-    close(dirfd);
-    printf("Directory %s now decrypted\n", dir_path);
-    system("echo 'Updating filesystem cache'; echo 2 |sudo tee /proc/sys/vm/drop_caches >/dev/null");
-    return 0;
+    int ret = create_vault(dir_path, template, &meta, secret, NULL, 0, threads, key);
+    sodium_free(secret);
+    return ret;
 }
 
-// Recrypt the encrypted directory
-int container_detach(const char *dir_path)
+// Setup an encrypted directory at dir_path like vault_create, bound to the
+// raw key given instead of a passphrase: no KDF runs to create or unlock it
+int vault_create_raw(const char *dir_path, const struct ext4_encryption_policy *template,
+        const struct ext4_encryption_key *raw, struct ext4_encryption_key *key)
 {
-    int dirfd = open_ext4_directory(dir_path);
-    if (dirfd == -1) {
-        error(0, "Cannot open directory %s", dir_path);
-        return -1;
-    }
+    struct vault_meta meta = { .flags = VAULT_META_KEYFILE };
+    kdf_vault_params(&meta.kdf);
+    return create_vault(dir_path, template, &meta, raw, NULL, 0, 0, key);
+}
 
+// Derive the key of the vault at dir_path and check it against its verifier
+int vault_derive_key(const char *dir_path, const char *pass, size_t pass_sz, unsigned threads,
+        struct ext4_encryption_key *key)
+{
     struct ext4_encryption_policy policy;
-    bool has_policy;
-
-    // Check that this directory is setup for encryption
-    if (get_ext4_encryption_policy(dirfd, &policy, &has_policy) < 0) {
-        error(0, "Cannot access directory properties of %s", dir_path);
-        return -1;
+    int ret = vault_policy(dir_path, &policy);
+    if (ret < 0)
+        return ret;
+
+    struct vault_meta meta;
+    if (vault_meta_read(dir_path, &meta) < 0)
+        return E2CRYPT_ERR_METADATA;
+
+    memset(key, 0, sizeof(*key));
+    key->size = policy_key_size(&policy);
+    if (derive_meta_key(pass, pass_sz, &meta, key, threads) < 0)
+        return fail(E2CRYPT_ERR_CRYPTO, "Failed to derive key from passphrase");
+
+    if (!vault_verifier_check(&meta, &policy.master_key_descriptor, key)) {
+        sodium_memzero(key, sizeof(*key));
+        return fail(E2CRYPT_ERR_WRONG_PASSPHRASE, "Wrong passphrase for %s", dir_path);
     }
 
-    if (!has_policy) {
-        error(0, "Cannot recrypt, directory %s not set up for encryption", dir_path);
-        return -1;
-    }
+    return 0;
+}
 
-    if (remove_key_for_descriptor(&policy.master_key_descriptor) < 0) {
-        error(0, "Cannot recrypt, directory %s not decrypted", dir_path);
-        return -1;
+// Add an already derived key for the vault at dir_path, a v1 key to the
+// keyring, a v2 key to the filesystem
+int vault_attach_key(const char *dir_path, const struct ext4_encryption_key *key)
+{
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+    int dirfd = open_encrypted_vault(dir_path, &policy, &identifier);
+    if (dirfd < 0)
+        return dirfd;
+
+    int ret = 0;
+    if (key->size != policy_key_size(&policy))
+        ret = fail(E2CRYPT_ERR_INVALID, "Key of %u bytes does not fit the policy of %s",
+                key->size, dir_path);
+    else {
+        struct vault_lock lock;
+        vault_lock(&policy, &lock);
+        ret = install_vault_key(dirfd, &policy, &identifier, key);
+        vault_unlock(&lock);
     }
 
     close(dirfd);
-    printf("Directory %s now recrypted\n", dir_path);
-    system("echo 'Updating filesystem cache'; echo 2 |sudo tee /proc/sys/vm/drop_caches >/dev/null");
-    return 0;
+    return ret;
+}
+
+// Remove the key of the vault at dir_path
+// For v2 the kernel also evicts the cached inodes, except those of open files:
+// then E2CRYPT_ERR_BUSY is returned, and recrypting again finishes the job
+int vault_detach(const char *dir_path)
+{
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+    int dirfd = open_encrypted_vault(dir_path, &policy, &identifier);
+    if (dirfd < 0)
+        return dirfd;
+
+    // The check and the removal go together, against a run adding the key in between
+    struct vault_lock lock;
+    vault_lock(&policy, &lock);
+
+    int ret = 0;
+    if (vault_key_status_fd(dirfd, &policy, &identifier, NULL) == EXT4_KEY_STATUS_ABSENT)
+        ret = fail(E2CRYPT_ERR_NO_KEY, "Cannot recrypt, directory %s not decrypted", dir_path);
+    else if (policy.version == EXT4_POLICY_V2)
+        ret = remove_key_from_filesystem(dirfd, &identifier);
+    else if (remove_key_for_descriptor(&policy.master_key_descriptor) < 0)
+        ret = E2CRYPT_ERR_KEYRING;
+
+    vault_unlock(&lock);
+    close(dirfd);
+    return ret;
 }
@@ -7,40 +7,93 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
-#include <stdarg.h>
 #include <string.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 
 #include "e2crypt.h"
 
 char *contents_cipher = "aes-256-xts";
 char *filename_cipher = "aes-256-cts";
 unsigned padding = 0;
+unsigned policy_version = 0;
+bool drop_caches = false;
+unsigned cache_ttl = 0;
+const char *key_family = NULL;
+const char *key_file = NULL;
 int usage_showed = 0;
 
+#define DEFAULT_NAME_SPECS "20000:1-12 and 20000:13-40"
+#define MAX_NAME_SPECS 8
+#define DEFAULT_BLOCK_SIZES "4,128,1024"
+#define DEFAULT_IO_SIZE 64
+
 static
 void usage(FILE *std)
 {
     fprintf(std, "%s - userspace tool to manage encrypted directories on ext4 filesystems\n\n", NAME);
-    fprintf(std, "USAGE: %s [ [-p <len>] -i|--init | -d|--decrypt | -e|--encrypt ] <dir>\n", NAME);
+    fprintf(std, "USAGE: %s [ [-p <len>] [-P <v>] [-M <cipher>] -i|--init | -d|--decrypt | -e|--encrypt ] <dir>...\n", NAME);
     fprintf(std, "    -p|--padding <len>:  Padding of filename (4, 8, 16 or 32, default 4)\n");
+    fprintf(std, "    -P|--policy <v>:     Encryption policy version 1 or 2 (default 2 when supported)\n");
+    fprintf(std, "    -M|--cipher <c>:     Contents cipher aes-256-xts (default), aes-128-cbc, adiantum or sm4-xts,\n");
+    fprintf(std, "                         ':<filenames cipher>' may follow; 'auto': the fastest of 256 bits\n");
+    fprintf(std, "    -G|--family <vault>: Derive the key from the key family of <vault>, one passphrase and one\n");
+    fprintf(std, "                         KDF run unlocking them all; 'new': start a family\n");
+    fprintf(std, "    -k|--key-file <file>:\n");
+    fprintf(std, "                         With -i, bind the vault to the raw key in <file>, created when missing;\n");
+    fprintf(std, "                         with -d, unlock with it, no passphrase ('-': stdin, <n>: descriptor)\n");
     fprintf(std, "    -i|--init <dir>:     Initialize empty directory for encryption <dir>\n");
     fprintf(std, "    -d|--decrypt <dir>:  Decrypt initialized directory <dir>\n");
     fprintf(std, "    -e|--encrypt <dir>:  Encrypt initialized directory <dir>\n");
+    fprintf(std, "    -C|--drop-caches:    Drop all system caches (sudo) instead of the directory's\n");
+    fprintf(std, "    -f|--from <file>:    Also decrypt/encrypt the directories listed in <file> ('-': stdin)\n");
+    fprintf(std, "    -W|--prewarm <depth>:\n");
+    fprintf(std, "                         After decrypting, load <depth> levels of the vault in cache (0: all)\n");
+    fprintf(std, "    -R|--readahead <MiB>:\n");
+    fprintf(std, "                         While prewarming, also read ahead files used last week, up to <MiB>\n");
+    fprintf(std, "    -x|--trace:          Print the time of each phase as JSON to stderr (also E2CRYPT_TRACE=1)\n");
+    fprintf(std, "    -j|--jobs <n>:       Derive at most <n> keys, or scan with <n> threads (default: automatic)\n");
+    fprintf(std, "    -s|--scan <root>:    List all encrypted directories below <root> as NDJSON\n");
+    fprintf(std, "    -I|--ingest <src>:   Copy the tree <src> into the vault <dir>, initializing it when empty\n");
+    fprintf(std, "    -c|--calibrate <ms>: Pick the KDF cost of new vaults for unlocking in <ms> on this host\n");
+    fprintf(std, "    -B|--cipher-bench <bits>:\n");
+    fprintf(std, "                         Measure the contents ciphers, recommend the fastest of <bits> (128 or 256)\n");
+    fprintf(std, "    -b|--bench-padding <dir>:\n");
+    fprintf(std, "                         Measure lookups in vaults of each filename padding created below <dir>\n");
+    fprintf(std, "    -n|--names <n>:<min>-<max>:\n");
+    fprintf(std, "                         Fill them with <n> names of <min> to <max> bytes (repeatable,\n");
+    fprintf(std, "                         default %s)\n", DEFAULT_NAME_SPECS);
+    fprintf(std, "    -O|--bench-io <dir>: Measure reads and writes in the decrypted vault <dir> against plaintext\n");
+    fprintf(std, "    -z|--block-size <KiB>,...:\n");
+    fprintf(std, "                         Block sizes to measure (default %s)\n", DEFAULT_BLOCK_SIZES);
+    fprintf(std, "    -Z|--io-size <MiB>:  Size of the file of each thread (default %d), -j sets the threads\n",
+            DEFAULT_IO_SIZE);
+    fprintf(std, "    -D|--direct:         Measure with O_DIRECT\n");
+    fprintf(std, "    -y|--fsync:          Sync each write to disk\n");
+    fprintf(std, "    -T|--cache <secs>:   Cache derived keys in the keyring for <secs> seconds\n");
+    fprintf(std, "    -F|--flush-cache:    Remove all cached keys from the keyring\n");
+    fprintf(std, "    -A|--agent:          Run an agent that keeps derived keys and serves requests\n");
+    fprintf(std, "    -t|--ttl <secs>:     Seconds the agent keeps a key (default %d)\n", AGENT_DEFAULT_TTL);
+    fprintf(std, "    -S|--socket <path>:  Agent socket to serve or to send requests to\n");
+    fprintf(std, "    -L|--autolock <secs>:\n");
+    fprintf(std, "                         Watch the vaults <dir>... and encrypt each after <secs> without access\n");
+    fprintf(std, "    -K|--cached:         Display the state of many <dir>... from the status index, one per line\n");
     fprintf(std, "  No options: display encryption information on directory <dir>\n");
+    fprintf(std, "  Several directories can be given to -d|--decrypt and -e|--encrypt\n");
+    fprintf(std, "  An interrupted -I|--ingest continues where it stopped when run again\n");
 }
 
-void error(bool show_usage, const char *fmt, ...)
+// Print the errors of the library and of the commands, with the usage once
+static
+void print_error(bool show_usage, const char *msg)
 {
-		if (show_usage && (!usage_showed++)) {
+    if (show_usage && (!usage_showed++)) {
         usage(stderr);
         fprintf(stderr, "\n");
     }
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    fprintf(stderr, "\n");
-    va_end(args);
+    fprintf(stderr, "%s\n", msg);
 }
 
 static
@@ -49,16 +102,171 @@ bool is_valid_padding(unsigned padding)
     return (padding == 4 || padding == 8 || padding == 16 || padding == 32);
 }
 
+// Set the ciphers of new vaults from '<contents>[:<filenames>]' or 'auto'
+static
+void parse_cipher(char *arg)
+{
+    if (strcmp(arg, "auto") == 0) {
+        contents_cipher = arg;
+        return;
+    }
+
+    char *filenames = strchr(arg, ':');
+    if (filenames) *filenames++ = 0;
+
+    int contents_mode = -1, filenames_mode = -1;
+    for (size_t i = 1; i < NR_EXT4_ENCRYPTION_MODES; i++) {
+        if (strcmp(arg, cipher_modes[i].cipher_name) == 0) contents_mode = i;
+        if (filenames && strcmp(filenames, cipher_modes[i].cipher_name) == 0) filenames_mode = i;
+    }
+    if (contents_mode < 0 || !cipher_modes[contents_mode].filenames_mode) {
+        error(1, "Invalid contents cipher: %s", arg);
+        return;
+    }
+    if (!filenames) filenames_mode = cipher_modes[contents_mode].filenames_mode;
+    if (filenames_mode < 0 || !cipher_pair_valid(contents_mode, filenames_mode)) {
+        error(1, "Invalid filenames cipher for %s: %s", arg, filenames);
+        return;
+    }
+
+    contents_cipher = (char *) cipher_modes[contents_mode].cipher_name;
+    filename_cipher = (char *) cipher_modes[filenames_mode].cipher_name;
+}
+
+// Add the names of a padding benchmark from '<count>:<min>-<max>'
+static
+void parse_name_spec(const char *arg, struct name_spec *specs, size_t *n)
+{
+    struct name_spec spec;
+    if (sscanf(arg, "%u:%u-%u", &spec.count, &spec.min_len, &spec.max_len) != 3
+            || spec.count == 0 || spec.min_len == 0 || spec.min_len > spec.max_len || spec.max_len > NAME_MAX) {
+        error(1, "Invalid names %s: must be <count>:<min>-<max>, lengths 1 to %d", arg, NAME_MAX);
+        return;
+    }
+    if (*n == MAX_NAME_SPECS) {
+        error(1, "At most %d -n|--names allowed", MAX_NAME_SPECS);
+        return;
+    }
+    specs[(*n)++] = spec;
+}
+
+// Set the block sizes of an I/O benchmark from '<KiB>,<KiB>...'
+static
+void parse_block_sizes(const char *arg, struct io_bench_spec *spec)
+{
+    char *list = strdup(arg), *save = NULL;
+    spec->nblocks = 0;
+    for (char *tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int kib = atoi(tok);
+        if (kib <= 0 || kib > (1 << 20) || (kib & (kib - 1)) != 0) {
+            error(1, "Invalid block size %s: must be a power of two of KiB", tok);
+            break;
+        }
+        if (spec->nblocks == MAX_BLOCK_SIZES) {
+            error(1, "At most %d block sizes allowed", MAX_BLOCK_SIZES);
+            break;
+        }
+        spec->block_kib[spec->nblocks++] = kib;
+    }
+    free(list);
+}
+
+// Append a directory to the list of directories to process
+static
+void add_dir(char ***dirs, size_t *n, char *dir)
+{
+    char **grown = realloc(*dirs, (*n + 1) * sizeof(**dirs));
+    if (!grown) {
+        error(0, "Cannot allocate memory for directory list");
+        exit(EXIT_FAILURE);
+    }
+    *dirs = grown;
+    (*dirs)[(*n)++] = dir;
+}
+
+// Read a manifest with one directory per line, skipping blank lines and # comments
+static
+int read_manifest(const char *path, char ***dirs, size_t *n)
+{
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!f) {
+        error(0, "Cannot open manifest %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t line_sz = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_sz, f)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = 0;
+        if (len == 0 || line[0] == '#') continue;
+        add_dir(dirs, n, strdup(line));
+    }
+
+    free(line);
+    if (f != stdin) fclose(f);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int c;
     char command = 0;
     char *dir_path = "";
+    char *manifest = NULL;
+    char *src_path = NULL;
+    unsigned jobs = 0;
+    bool agent = false;
+    bool flush_cache = false;
+    unsigned calibrate = 0;
+    unsigned bench_bits = 0;
+    char *bench_padding = NULL;
+    struct name_spec name_specs[MAX_NAME_SPECS];
+    size_t nname_specs = 0;
+    bool cipher_set = false;
+    unsigned ttl = 0;
+    unsigned autolock = 0;
+    bool cached = false;
+    struct io_bench_spec io_spec = { .size_mib = DEFAULT_IO_SIZE };
+    bool io_set = false;
+    int prewarm_depth = -1;
+    unsigned readahead_mib = 0;
+    char sock_path[PATH_MAX] = "";
 
-    const char *optstring = ":hp:i:d:e:";
+    error_set_handler(print_error);
+
+    const char *optstring = ":hCxKDyO:z:Z:W:R:p:P:M:G:k:B:b:n:i:d:e:f:j:T:FAt:S:L:c:s:I:";
     static struct option longopts[] = {
         { "help", no_argument, 0, 'h' },
         { "padding", required_argument, 0, 'p' },
+        { "policy", required_argument, 0, 'P' },
+        { "cipher", required_argument, 0, 'M' },
+        { "family", required_argument, 0, 'G' },
+        { "key-file", required_argument, 0, 'k' },
+        { "cipher-bench", required_argument, 0, 'B' },
+        { "bench-padding", required_argument, 0, 'b' },
+        { "names", required_argument, 0, 'n' },
+        { "bench-io", required_argument, 0, 'O' },
+        { "block-size", required_argument, 0, 'z' },
+        { "io-size", required_argument, 0, 'Z' },
+        { "direct", no_argument, 0, 'D' },
+        { "fsync", no_argument, 0, 'y' },
+        { "drop-caches", no_argument, 0, 'C' },
+        { "trace", no_argument, 0, 'x' },
+        { "cached", no_argument, 0, 'K' },
+        { "prewarm", required_argument, 0, 'W' },
+        { "readahead", required_argument, 0, 'R' },
+        { "from", required_argument, 0, 'f' },
+        { "jobs", required_argument, 0, 'j' },
+        { "cache", required_argument, 0, 'T' },
+        { "calibrate", required_argument, 0, 'c' },
+        { "scan", required_argument, 0, 's' },
+        { "ingest", required_argument, 0, 'I' },
+        { "flush-cache", no_argument, 0, 'F' },
+        { "agent", no_argument, 0, 'A' },
+        { "ttl", required_argument, 0, 't' },
+        { "socket", required_argument, 0, 'S' },
+        { "autolock", required_argument, 0, 'L' },
         { "init", required_argument, 0, 'i' },
         { "decrypt", required_argument, 0, 'd' },
         { "encrypt", required_argument, 0, 'e' },
@@ -71,19 +279,94 @@ int main(int argc, char *argv[])
 
         switch (c) {
             case 'h': usage(stdout); return EXIT_SUCCESS;
+            case 'C': drop_caches = true; break;
+            case 'x': trace_enable(true); break;
+            case 'K': cached = true; break;
+            case 'W':
+                if (atoi(optarg) < 0) error(1, "Option -W|--prewarm requires a depth, 0 for the whole vault");
+                else prewarm_depth = atoi(optarg);
+                break;
+            case 'R':
+                if (atoi(optarg) <= 0) error(1, "Option -R|--readahead requires a positive number of MiB");
+                else readahead_mib = atoi(optarg);
+                break;
+            case 'f': manifest = optarg; break;
+            case 'j':
+                if (atoi(optarg) <= 0) error(1, "Option -j|--jobs requires a positive number");
+                else jobs = atoi(optarg);
+                break;
             case 'p':
                 if (optarg == 0) error(1, "Option -%c requires padding as an argument", c);
                 else padding = atoi(optarg);
                 if (!is_valid_padding(padding))
                     error(1, "Invalid filename padding length: must be 4, 8, 16 or 32");
                 break;
+            case 'P':
+                policy_version = atoi(optarg);
+                if (policy_version != 1 && policy_version != 2)
+                    error(1, "Invalid policy version: must be 1 or 2");
+                break;
+            case 'M':
+                parse_cipher(optarg);
+                cipher_set = true;
+                break;
+            case 'G': key_family = optarg; break;
+            case 'k': key_file = optarg; break;
+            case 'B':
+                bench_bits = atoi(optarg);
+                if (bench_bits != 128 && bench_bits != 256)
+                    error(1, "Option -B|--cipher-bench requires a security level of 128 or 256 bits");
+                break;
+            case 'b': bench_padding = optarg; break;
+            case 'n': parse_name_spec(optarg, name_specs, &nname_specs); break;
+            case 'O': io_spec.vault = optarg; break;
+            case 'z':
+                parse_block_sizes(optarg, &io_spec);
+                io_set = true;
+                break;
+            case 'Z':
+                if (atoi(optarg) <= 0) error(1, "Option -Z|--io-size requires a positive number of MiB");
+                else io_spec.size_mib = atoi(optarg);
+                io_set = true;
+                break;
+            case 'D': io_spec.direct = io_set = true; break;
+            case 'y': io_spec.fsync = io_set = true; break;
+            case 'T':
+                if (atoi(optarg) <= 0) error(1, "Option -T|--cache requires a positive number of seconds");
+                else cache_ttl = atoi(optarg);
+                break;
+            case 'F': flush_cache = true; break;
+            case 'c':
+                if (atoi(optarg) <= 0) error(1, "Option -c|--calibrate requires a positive number of milliseconds");
+                else calibrate = atoi(optarg);
+                break;
+            case 'A': agent = true; break;
+            case 't':
+                if (atoi(optarg) <= 0) error(1, "Option -t|--ttl requires a positive number of seconds");
+                else ttl = atoi(optarg);
+                break;
+            case 'S': snprintf(sock_path, sizeof(sock_path), "%s", optarg); break;
+            case 'L':
+                if (atoi(optarg) <= 0) error(1, "Option -L|--autolock requires a positive number of seconds");
+                else autolock = atoi(optarg);
+                break;
             case 'i':
             case 'd':
             case 'e':
+            case 's':
                 if (optarg == 0) error(1, "Option -%c requires a directory as an argument", c);
+                // Allow the directories to come from -f|--from only: '-e -f list'
+                else if (c != 'i' && optarg[0] == '-' && optarg[1] && optarg == argv[optind - 1])
+                    optind--;
                 else dir_path = optarg;
                 if (command)
-                    error(1, "Only one of -i|--init, -d|--decrypt and -e|--encrypt allowed");
+                    error(1, "Only one of -i|--init, -d|--decrypt, -e|--encrypt, -s|--scan and -I|--ingest allowed");
+                command = c;
+                break;
+            case 'I':
+                if (command)
+                    error(1, "Only one of -i|--init, -d|--decrypt, -e|--encrypt, -s|--scan and -I|--ingest allowed");
+                src_path = optarg;
                 command = c;
                 break;
             case ':': error(1, "Missing argument to -%c", optopt); break;
@@ -91,21 +374,164 @@ int main(int argc, char *argv[])
             default: error(1, "Invalid command option -%c", optopt);
         }
     }
-    if (padding && command != 'i')
-        error(1, "Option -p|--padding only allowed with -i/--init");
+    if (padding && command != 'i' && command != 'I')
+        error(1, "Option -p|--padding only allowed with -i/--init or -I|--ingest");
     if (!padding) padding = 4;
+    if (policy_version && command != 'i' && command != 'I' && !bench_padding)
+        error(1, "Option -P|--policy only allowed with -i/--init, -I|--ingest or -b|--bench-padding");
+    if (cipher_set && command != 'i' && command != 'I' && !bench_padding)
+        error(1, "Option -M|--cipher only allowed with -i/--init, -I|--ingest or -b|--bench-padding");
+    if (key_family && command != 'i' && command != 'I')
+        error(1, "Option -G|--family only allowed with -i/--init or -I|--ingest");
+    if (key_file && command != 'i' && command != 'd' && command != 'I')
+        error(1, "Option -k|--key-file only allowed with -i/--init, -d|--decrypt or -I|--ingest");
+    if (key_file && (key_family || cache_ttl))
+        error(1, "Option -k|--key-file cannot be combined with -G|--family or -T|--cache");
+    if (autolock && command)
+        error(1, "Option -L|--autolock takes the directories to watch, no other command");
+    if (drop_caches && command != 'd' && command != 'e' && !autolock && !bench_padding)
+        error(1, "Option -C|--drop-caches only allowed with -d|--decrypt, -e|--encrypt, -L|--autolock "
+                "or -b|--bench-padding");
+    if (prewarm_depth >= 0 && command != 'd')
+        error(1, "Option -W|--prewarm only allowed with -d|--decrypt");
+    if (readahead_mib && prewarm_depth < 0)
+        error(1, "Option -R|--readahead only allowed with -W|--prewarm");
+    if (nname_specs && !bench_padding)
+        error(1, "Option -n|--names only allowed with -b|--bench-padding");
+    if (io_set && !io_spec.vault)
+        error(1, "Options -z|--block-size, -Z|--io-size, -D|--direct and -y|--fsync only allowed with -O|--bench-io");
+
+    if (cached && command)
+        error(1, "Option -K|--cached only allowed without a command, for the status");
+    if (manifest && command != 'd' && command != 'e' && !autolock && !cached)
+        error(1, "Option -f|--from only allowed with -d|--decrypt, -e|--encrypt, -L|--autolock or -K|--cached");
+    if (jobs && command != 'd' && command != 'e' && command != 's' && command != 'I' && !autolock && !io_spec.vault)
+        error(1, "Option -j|--jobs only allowed with -d|--decrypt, -e|--encrypt, -s|--scan, -I|--ingest, "
+                "-L|--autolock or -O|--bench-io");
+
+    if (ttl && !agent)
+        error(1, "Option -t|--ttl only allowed with -A|--agent");
+    if (cache_ttl && command != 'i' && command != 'd' && command != 'I')
+        error(1, "Option -T|--cache only allowed with -i|--init, -d|--decrypt or -I|--ingest");
+
+    if (calibrate) {
+        if (command || manifest || argv[optind])
+            error(1, "Option -c|--calibrate takes no directory");
+        if (usage_showed) return EXIT_FAILURE;
+        return (calibrate_host(calibrate) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (bench_bits) {
+        if (command || manifest || argv[optind])
+            error(1, "Option -B|--cipher-bench takes no directory");
+        if (usage_showed) return EXIT_FAILURE;
+        return (cipher_bench(bench_bits) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (bench_padding) {
+        if (command || manifest || argv[optind])
+            error(1, "Option -b|--bench-padding takes its scratch directory only");
+        if (usage_showed) return EXIT_FAILURE;
+        if (nname_specs == 0) {
+            name_specs[nname_specs++] = (struct name_spec) { 20000, 1, 12 };
+            name_specs[nname_specs++] = (struct name_spec) { 20000, 13, 40 };
+        }
+        if (strcmp(contents_cipher, "auto") == 0 && cipher_select(256, &contents_cipher, &filename_cipher) < 0)
+            return EXIT_FAILURE;
+        return (padding_bench(bench_padding, name_specs, nname_specs) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (io_spec.vault) {
+        if (command || manifest || argv[optind])
+            error(1, "Option -O|--bench-io takes its vault only");
+        if (usage_showed) return EXIT_FAILURE;
+        if (io_spec.nblocks == 0) parse_block_sizes(DEFAULT_BLOCK_SIZES, &io_spec);
+        for (size_t b = 0; b < io_spec.nblocks; b++)
+            if (io_spec.block_kib[b] > io_spec.size_mib * 1024ULL)
+                error(1, "Block size %u KiB larger than the %u MiB of -Z|--io-size", io_spec.block_kib[b],
+                        io_spec.size_mib);
+        if (usage_showed) return EXIT_FAILURE;
+        io_spec.threads = jobs ? jobs : 1;
+        return (io_bench(&io_spec) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (flush_cache) {
+        if (command || manifest || argv[optind])
+            error(1, "Option -F|--flush-cache takes no directory");
+        if (usage_showed) return EXIT_FAILURE;
+        int removed = keycache_flush();
+        if (removed >= 0) printf("Removed %d cached keys\n", removed);
+        return (removed >= 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
-    if (*dir_path == 0)
-        if (argv[optind] == 0) error(1, "No directory specified");
-        else dir_path = argv[optind];
-    else if (argv[optind] != 0) error(1, "Only one directory at a time allowed");
+    // Requests go to an agent when a socket is given explicitly or in the environment
+    bool use_agent = *sock_path || getenv("E2CRYPT_AGENT_SOCK");
+    if (!*sock_path && agent_socket_path(sock_path, sizeof(sock_path)) < 0) *sock_path = 0;
+
+    if (agent) {
+        if (command || manifest || jobs || argv[optind])
+            error(1, "Option -A|--agent only allowed with -t|--ttl and -S|--socket");
+        if (usage_showed) return EXIT_FAILURE;
+        if (!*sock_path) {
+            error(0, "Cannot use /tmp/%s-%u for the socket: not a private directory of the user, "
+                    "give one with -S|--socket", NAME, (unsigned) getuid());
+            return EXIT_FAILURE;
+        }
+        return agent_run(sock_path, ttl ? ttl : AGENT_DEFAULT_TTL) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    char **dirs = NULL;
+    size_t ndirs = 0;
+    if (*dir_path) add_dir(&dirs, &ndirs, dir_path);
+    for (int i = optind; i < argc; i++) add_dir(&dirs, &ndirs, argv[i]);
+    if (manifest && !usage_showed && read_manifest(manifest, &dirs, &ndirs) < 0)
+        return EXIT_FAILURE;
+
+    if (ndirs == 0 && !manifest) error(1, "No directory specified");
+    else if (autolock) {
+        if (usage_showed || ndirs == 0) return EXIT_FAILURE;
+        return autolock_run(dirs, ndirs, autolock, jobs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (cached) {
+        if (usage_showed) return EXIT_FAILURE;
+        return status_cached(dirs, ndirs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    else if (ndirs > 1 && command != 'd' && command != 'e')
+        error(1, "Only one directory at a time allowed");
+    else if (ndirs > 0) dir_path = dirs[0];
 
     int ret = usage_showed;
+    if (!ret && use_agent && !key_file && command != 'i' && command != 's' && command != 'I' && ndirs > 0) {
+        ret = agent_request(sock_path, command, dirs[0]);
+        for (size_t i = 1; i < ndirs && ret != -2; i++)
+            if (agent_request(sock_path, command, dirs[i]) != 0) ret = -1;
+        // Without a listening agent, do the work in this process
+        if (ret != -2) {
+            if (prewarm_depth >= 0 && (ret == 0 || ndirs > 1) && prewarm_vaults(dirs, ndirs, prewarm_depth,
+                    readahead_mib * (1ULL << 20), jobs) < 0)
+                ret = -1;
+            return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+        ret = 0;
+    }
     if (!ret) {
-        if (command == 'i') ret = container_create(dir_path);
+        trace_start(command == 'i' ? "create" : command == 'd' ? "attach" : command == 'e' ? "detach" :
+                command == 's' ? "scan" : command == 'I' ? "ingest" : "status",
+                (manifest || ndirs > 1) ? NULL : dir_path);
+        if (command == 'd' && key_file) ret = keyfile_attach(dirs, ndirs, key_file);
+        else if (command == 'd' && (manifest || ndirs > 1)) ret = batch_attach(dirs, ndirs, jobs);
+        else if (command == 'e' && (manifest || ndirs > 1)) ret = batch_detach(dirs, ndirs);
+        else if (command == 's') ret = scan_tree(dir_path, jobs);
+        else if (command == 'I') ret = ingest_tree(src_path, dir_path, jobs);
+        else if (command == 'i') ret = container_create(dir_path);
         else if (command == 'd') ret = container_attach(dir_path);
         else if (command == 'e') ret = container_detach(dir_path);
         else ret = container_status(dir_path);
+        // The vaults that failed to unlock in a batch are skipped
+        if (prewarm_depth >= 0 && (ret == 0 || ndirs > 1) && prewarm_vaults(dirs, ndirs, prewarm_depth,
+                readahead_mib * (1ULL << 20), jobs) < 0)
+            ret = -1;
+        trace_report(stderr);
     }
     return (ret == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,64 @@
+// family.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sodium.h>
+
+#include "e2crypt.h"
+
+// Derive the secret of the key family of meta from the passphrase: the
+// expensive KDF, run once however many vaults share the family
+int family_secret(const char *pass, size_t pass_sz, const struct vault_meta *meta,
+        struct ext4_encryption_key *secret, unsigned threads)
+{
+    memset(secret, 0, sizeof(*secret));
+    secret->size = FAMILY_SECRET_SZ;
+    return derive_passphrase_to_key(pass, pass_sz, &meta->kdf, secret, threads);
+}
+
+// Derive the key of one vault of a family from the family secret and the
+// nonce recorded in its metadata; key->size gives the size of the key
+void family_key(const struct ext4_encryption_key *secret, const struct vault_meta *meta,
+        struct ext4_encryption_key *key)
+{
+    static const char label[] = NAME " family key";
+    crypto_generichash_state state;
+
+    TRACE_BEGIN(family_key);
+    crypto_generichash_init(&state, secret->raw, secret->size, key->size);
+    crypto_generichash_update(&state, (const unsigned char *) label, sizeof(label));
+    crypto_generichash_update(&state, meta->family_nonce, VAULT_NONCE_SZ);
+    crypto_generichash_final(&state, key->raw, key->size);
+    TRACE_END(family_key);
+}
+
+// Whether the vaults of a and b derive their keys from the same family secret
+bool family_same(const struct vault_meta *a, const struct vault_meta *b)
+{
+    return (a->flags & VAULT_META_FAMILY) && (b->flags & VAULT_META_FAMILY) &&
+            a->kdf.N == b->kdf.N && a->kdf.r == b->kdf.r && a->kdf.p == b->kdf.p &&
+            a->kdf.salt_sz == b->kdf.salt_sz &&
+            memcmp(a->kdf.salt, b->kdf.salt, a->kdf.salt_sz) == 0;
+}
+
+// Derive the key of a vault with metadata meta from the passphrase, through
+// the family secret for a vault of a key family; key->size must be set
+int derive_meta_key(const char *pass, size_t pass_sz, const struct vault_meta *meta,
+        struct ext4_encryption_key *key, unsigned threads)
+{
+    if (!(meta->flags & VAULT_META_FAMILY))
+        return derive_passphrase_to_key(pass, pass_sz, &meta->kdf, key, threads);
+
+    struct ext4_encryption_key *secret = sodium_malloc(sizeof(*secret));
+    if (!secret) {
+        error(0, "Cannot allocate memory for the family secret");
+        return -1;
+    }
+
+    int ret = family_secret(pass, pass_sz, meta, secret, threads);
+    if (ret == 0) family_key(secret, meta, key);
+    sodium_free(secret);
+    return ret;
+}
@@ -0,0 +1,393 @@
+// index.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Status index: the last known state of each vault, in a file mapped by every
+// query; a record stays valid while the directory keeps its inode and ctime
+#define INDEX_MAGIC "e2cindex"
+#define INDEX_VERSION 1
+#define INDEX_MIN_SLOTS 1024
+#define INDEX_FILE NAME "-status.idx"
+
+struct index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;              // Slots, a power of two
+    uint64_t count;
+    uint8_t reserved[32];
+};
+
+// One slot of the open addressing table, found by the hash of the path
+struct index_record {
+    uint64_t path_hash;             // 0 for a free slot
+    uint64_t dev;
+    uint64_t ino;
+    int64_t ctime_sec;
+    int64_t updated;                // Wall clock time of the last full check
+    uint32_t ctime_nsec;
+    uint32_t generation;
+    uint8_t identifier[EXT4_KEY_IDENTIFIER_SIZE];   // v1: the descriptor, zero padded
+    uint8_t encrypted;
+    uint8_t policy_version;
+    uint8_t contents_mode;
+    uint8_t filenames_mode;
+    uint8_t flags;
+    uint8_t key_state;              // EXT4_KEY_STATUS_*
+    uint8_t reserved[10];
+};
+
+_Static_assert(sizeof(struct index_header) == 64, "index header layout");
+_Static_assert(sizeof(struct index_record) == 80, "index record layout");
+
+struct index_map {
+    int fd;
+    size_t size;
+    struct index_header *header;
+    struct index_record *records;
+};
+
+// Path of the index: E2CRYPT_STATUS_INDEX, or in the state directory of the user
+static
+bool index_path(char *path, size_t n)
+{
+    const char *env = getenv("E2CRYPT_STATUS_INDEX");
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+
+    if (env && *env) snprintf(path, n, "%s", env);
+    else if (state && *state) snprintf(path, n, "%s/%s", state, INDEX_FILE);
+    else if (home && *home) snprintf(path, n, "%s/.local/state/%s", home, INDEX_FILE);
+    else return false;
+    return true;
+}
+
+// FNV-1a of the absolute path of dir_path, never 0
+static
+uint64_t index_hash(const char *dir_path)
+{
+    static char cwd[PATH_MAX];
+    uint64_t h = 14695981039346656037ULL;
+
+    if (dir_path[0] != '/') {
+        if (!cwd[0] && !getcwd(cwd, sizeof(cwd))) cwd[0] = 0;
+        for (const char *c = cwd; *c; c++) h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+        h = (h ^ '/') * 1099511628211ULL;
+    }
+    for (const char *c = dir_path; *c; c++) h = (h ^ (unsigned char) *c) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+static
+size_t index_size(uint64_t capacity)
+{
+    return sizeof(struct index_header) + capacity * sizeof(struct index_record);
+}
+
+// Map an index file of capacity slots, empty when it has none yet
+static
+int index_map_file(struct index_map *map, bool write, uint64_t capacity)
+{
+    map->size = index_size(capacity);
+    void *base = mmap(NULL, map->size, PROT_READ | (write ? PROT_WRITE : 0), MAP_SHARED, map->fd, 0);
+    if (base == MAP_FAILED)
+        return -1;
+
+    map->header = base;
+    map->records = (struct index_record *) (map->header + 1);
+    return 0;
+}
+
+// Open and lock the index, shared to read, exclusive to write
+// Return 0, 1 when there is no index, -1 on failure
+static
+int index_open(struct index_map *map, bool write, bool create)
+{
+    char path[PATH_MAX];
+    if (!index_path(path, sizeof(path)))
+        return 1;
+
+    map->fd = open(path, (write ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0) | O_CLOEXEC, 0600);
+    if (map->fd == -1 && errno == ENOENT && create) {
+        // The state directory of a fresh account
+        char *slash = strrchr(path, '/');
+        if (slash && slash != path) {
+            *slash = 0;
+            mkdir(path, 0700);
+            *slash = '/';
+        }
+        map->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if (map->fd == -1)
+        return (errno == ENOENT) ? 1 : -1;
+
+    flock(map->fd, write ? LOCK_EX : LOCK_SH);
+
+    struct index_header header;
+    struct stat st;
+    bool valid = fstat(map->fd, &st) == 0 && pread(map->fd, &header, sizeof(header), 0) == sizeof(header)
+            && memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) == 0
+            && header.version == INDEX_VERSION && header.record_size == sizeof(struct index_record)
+            && header.capacity && !(header.capacity & (header.capacity - 1))
+            && (size_t) st.st_size == index_size(header.capacity);
+
+    // A missing or foreign index is started over: it only holds a cache
+    if (!valid && write) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+        header.version = INDEX_VERSION;
+        header.record_size = sizeof(struct index_record);
+        header.capacity = INDEX_MIN_SLOTS;
+        if (ftruncate(map->fd, 0) != 0 || ftruncate(map->fd, index_size(header.capacity)) != 0
+                || pwrite(map->fd, &header, sizeof(header), 0) != sizeof(header))
+            valid = false;
+        else valid = true;
+    }
+    if (!valid || index_map_file(map, write, header.capacity) < 0) {
+        close(map->fd);
+        return write ? -1 : 1;
+    }
+
+    return 0;
+}
+
+static
+void index_close(struct index_map *map)
+{
+    munmap(map->header, map->size);
+    close(map->fd);
+}
+
+// Slot of hash: its record, or the free slot where it goes; NULL when full
+static
+struct index_record *index_slot(struct index_map *map, uint64_t hash)
+{
+    uint64_t mask = map->header->capacity - 1;
+    for (uint64_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        struct index_record *record = &map->records[i];
+        if (record->path_hash == hash || record->path_hash == 0)
+            return record;
+    }
+    return NULL;
+}
+
+// Double the slots of the index, with the exclusive lock held
+static
+int index_grow(struct index_map *map)
+{
+    uint64_t capacity = map->header->capacity;
+    struct index_record *old = malloc(capacity * sizeof(*old));
+    if (!old)
+        return -1;
+    memcpy(old, map->records, capacity * sizeof(*old));
+
+    struct index_map grown = { .fd = map->fd };
+    if (ftruncate(map->fd, index_size(capacity * 2)) != 0 || index_map_file(&grown, true, capacity * 2) < 0) {
+        ftruncate(map->fd, map->size);
+        free(old);
+        return -1;
+    }
+    munmap(map->header, map->size);
+    *map = grown;
+
+    map->header->capacity = capacity * 2;
+    memset(map->records, 0, capacity * 2 * sizeof(*old));
+    for (uint64_t i = 0; i < capacity; i++)
+        if (old[i].path_hash) *index_slot(map, old[i].path_hash) = old[i];
+    free(old);
+    return 0;
+}
+
+// Store a record, growing the index when it is three quarters full
+static
+void index_store(struct index_map *map, const struct index_record *record)
+{
+    struct index_record *slot = index_slot(map, record->path_hash);
+    if (slot && slot->path_hash == 0 && (map->header->count + 1) * 4 > map->header->capacity * 3
+            && index_grow(map) == 0)
+        slot = index_slot(map, record->path_hash);
+    if (!slot || (slot->path_hash == 0 && map->header->count + 1 >= map->header->capacity))
+        return;
+
+    if (slot->path_hash == 0) map->header->count++;
+    *slot = *record;
+}
+
+// Does the record still describe the directory at dir_path
+static
+bool index_fresh(const struct index_record *record, const char *dir_path)
+{
+    struct statx stx;
+    if (statx(AT_FDCWD, dir_path, 0, STATX_INO | STATX_CTIME, &stx) != 0)
+        return false;
+
+    return record->dev == makedev(stx.stx_dev_major, stx.stx_dev_minor) && record->ino == stx.stx_ino
+            && record->ctime_sec == stx.stx_ctime.tv_sec && record->ctime_nsec == stx.stx_ctime.tv_nsec;
+}
+
+// Check the directory at dir_path in full and describe it in record
+static
+int index_check(struct index_record *record, uint64_t hash, const char *dir_path)
+{
+    // Stat first: a change in between leaves an older ctime, found stale next time
+    struct statx stx;
+    if (statx(AT_FDCWD, dir_path, 0, STATX_INO | STATX_CTIME, &stx) != 0) {
+        error(0, "Cannot access %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+
+    struct e2crypt_status status;
+    int ret = vault_status(dir_path, &status);
+    if (ret < 0 && ret != E2CRYPT_ERR_METADATA)
+        return -1;
+
+    memset(record, 0, sizeof(*record));
+    record->path_hash = hash;
+    record->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    record->ino = stx.stx_ino;
+    record->ctime_sec = stx.stx_ctime.tv_sec;
+    record->ctime_nsec = stx.stx_ctime.tv_nsec;
+    record->updated = time(NULL);
+
+    long generation = 0;
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        if (ioctl(fd, FS_IOC_GETVERSION, &generation) == 0) record->generation = generation;
+        close(fd);
+    }
+
+    record->encrypted = status.encrypted;
+    if (!status.encrypted)
+        return 0;
+
+    record->policy_version = status.policy_version;
+    record->contents_mode = cipher_string_to_mode(status.contents_cipher);
+    record->filenames_mode = cipher_string_to_mode(status.filenames_cipher);
+    record->flags = padding_length_to_flags(status.padding);
+    if (status.policy_version == EXT4_POLICY_V2)
+        memcpy(record->identifier, status.identifier, sizeof(record->identifier));
+    else memcpy(record->identifier, status.descriptor, sizeof(status.descriptor));
+    record->key_state = status.key_present ? EXT4_KEY_STATUS_PRESENT :
+            status.key_busy ? EXT4_KEY_STATUS_INCOMPLETELY_REMOVED : EXT4_KEY_STATUS_ABSENT;
+    return 0;
+}
+
+// Store the state of n directories in the index, when there is one
+// Called after every change e2crypt makes to vaults
+void status_index_update_batch(char **dir_paths, size_t n)
+{
+    struct index_map map;
+    if (n == 0 || index_open(&map, true, false) != 0)
+        return;
+
+    for (size_t i = 0; i < n; i++) {
+        struct index_record record;
+        if (index_check(&record, index_hash(dir_paths[i]), dir_paths[i]) == 0)
+            index_store(&map, &record);
+    }
+
+    index_close(&map);
+}
+
+void status_index_update(const char *dir_path)
+{
+    status_index_update_batch((char **) &dir_path, 1);
+}
+
+// Print one line per directory from a record
+static
+void index_print(const struct index_record *record, const char *dir_path)
+{
+    if (!record->encrypted) {
+        printf("%-8s %-2s %-32s %s\n", "regular", "-", "-", dir_path);
+        return;
+    }
+
+    const char *state = record->key_state == EXT4_KEY_STATUS_PRESENT ? "present" :
+            record->key_state == EXT4_KEY_STATUS_INCOMPLETELY_REMOVED ? "busy" : "absent";
+    bool v2 = (record->policy_version == EXT4_POLICY_V2);
+    char hex[EXT4_KEY_IDENTIFIER_SIZE * 2 + 1];
+    size_t n = v2 ? EXT4_KEY_IDENTIFIER_SIZE : EXT4_KEY_DESCRIPTOR_SIZE;
+    for (size_t i = 0; i < n; i++) snprintf(hex + i * 2, 3, "%02x", record->identifier[i]);
+
+    printf("%-8s %-2s %-32s %s\n", state, v2 ? "v2" : "v1", hex, dir_path);
+}
+
+// Print the state of many directories, from the index as long as the
+// directories did not change since, and refresh the index for the others
+// The key state is the one e2crypt last set or saw
+int status_cached(char **dir_paths, size_t n)
+{
+    struct index_map map;
+    int opened = index_open(&map, false, false);
+    if (opened < 0) {
+        error(0, "Cannot open the status index: %s", strerror(errno));
+        return -1;
+    }
+
+    bool *stale = calloc(n ? n : 1, sizeof(*stale));
+    if (!stale) {
+        if (opened == 0) index_close(&map);
+        error(0, "Cannot allocate memory for %zu directories", n);
+        return -1;
+    }
+
+    size_t hits = 0;
+    for (size_t i = 0; i < n; i++) {
+        const struct index_record *record = (opened == 0) ? index_slot(&map, index_hash(dir_paths[i])) : NULL;
+        if (record && record->path_hash == index_hash(dir_paths[i]) && index_fresh(record, dir_paths[i])) {
+            index_print(record, dir_paths[i]);
+            hits++;
+        }
+        else stale[i] = true;
+    }
+    if (opened == 0) index_close(&map);
+
+    // The others get a full check, under the exclusive lock
+    int ret = 0;
+    if (hits < n) {
+        if ((opened = index_open(&map, true, true)) < 0) {
+            error(0, "Cannot update the status index: %s", strerror(errno));
+            ret = -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            if (!stale[i]) continue;
+
+            uint64_t hash = index_hash(dir_paths[i]);
+            struct index_record record;
+            if (index_check(&record, hash, dir_paths[i]) < 0) {
+                ret = -1;
+                continue;
+            }
+            index_print(&record, dir_paths[i]);
+            if (opened == 0) index_store(&map, &record);
+        }
+        if (opened == 0) index_close(&map);
+    }
+
+    fflush(stdout);
+    fprintf(stderr, "%zu of %zu directories answered from the status index\n", hits, n);
+    free(stale);
+    return ret;
+}
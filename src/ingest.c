@@ -0,0 +1,465 @@
+// ingest.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define INGEST_BUF_SZ (1 << 20)
+#define INGEST_CHUNK_SZ (64 << 20)
+#define INGEST_LINKS_BUCKETS 4096
+#define INGEST_XATTR_SZ 65536
+
+// First copy of a file with several hard links
+struct ingest_link {
+    struct ingest_link *next;
+    dev_t dev;
+    ino_t ino;
+    char *path;
+};
+
+struct ingest_state {
+    const char *src;
+    size_t src_len;
+    int vaultfd;
+    pthread_mutex_t lock;
+    // Directories created, their attributes are applied once their contents are in
+    char **dirs;
+    size_t ndirs;
+    size_t dirs_sz;
+    struct ingest_link *links[INGEST_LINKS_BUCKETS];
+    unsigned long files;
+    unsigned long skipped;
+    unsigned long errors;
+    unsigned long long bytes;
+};
+
+// Destination directory of the source directory this thread is reading
+static __thread int ingest_dstfd = -1;
+
+// Path of a source directory relative to the source root
+static
+const char *relative_path(struct ingest_state *state, const char *path)
+{
+    path += state->src_len;
+    while (*path == '/') path++;
+    return *path ? path : ".";
+}
+
+static
+void ingest_error(struct ingest_state *state, const char *what, const char *dir, const char *name)
+{
+    error(0, "Cannot %s %s%s%s: %s", what, dir, name ? "/" : "", name ? name : "", strerror(errno));
+    __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+}
+
+// Copy the extended attributes; those the vault cannot hold are skipped silently
+static
+void copy_xattrs(int in, int out)
+{
+    char names[INGEST_XATTR_SZ];
+    ssize_t names_sz = flistxattr(in, names, sizeof(names));
+    if (names_sz <= 0) return;
+
+    char *value = malloc(INGEST_XATTR_SZ);
+    if (!value) return;
+    for (char *name = names; name < names + names_sz; name += strlen(name) + 1) {
+        // The vault metadata of a nested vault is not meant for this one
+        if (strcmp(name, "user." NAME) == 0) continue;
+        ssize_t sz = fgetxattr(in, name, value, INGEST_XATTR_SZ);
+        if (sz >= 0) fsetxattr(out, name, value, sz, 0);
+    }
+    free(value);
+}
+
+// Give out the ownership, mode and timestamps of st
+static
+int copy_attrs(int out, const struct stat *st)
+{
+    // Only root can give files away; ownership is kept when allowed
+    if (fchown(out, st->st_uid, st->st_gid) != 0 && errno != EPERM)
+        return -1;
+    if (fchmod(out, st->st_mode & 07777) != 0)
+        return -1;
+
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    return futimens(out, times);
+}
+
+// Copy len bytes at off, in the kernel when the filesystems allow it
+static
+int copy_range(int in, int out, off_t off, off_t len, char **buf)
+{
+    off_t off_in = off, off_out = off;
+    while (len > 0 && !*buf) {
+        ssize_t n = copy_file_range(in, &off_in, out, &off_out,
+                len < INGEST_CHUNK_SZ ? len : INGEST_CHUNK_SZ, 0);
+        if (n > 0) {
+            len -= n;
+            continue;
+        }
+        if (n == 0) return -1;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP)
+            return -1;
+
+        // Fall back to reading and writing through a buffer
+        if (!(*buf = malloc(INGEST_BUF_SZ))) return -1;
+    }
+
+    while (len > 0) {
+        ssize_t n = pread(in, *buf, len < INGEST_BUF_SZ ? len : INGEST_BUF_SZ, off_in);
+        if (n <= 0) return -1;
+        for (ssize_t done = 0; done < n; ) {
+            ssize_t w = pwrite(out, *buf + done, n - done, off_out + done);
+            if (w < 0) return -1;
+            done += w;
+        }
+        off_in += n;
+        off_out += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Copy the data of a file, leaving its holes unwritten
+static
+int copy_data(int in, int out, off_t size)
+{
+    char *buf = NULL;
+    int ret = 0;
+    off_t off = 0;
+
+    while (off < size && ret == 0) {
+        off_t data = lseek(in, off, SEEK_DATA);
+        if (data == -1 && errno == ENXIO) break;
+        off_t hole = (data == -1) ? size : lseek(in, data, SEEK_HOLE);
+        if (data == -1) data = off;
+        if (hole == -1 || hole > size) hole = size;
+
+        ret = copy_range(in, out, data, hole - data, &buf);
+        off = hole;
+    }
+
+    free(buf);
+    if (ret == 0) ret = ftruncate(out, size);
+    return ret;
+}
+
+// Copy a regular file into the destination directory
+// The file only appears under its name once it is complete, so an interrupted
+// run never leaves a partial file that a later run would take as done
+static
+int copy_file(struct ingest_state *state, int dirfd, const char *name, const struct stat *st)
+{
+    int in = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1) return -1;
+
+    char tmp_name[64] = "";
+    int out = openat(ingest_dstfd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (out == -1 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        static unsigned long counter = 0;
+        snprintf(tmp_name, sizeof(tmp_name), ".%s-ingest.%d.%lu", NAME, getpid(),
+                __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED));
+        out = openat(ingest_dstfd, tmp_name, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                S_IRUSR | S_IWUSR);
+    }
+    if (out == -1) {
+        close(in);
+        return -1;
+    }
+
+    int ret = copy_data(in, out, st->st_size);
+    if (ret == 0) {
+        copy_xattrs(in, out);
+        ret = copy_attrs(out, st);
+    }
+
+    if (ret == 0 && *tmp_name) ret = renameat(ingest_dstfd, tmp_name, ingest_dstfd, name);
+    else if (ret == 0) {
+        char proc_path[64];
+        snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", out);
+        ret = linkat(AT_FDCWD, proc_path, ingest_dstfd, name, AT_SYMLINK_FOLLOW);
+        if (ret != 0 && errno == EEXIST && unlinkat(ingest_dstfd, name, 0) == 0)
+            ret = linkat(AT_FDCWD, proc_path, ingest_dstfd, name, AT_SYMLINK_FOLLOW);
+    }
+    if (ret != 0 && *tmp_name) unlinkat(ingest_dstfd, tmp_name, 0);
+
+    close(out);
+    close(in);
+    if (ret == 0) __atomic_add_fetch(&state->bytes, st->st_size, __ATOMIC_RELAXED);
+    return ret;
+}
+
+// Find the copy of a file with several hard links, or record path as its copy
+// Return the path of an earlier copy
+static
+const char *ingest_link(struct ingest_state *state, const struct stat *st, const char *path, bool record)
+{
+    unsigned h = (st->st_ino ^ st->st_dev) % INGEST_LINKS_BUCKETS;
+    const char *found = NULL;
+
+    pthread_mutex_lock(&state->lock);
+    struct ingest_link *link = state->links[h];
+    while (link && (link->ino != st->st_ino || link->dev != st->st_dev)) link = link->next;
+    if (link) found = link->path;
+    else if (record && (link = malloc(sizeof(*link)))) {
+        link->dev = st->st_dev;
+        link->ino = st->st_ino;
+        link->path = strdup(path);
+        link->next = state->links[h];
+        state->links[h] = link;
+    }
+    pthread_mutex_unlock(&state->lock);
+    return found;
+}
+
+// Create the destination of a source directory and remember it for its attributes
+static
+int ingest_dir(int dirfd, const char *path, unsigned depth, void *arg)
+{
+    (void) dirfd;
+    (void) depth;
+    struct ingest_state *state = arg;
+    const char *rel = relative_path(state, path);
+
+    if (mkdirat(state->vaultfd, rel, S_IRWXU) != 0 && errno != EEXIST) {
+        ingest_error(state, "create", rel, NULL);
+        return 1;
+    }
+    ingest_dstfd = openat(state->vaultfd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (ingest_dstfd == -1) {
+        ingest_error(state, "open", rel, NULL);
+        return 1;
+    }
+
+    char *copy = strdup(rel);
+    pthread_mutex_lock(&state->lock);
+    if (copy && state->ndirs == state->dirs_sz) {
+        size_t sz = state->dirs_sz ? state->dirs_sz * 2 : 256;
+        char **dirs = realloc(state->dirs, sz * sizeof(*dirs));
+        if (dirs) {
+            state->dirs = dirs;
+            state->dirs_sz = sz;
+        }
+    }
+    if (copy && state->ndirs < state->dirs_sz) state->dirs[state->ndirs++] = copy;
+    else free(copy);
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+static
+void ingest_dir_done(const char *path, unsigned depth, void *arg)
+{
+    (void) path;
+    (void) depth;
+    (void) arg;
+    close(ingest_dstfd);
+    ingest_dstfd = -1;
+}
+
+// Copy one entry of a source directory, unless an earlier run already did
+static
+void ingest_entry(int dirfd, const char *dir_path, const char *name, unsigned char type,
+        unsigned depth, void *arg)
+{
+    (void) depth;
+    struct ingest_state *state = arg;
+    const char *rel = relative_path(state, dir_path);
+    if (type == DT_DIR) return;
+
+    struct stat st, dst;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        ingest_error(state, "stat", dir_path, name);
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", rel, name);
+
+    // Resume: an entry of the same kind, size and modification time is done
+    if (fstatat(ingest_dstfd, name, &dst, AT_SYMLINK_NOFOLLOW) == 0) {
+        if ((dst.st_mode & S_IFMT) == (st.st_mode & S_IFMT) && dst.st_size == st.st_size &&
+                (S_ISLNK(st.st_mode) || (dst.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+                 dst.st_mtim.tv_nsec == st.st_mtim.tv_nsec))) {
+            if (S_ISREG(st.st_mode) && st.st_nlink > 1) ingest_link(state, &st, path, true);
+            __atomic_add_fetch(&state->skipped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (!S_ISREG(st.st_mode) || !S_ISREG(dst.st_mode)) unlinkat(ingest_dstfd, name, 0);
+    }
+
+    int ret;
+    if (S_ISREG(st.st_mode)) {
+        const char *first = (st.st_nlink > 1) ? ingest_link(state, &st, path, false) : NULL;
+        if (first) ret = linkat(state->vaultfd, first, ingest_dstfd, name, 0);
+        else {
+            ret = copy_file(state, dirfd, name, &st);
+            // Two links copied at the same time end up as two copies, which is harmless
+            if (ret == 0 && st.st_nlink > 1) ingest_link(state, &st, path, true);
+        }
+    }
+    else {
+        // Symbolic links, fifos, sockets and device nodes
+        char target[PATH_MAX];
+        ssize_t len = S_ISLNK(st.st_mode) ? readlinkat(dirfd, name, target, sizeof(target) - 1) : 0;
+        ret = (len < 0) ? -1 : 0;
+        if (ret == 0 && S_ISLNK(st.st_mode)) {
+            target[len] = 0;
+            ret = symlinkat(target, ingest_dstfd, name);
+        }
+        else if (ret == 0) ret = mknodat(ingest_dstfd, name, st.st_mode, st.st_rdev);
+
+        if (ret == 0) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            if (fchownat(ingest_dstfd, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0 &&
+                    errno != EPERM)
+                ret = -1;
+            else ret = utimensat(ingest_dstfd, name, times, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+
+    if (ret != 0) ingest_error(state, "copy", dir_path, name);
+    else __atomic_add_fetch(&state->files, 1, __ATOMIC_RELAXED);
+}
+
+// Give the directories their attributes, deepest first so that adding entries
+// does not change the timestamps of a directory once set
+static
+void ingest_dir_attrs(struct ingest_state *state)
+{
+    char path[PATH_MAX];
+    for (size_t i = state->ndirs; i-- > 0; ) {
+        snprintf(path, sizeof(path), "%s/%s", state->src, state->dirs[i]);
+        int in = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int out = openat(state->vaultfd, state->dirs[i], O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        struct stat st;
+
+        if (in == -1 || out == -1 || fstat(in, &st) != 0) {
+            ingest_error(state, "open", path, NULL);
+        }
+        else {
+            // The policy and metadata of the vault itself stay as they are
+            if (strcmp(state->dirs[i], ".") != 0) copy_xattrs(in, out);
+            if (copy_attrs(out, &st) != 0) ingest_error(state, "set attributes of", path, NULL);
+        }
+
+        if (in != -1) close(in);
+        if (out != -1) close(out);
+        free(state->dirs[i]);
+    }
+    free(state->dirs);
+}
+
+// Make sure vault is an encrypted directory with its key in the keyring,
+// initializing it when it is missing or an empty regular directory
+static
+int ingest_vault(const char *vault_path)
+{
+    if (mkdir(vault_path, S_IRWXU) == 0)
+        printf("Created %s\n", vault_path);
+    else if (errno != EEXIST) {
+        error(0, "Cannot create %s: %s", vault_path, strerror(errno));
+        return -1;
+    }
+
+    struct ext4_encryption_policy policy;
+    int ret = container_policy(vault_path, &policy);
+    if (ret < 0)
+        return -1;
+    if (ret > 0)
+        return container_create(vault_path);
+
+    if (vault_key_status(vault_path) != EXT4_KEY_STATUS_PRESENT) {
+        error(0, "Cannot ingest into %s: decrypt it first", vault_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copy the plaintext tree at src_path into the vault at vault_path on threads workers
+// Keeps sparse files, hard links, extended attributes, ownership and timestamps;
+// entries an interrupted earlier run completed are skipped
+int ingest_tree(const char *src_path, const char *vault_path, unsigned threads)
+{
+    char src[PATH_MAX], vault[PATH_MAX];
+    if (!realpath(src_path, src)) {
+        error(0, "Cannot resolve %s: %s", src_path, strerror(errno));
+        return -1;
+    }
+
+    if (ingest_vault(vault_path) < 0)
+        return -1;
+
+    if (!realpath(vault_path, vault)) {
+        error(0, "Cannot resolve %s: %s", vault_path, strerror(errno));
+        return -1;
+    }
+
+    size_t src_len = strlen(src), vault_len = strlen(vault);
+    if ((strncmp(vault, src, src_len) == 0 && (vault[src_len] == '/' || !vault[src_len] || src_len == 1)) ||
+            (strncmp(src, vault, vault_len) == 0 && src[vault_len] == '/')) {
+        error(0, "Cannot ingest %s into %s: one contains the other", src, vault);
+        return -1;
+    }
+
+    struct ingest_state state = {
+        .src = src, .src_len = src_len,
+        .vaultfd = open(vault, O_RDONLY | O_DIRECTORY | O_CLOEXEC),
+    };
+    if (state.vaultfd == -1) {
+        error(0, "Cannot open %s: %s", vault, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&state.lock, NULL);
+
+    struct walk_ops ops = {
+        .dir = ingest_dir,
+        .entry = ingest_entry,
+        .dir_done = ingest_dir_done,
+        .arg = &state,
+        .threads = threads,
+    };
+    struct walk_stats stats;
+    int ret = walk_tree(src, &ops, &stats);
+    if (ret == 0) {
+        ingest_dir_attrs(&state);
+        if (syncfs(state.vaultfd) != 0) ingest_error(&state, "sync", vault, NULL);
+
+        printf("Ingested %lu entries (%llu MiB) from %lu directories into %s\n",
+                state.files, state.bytes >> 20, stats.dirs, vault);
+        if (state.skipped) printf("Skipped %lu entries copied by an earlier run\n", state.skipped);
+        if (state.errors || stats.errors) {
+            error(0, "Failed to copy %lu entries", state.errors + stats.errors);
+            ret = -1;
+        }
+    }
+
+    for (int i = 0; i < INGEST_LINKS_BUCKETS; i++) {
+        while (state.links[i]) {
+            struct ingest_link *next = state.links[i]->next;
+            free(state.links[i]->path);
+            free(state.links[i]);
+            state.links[i] = next;
+        }
+    }
+    pthread_mutex_destroy(&state.lock);
+    close(state.vaultfd);
+    return ret;
+}
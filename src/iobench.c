@@ -0,0 +1,309 @@
+// iobench.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Alignment of the buffers, enough for O_DIRECT on any block device
+#define IO_ALIGN 4096
+
+enum io_test {
+    IO_SEQ_WRITE,
+    IO_SEQ_READ,
+    IO_RAND_WRITE,
+    IO_RAND_READ,
+    NR_IO_TESTS
+};
+
+static const char *io_test_names[NR_IO_TESTS] = { "seq-write", "seq-read", "rand-write", "rand-read" };
+
+// Throughput and latencies of one test in one directory
+struct io_result {
+    double mib_s;
+    double avg_us;
+    double p99_us;
+};
+
+// One test run by all threads at the same time, each on its own file
+struct io_run {
+    const struct io_bench_spec *spec;
+    const char *dir_path;
+    enum io_test test;
+    size_t block;
+    size_t nops;
+    bool go;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+};
+
+struct io_job {
+    struct io_run *run;
+    unsigned index;
+    double *lat_us;
+    int err;
+};
+
+static
+double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static
+void io_file_path(char *path, size_t n, const char *dir_path, unsigned index)
+{
+    snprintf(path, n, "%s/.%s-io.%u.%u", dir_path, NAME, (unsigned) getpid(), index);
+}
+
+// Worker: run the test of run on the file of the job, timing every operation
+static
+void *io_worker(void *arg)
+{
+    struct io_job *job = arg;
+    struct io_run *run = job->run;
+    bool write_test = (run->test == IO_SEQ_WRITE || run->test == IO_RAND_WRITE);
+    bool random = (run->test == IO_RAND_WRITE || run->test == IO_RAND_READ);
+    char path[PATH_MAX];
+    void *buf = NULL;
+
+    io_file_path(path, sizeof(path), run->dir_path, job->index);
+    int flags = O_CLOEXEC | (run->spec->direct ? O_DIRECT : 0) |
+            (write_test ? O_WRONLY | O_CREAT : O_RDONLY) | (run->test == IO_SEQ_WRITE ? O_TRUNC : 0);
+    int fd = open(path, flags, S_IRUSR | S_IWUSR);
+    if (fd == -1 || posix_memalign(&buf, IO_ALIGN, run->block) != 0) {
+        job->err = (fd == -1) ? errno : ENOMEM;
+        buf = NULL;
+    }
+    else randombytes_buf(buf, run->block);
+
+    // All threads start together, once the last one exists
+    pthread_mutex_lock(&run->lock);
+    while (!run->go) pthread_cond_wait(&run->start, &run->lock);
+    pthread_mutex_unlock(&run->lock);
+    for (size_t i = 0; i < run->nops && !job->err; i++) {
+        off_t offset = (off_t) (random ? randombytes_uniform(run->nops) : i) * run->block;
+        double start = now_us();
+        ssize_t n = write_test ? pwrite(fd, buf, run->block, offset) : pread(fd, buf, run->block, offset);
+        if (n == (ssize_t) run->block && write_test && run->spec->fsync && fdatasync(fd) != 0) n = -1;
+        job->lat_us[i] = now_us() - start;
+        if (n != (ssize_t) run->block) job->err = (n < 0) ? errno : EIO;
+    }
+
+    // Written data counts once it reached the disk, encrypted on the way
+    if (!job->err && write_test && !run->spec->fsync && fdatasync(fd) != 0)
+        job->err = errno;
+
+    free(buf);
+    if (fd != -1) close(fd);
+    return NULL;
+}
+
+static
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Write the data of the files to disk and drop it from the page cache, so
+// that reads go through the contents cipher again
+static
+void io_make_cold(const char *dir_path, unsigned threads)
+{
+    char path[PATH_MAX];
+    for (unsigned t = 0; t < threads; t++) {
+        io_file_path(path, sizeof(path), dir_path, t);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Run one test on all threads in dir_path
+static
+int io_run_test(const struct io_bench_spec *spec, const char *dir_path, enum io_test test, size_t block,
+        struct io_result *result)
+{
+    unsigned threads = spec->threads;
+    struct io_run run = {
+        .spec = spec, .dir_path = dir_path, .test = test, .block = block,
+        .nops = (spec->size_mib * (1ULL << 20)) / block,
+    };
+    if (run.nops == 0) {
+        error(0, "Cannot run %s: block of %zu KiB larger than the file", io_test_names[test], block / 1024);
+        return -1;
+    }
+
+    struct io_job *jobs = calloc(threads, sizeof(*jobs));
+    double *lat_us = calloc(threads * run.nops, sizeof(*lat_us));
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    if (!jobs || !lat_us || !tids) {
+        free(jobs);
+        free(lat_us);
+        free(tids);
+        error(0, "Cannot allocate memory for %u threads", threads);
+        return -1;
+    }
+
+    if (test == IO_SEQ_READ || test == IO_RAND_READ)
+        io_make_cold(dir_path, threads);
+
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.start, NULL);
+    unsigned started = 0;
+    for (; started < threads; started++) {
+        jobs[started] = (struct io_job) { .run = &run, .index = started, .lat_us = lat_us + started * run.nops };
+        if (pthread_create(&tids[started], NULL, io_worker, &jobs[started]) != 0) break;
+    }
+
+    pthread_mutex_lock(&run.lock);
+    run.go = true;
+    pthread_cond_broadcast(&run.start);
+    pthread_mutex_unlock(&run.lock);
+    double start = now_us();
+    for (unsigned t = 0; t < started; t++) pthread_join(tids[t], NULL);
+    double elapsed = now_us() - start;
+    pthread_cond_destroy(&run.start);
+    pthread_mutex_destroy(&run.lock);
+
+    int ret = 0;
+    if (started < threads) {
+        error(0, "Cannot start %u threads", threads);
+        ret = -1;
+    }
+    for (unsigned t = 0; t < started && ret == 0; t++)
+        if (jobs[t].err) {
+            error(0, "Cannot run %s in %s: %s", io_test_names[test], dir_path, strerror(jobs[t].err));
+            ret = -1;
+        }
+
+    if (ret == 0) {
+        size_t nops = threads * run.nops;
+        double total = 0;
+        for (size_t i = 0; i < nops; i++) total += lat_us[i];
+        qsort(lat_us, nops, sizeof(*lat_us), compare_doubles);
+        result->mib_s = (double) nops * block / (1 << 20) / (elapsed / 1e6);
+        result->avg_us = total / nops;
+        result->p99_us = lat_us[nops * 99 / 100];
+    }
+
+    free(jobs);
+    free(lat_us);
+    free(tids);
+    return ret;
+}
+
+// Run all tests with one block size in dir_path, then remove the files
+static
+int io_run_dir(const struct io_bench_spec *spec, const char *dir_path, size_t block,
+        struct io_result *results)
+{
+    int ret = 0;
+    for (int test = 0; test < NR_IO_TESTS && ret == 0; test++)
+        ret = io_run_test(spec, dir_path, test, block, &results[test]);
+
+    char path[PATH_MAX];
+    for (unsigned t = 0; t < spec->threads; t++) {
+        io_file_path(path, sizeof(path), dir_path, t);
+        unlink(path);
+    }
+    return ret;
+}
+
+// Measure sequential and random reads and writes in the decrypted vault of
+// spec and in a plaintext directory next to it on the same filesystem, and
+// print the overhead of the contents cipher of the vault
+int io_bench(const struct io_bench_spec *spec)
+{
+    if (crypto_init() == -1)
+        return -1;
+
+    struct e2crypt_status status;
+    int ret = vault_status(spec->vault, &status);
+    if (ret < 0 && ret != E2CRYPT_ERR_METADATA)
+        return -1;
+    if (!status.encrypted) {
+        error(0, "Cannot measure: %s not an encrypted directory", spec->vault);
+        return -1;
+    }
+    if (!status.key_present) {
+        error(0, "Cannot measure: vault %s must be decrypted first", spec->vault);
+        return -1;
+    }
+
+    // The plaintext directory shares the filesystem and device of the vault
+    char plain[PATH_MAX];
+    if (!realpath(spec->vault, plain)) {
+        error(0, "Cannot resolve %s: %s", spec->vault, strerror(errno));
+        return -1;
+    }
+    char *parent = dirname(plain);
+    memmove(plain, parent, strlen(parent) + 1);
+    snprintf(plain + strlen(plain), sizeof(plain) - strlen(plain), "/.%s-io-XXXXXX", NAME);
+    if (!mkdtemp(plain)) {
+        error(0, "Cannot create a plaintext directory next to %s: %s", spec->vault, strerror(errno));
+        return -1;
+    }
+
+    struct stat vault_st, plain_st;
+    struct ext4_encryption_policy policy;
+    ret = 0;
+    if (stat(spec->vault, &vault_st) != 0 || stat(plain, &plain_st) != 0 || vault_st.st_dev != plain_st.st_dev) {
+        error(0, "Cannot measure: vault %s is not on the filesystem of its parent", spec->vault);
+        ret = -1;
+    }
+    else if (vault_policy(plain, &policy) != E2CRYPT_ERR_NOT_ENCRYPTED) {
+        error(0, "Cannot measure: the parent of %s is encrypted, no plaintext directory on its filesystem",
+                spec->vault);
+        ret = -1;
+    }
+
+    if (ret == 0) {
+        printf("Vault %s: contents cipher %s, against plaintext %s\n", spec->vault, status.contents_cipher, plain);
+        printf("%u thread%s, %u MiB per thread%s%s\n", spec->threads, spec->threads > 1 ? "s" : "",
+                spec->size_mib, spec->direct ? ", O_DIRECT" : "", spec->fsync ? ", fsync per write" : "");
+        printf("%-10s %8s %10s %10s %8s %10s %10s %10s %10s\n", "Test", "Block", "MiB/s", "(vault)",
+                "Overhead", "avg us", "(vault)", "p99 us", "(vault)");
+    }
+
+    for (size_t b = 0; b < spec->nblocks && ret == 0; b++) {
+        size_t block = spec->block_kib[b] * 1024ULL;
+        struct io_result results[2][NR_IO_TESTS];
+        ret = io_run_dir(spec, plain, block, results[0]);
+        if (ret == 0) ret = io_run_dir(spec, spec->vault, block, results[1]);
+        if (ret < 0)
+            break;
+
+        for (int test = 0; test < NR_IO_TESTS; test++) {
+            struct io_result *p = &results[0][test], *v = &results[1][test];
+            printf("%-10s %4u KiB %10.1f %10.1f %7.1f%% %10.1f %10.1f %10.1f %10.1f\n", io_test_names[test],
+                    spec->block_kib[b], p->mib_s, v->mib_s, (p->mib_s > 0) ? 100 * (1 - v->mib_s / p->mib_s) : 0,
+                    p->avg_us, v->avg_us, p->p99_us, v->p99_us);
+        }
+        fflush(stdout);
+    }
+
+    if (rmdir(plain) != 0)
+        error(0, "Cannot remove %s: %s", plain, strerror(errno));
+    return ret;
+}
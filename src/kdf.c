@@ -0,0 +1,193 @@
+// kdf.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define KDF_CONFIG "kdf.conf"
+#define KDF_MIN_LOG2_N 10
+#define KDF_MAX_LOG2_N 22
+#define KDF_MAX_P 64
+#define KDF_BANDWIDTH_SZ (64 << 20)
+
+// Path of the host KDF configuration written by --calibrate
+static
+int kdf_config_path(char *path, size_t n, bool create)
+{
+    const char *config = getenv("XDG_CONFIG_HOME");
+    const char *home = getenv("HOME");
+    if (config && *config) snprintf(path, n, "%s/%s", config, NAME);
+    else if (home && *home) snprintf(path, n, "%s/.config/%s", home, NAME);
+    else return -1;
+
+    if (create) {
+        char parent[n];
+        snprintf(parent, n, "%s", path);
+        *strrchr(parent, '/') = 0;
+        mkdir(parent, S_IRWXU);
+        mkdir(path, S_IRWXU);
+    }
+
+    snprintf(path + strlen(path), n - strlen(path), "/%s", KDF_CONFIG);
+    return 0;
+}
+
+// KDF cost for new vaults on this host: calibrated when --calibrate was run,
+// otherwise the legacy cost
+void kdf_host_params(struct kdf_params *params)
+{
+    kdf_legacy_params(params);
+
+    char path[4096];
+    if (kdf_config_path(path, sizeof(path), false) < 0) return;
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+
+    unsigned long long N;
+    unsigned r, p;
+    if (fscanf(f, "N=%llu r=%u p=%u", &N, &r, &p) == 3 &&
+            N >= (1ULL << KDF_MIN_LOG2_N) && kdf_params_sane(N, r, p)) {
+        params->N = N;
+        params->r = r;
+        params->p = p;
+    }
+    else error(0, "Ignoring invalid KDF configuration %s", path);
+    fclose(f);
+}
+
+// KDF parameters for a new vault: the host cost and a random salt
+void kdf_vault_params(struct kdf_params *params)
+{
+    kdf_host_params(params);
+    params->salt_sz = KDF_SALT_SZ;
+    randombytes_buf(params->salt, params->salt_sz);
+}
+
+static
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Time one derivation with the given cost
+static
+double time_kdf(uint64_t N, uint32_t r, uint32_t p, unsigned threads)
+{
+    const char pass[] = "calibration";
+    const uint8_t salt[KDF_SALT_SZ] = { 0 };
+    uint8_t out[EXT4_MAX_KEY_SIZE];
+
+    double start = now_ms();
+    if (scrypt_parallel((const uint8_t *) pass, sizeof(pass) - 1, salt, sizeof(salt),
+                N, r, p, threads, out, sizeof(out)) != 0)
+        return -1;
+    return now_ms() - start;
+}
+
+// Measure memory copy bandwidth in MiB/s
+static
+double memory_bandwidth()
+{
+    char *src = malloc(KDF_BANDWIDTH_SZ);
+    char *dst = malloc(KDF_BANDWIDTH_SZ);
+    if (!src || !dst) {
+        free(src);
+        free(dst);
+        return 0;
+    }
+
+    memset(src, 1, KDF_BANDWIDTH_SZ);
+    memset(dst, 0, KDF_BANDWIDTH_SZ);
+    double best = 0;
+    for (int i = 0; i < 4; i++) {
+        double start = now_ms();
+        memcpy(dst, src, KDF_BANDWIDTH_SZ);
+        double ms = now_ms() - start;
+        // Each copy reads and writes the buffer once
+        double mibs = 2.0 * (KDF_BANDWIDTH_SZ >> 20) / (ms / 1e3);
+        if (ms > 0 && mibs > best) best = mibs;
+    }
+
+    free(src);
+    free(dst);
+    return best;
+}
+
+// Measure this host and pick the largest scrypt cost that unlocks within target_ms
+// Record it as the cost for vaults initialized from now on; cal receives the
+// measurements and the cost, valid as far as cal->N is set
+int kdf_calibrate(unsigned target_ms, struct kdf_calibration *cal)
+{
+    memset(cal, 0, sizeof(*cal));
+    if (crypto_init() == -1) {
+        error(0, "Cannot access cryptography system");
+        return -1;
+    }
+
+    const uint32_t r = SCRYPT_R;
+    cal->cpus = available_cpus();
+    cal->bandwidth_mib_s = memory_bandwidth();
+
+    // One lane at the legacy cost gives the time per unit of N
+    double lane_ms = time_kdf(SCRYPT_N, r, 1, 1);
+    for (int i = 0; i < 2; i++) {
+        double ms = time_kdf(SCRYPT_N, r, 1, 1);
+        if (ms >= 0 && ms < lane_ms) lane_ms = ms;
+    }
+    if (lane_ms <= 0) {
+        error(0, "Cannot run the key derivation");
+        return -1;
+    }
+    cal->lane_ms = lane_ms;
+
+    // Lanes run in parallel: use one per thread the CPU and memory limits allow
+    uint32_t p = scrypt_threads(1ULL << KDF_MIN_LOG2_N, r, KDF_MAX_P);
+    unsigned threads = p;
+    unsigned long long mem = available_memory();
+
+    int log2_n = KDF_MIN_LOG2_N;
+    while (log2_n < KDF_MAX_LOG2_N) {
+        uint64_t N = 1ULL << (log2_n + 1);
+        double predicted = lane_ms * N / SCRYPT_N * ((p + threads - 1) / threads);
+        if (predicted > target_ms) break;
+        if (mem && threads * 128ULL * r * N > mem / 2) break;
+        log2_n++;
+    }
+
+    // The prediction assumes perfect scaling over threads, so check it
+    double ms = time_kdf(1ULL << log2_n, r, p, threads);
+    while (ms > target_ms && log2_n > KDF_MIN_LOG2_N)
+        ms = time_kdf(1ULL << --log2_n, r, p, threads);
+
+    uint64_t N = 1ULL << log2_n;
+    cal->N = N;
+    cal->r = r;
+    cal->p = p;
+    cal->mem_mib = 128ULL * r * N * threads >> 20;
+    cal->unlock_ms = ms;
+
+    if (kdf_config_path(cal->path, sizeof(cal->path), true) < 0) {
+        error(0, "Cannot find a configuration directory: HOME not set");
+        return -1;
+    }
+
+    FILE *f = fopen(cal->path, "w");
+    if (!f || fprintf(f, "N=%llu r=%u p=%u\n", (unsigned long long) N, r, p) < 0) {
+        error(0, "Cannot write %s: %s", cal->path, strerror(errno));
+        if (f) fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
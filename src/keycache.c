@@ -0,0 +1,219 @@
+// keycache.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <keyutils.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define KEYCACHE_KEYRING NAME ":cache"
+#define KEYCACHE_V2_TYPE "fscrypt-provisioning"
+#define KEYCACHE_V2_PREFIX NAME ":cache:"
+#define KEYCACHE_PARENT KEY_SPEC_USER_SESSION_KEYRING
+#define KEYCACHE_DESC_SZ (sizeof(KEYCACHE_V2_PREFIX) + EXT4_KEY_DESCRIPTOR_SIZE * 2)
+// Entries of earlier versions: "user" keys next to a readable cache secret
+#define KEYCACHE_OLD_TYPE "user"
+#define KEYCACHE_OLD_PREFIX NAME ":cache:"
+#define KEYCACHE_OLD_SECRET NAME ":cache-secret"
+// The keyring grants no search, so the kernel never finds a cached v1 key on
+// its own: a vault only uses it once linked into the vault keyring
+#define KEYCACHE_KEYRING_PERM (KEY_POS_VIEW | KEY_POS_READ | KEY_POS_WRITE | KEY_POS_LINK | KEY_POS_SETATTR | \
+        KEY_USR_VIEW | KEY_USR_READ | KEY_USR_WRITE)
+// Cached keys are linked or handed to the filesystem by serial, never read:
+// "logon" and "fscrypt-provisioning" keys have no way out to userspace
+#define KEYCACHE_PERM (KEY_POS_VIEW | KEY_POS_SEARCH | KEY_POS_LINK | KEY_POS_SETATTR | \
+        KEY_USR_VIEW | KEY_USR_SEARCH | KEY_USR_LINK)
+
+// Payload of a "fscrypt-provisioning" key, as the kernel expects it
+struct keycache_provisioning {
+    uint32_t type;
+    uint32_t reserved;
+    unsigned char raw[EXT4_MAX_KEY_SIZE];
+};
+
+// Find the key of the given type and description linked into keyring
+// Keyrings without search permission cannot be searched, so list it
+static
+key_serial_t keyring_find(key_serial_t keyring, const char *type, const char *desc)
+{
+    key_serial_t *serials, found = -1;
+    size_t type_sz = strlen(type);
+    long sz = keyctl_read_alloc(keyring, (void **) &serials);
+    for (long i = 0; i < sz / (long) sizeof(*serials) && found == -1; i++) {
+        char *info;
+        if (keyctl_describe_alloc(serials[i], &info) < 0) continue;
+
+        // The description is the last field of "type;uid;gid;perm;description"
+        char *last = strrchr(info, ';');
+        if (strncmp(info, type, type_sz) == 0 && info[type_sz] == ';' && last && strcmp(last + 1, desc) == 0)
+            found = serials[i];
+        free(info);
+    }
+    if (sz > 0) free(serials);
+    return found;
+}
+
+// The keyring of the cache, created when asked to
+// The keyring expires cache_ttl after the last key stored, dropping its keys
+// along with it, so nothing outlives the TTL
+static
+key_serial_t keycache_keyring(bool create)
+{
+    key_serial_t keyring = keyring_find(KEYCACHE_PARENT, "keyring", KEYCACHE_KEYRING);
+    if (keyring != -1 || !create)
+        return keyring;
+
+    keyring = add_key("keyring", KEYCACHE_KEYRING, NULL, 0, KEYCACHE_PARENT);
+    if (keyring == -1) {
+        error(0, "Cannot create the key cache: %s", strerror(errno));
+        return -1;
+    }
+    keyctl_setperm(keyring, KEYCACHE_KEYRING_PERM);
+    return keyring;
+}
+
+// Keyring type and description of the cached key of a descriptor
+static
+const char *keycache_entry(key_desc_t *key_desc, char version, char *desc)
+{
+    full_key_desc_t full;
+    build_full_key_descriptor(key_desc, &full);
+
+    // A v1 entry is the key the kernel looks up, the v2 one is named after
+    // the start of the key identifier
+    if (version != EXT4_POLICY_V2) {
+        snprintf(desc, KEYCACHE_DESC_SZ, "%s", full);
+        return EXT4_ENCRYPTION_KEY_TYPE;
+    }
+    snprintf(desc, KEYCACHE_DESC_SZ, "%s%s", KEYCACHE_V2_PREFIX, full + EXT4_KEY_DESC_PREFIX_SIZE);
+    return KEYCACHE_V2_TYPE;
+}
+
+// Add the cached key of the v2 vault open as dirfd to its filesystem by serial
+static
+int keycache_attach_v2(int dirfd, key_serial_t serial, key_id_t *identifier)
+{
+    struct ext4_add_key_arg add = { .key_spec.type = EXT4_KEY_SPEC_TYPE_IDENTIFIER, .key_id = serial };
+    if (ioctl(dirfd, EXT4_IOC_ADD_ENCRYPTION_KEY, &add) != 0)
+        return -1;
+    if (memcmp(add.key_spec.u.identifier, *identifier, sizeof(key_id_t)) == 0)
+        return 0;
+
+    // Another key with the same start of its identifier: take it off again
+    struct ext4_remove_key_arg remove = { .key_spec = add.key_spec };
+    ioctl(dirfd, EXT4_IOC_REMOVE_ENCRYPTION_KEY, &remove);
+    return -1;
+}
+
+// Decrypt the vault at dir_path with the key cached for it, without a passphrase
+// Return 0 when decrypted, -1 when no usable key is cached
+int keycache_attach(const char *dir_path)
+{
+    key_serial_t keyring = keycache_keyring(false);
+    if (keyring == -1)
+        return -1;
+
+    int dirfd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+    if (dirfd < 0 || vault_policy_fd(dirfd, &policy, &identifier) != 1) {
+        if (dirfd >= 0) close(dirfd);
+        return -1;
+    }
+
+    char desc[KEYCACHE_DESC_SZ];
+    const char *type = keycache_entry(&policy.master_key_descriptor, policy.version, desc);
+
+    TRACE_BEGIN(keycache_lookup);
+    key_serial_t serial = keyring_find(keyring, type, desc);
+    int ret = -1;
+    if (serial != -1) {
+        struct vault_lock lock;
+        vault_lock(&policy, &lock);
+        if (policy.version == EXT4_POLICY_V2) ret = keycache_attach_v2(dirfd, serial, &identifier);
+        else {
+            key_serial_t vault = vault_keyring(true);
+            ret = (vault != -1 && keyctl_link(serial, vault) == 0) ? 0 : -1;
+        }
+        vault_unlock(&lock);
+    }
+    TRACE_END(keycache_lookup);
+
+    close(dirfd);
+    return ret;
+}
+
+// Keep the key of a vault with descriptor and policy version for cache_ttl
+// seconds, in a key of the kernel that userspace cannot read back
+int keycache_store(key_desc_t *key_desc, char version, const struct ext4_encryption_key *key)
+{
+    key_serial_t keyring = keycache_keyring(true);
+    if (keyring == -1)
+        return -1;
+
+    char desc[KEYCACHE_DESC_SZ];
+    const char *type = keycache_entry(key_desc, version, desc);
+
+    key_serial_t serial;
+    if (version != EXT4_POLICY_V2) serial = add_key(type, desc, key, sizeof(*key), keyring);
+    else {
+        struct keycache_provisioning payload = { .type = EXT4_KEY_SPEC_TYPE_IDENTIFIER };
+        memcpy(payload.raw, key->raw, key->size);
+        serial = add_key(type, desc, &payload, offsetof(struct keycache_provisioning, raw) + key->size, keyring);
+        sodium_memzero(&payload, sizeof(payload));
+    }
+    if (serial == -1) {
+        error(0, "Cannot add key to cache: %s", strerror(errno));
+        return -1;
+    }
+
+    keyctl_setperm(serial, KEYCACHE_PERM);
+    keyctl_set_timeout(keyring, cache_ttl);
+    return 0;
+}
+
+// Remove all cached keys, and the entries earlier versions left
+// Return the number of keys removed
+int keycache_flush()
+{
+    int removed = 0;
+    key_serial_t keyring = keycache_keyring(false);
+    if (keyring != -1) {
+        long sz = keyctl_read(keyring, NULL, 0);
+        if (keyctl_clear(keyring) == 0 && sz > 0) removed += sz / sizeof(key_serial_t);
+        keyctl_unlink(keyring, KEYCACHE_PARENT);
+    }
+
+    key_serial_t *serials;
+    long sz = keyctl_read_alloc(KEYCACHE_PARENT, (void **) &serials);
+    if (sz < 0) {
+        error(0, "Cannot read keyring: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sz / sizeof(*serials); i++) {
+        char *info;
+        if (keyctl_describe_alloc(serials[i], &info) < 0) continue;
+
+        char *desc = strrchr(info, ';');
+        if (strncmp(info, KEYCACHE_OLD_TYPE ";", sizeof(KEYCACHE_OLD_TYPE)) == 0 && desc &&
+                (strncmp(desc + 1, KEYCACHE_OLD_PREFIX, strlen(KEYCACHE_OLD_PREFIX)) == 0 ||
+                 strcmp(desc + 1, KEYCACHE_OLD_SECRET) == 0)) {
+            if (keyctl_invalidate(serials[i]) == 0 ||
+                    keyctl_unlink(serials[i], KEYCACHE_PARENT) == 0)
+                removed++;
+        }
+        free(info);
+    }
+
+    free(serials);
+    return removed;
+}
@@ -0,0 +1,248 @@
+// keyfile.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <keyutils.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define KEYFILE_MAGIC "E2CK"
+#define KEYFILE_VERSION 1
+#define KEYFILE_WRAP_TYPE "user"
+#define KEYFILE_WRAP_KEY "e2crypt:wrap"
+#define KEYFILE_WRAP_SZ crypto_aead_xchacha20poly1305_ietf_KEYBYTES
+#define KEYFILE_RAW_SZ EXT4_MAX_KEY_SIZE
+
+// Key file sealed under the wrapping key of the user keyring
+// The header is authenticated along with the key
+struct keyfile_wrapped {
+    char magic[4];
+    uint8_t version;
+    uint8_t reserved[3];
+    unsigned char nonce[crypto_aead_xchacha20poly1305_ietf_NPUBBYTES];
+    unsigned char sealed[KEYFILE_RAW_SZ + crypto_aead_xchacha20poly1305_ietf_ABYTES];
+} __attribute__((__packed__));
+
+#define KEYFILE_HEADER_SZ offsetof(struct keyfile_wrapped, nonce)
+
+// Get the wrapping key, which whoever provisions the machine adds as
+// "user" key KEYFILE_WRAP_KEY to the keyrings of the process
+static
+int keyfile_wrap_key(unsigned char *wrap)
+{
+    long serial = keyctl_search(KEY_SPEC_USER_SESSION_KEYRING, KEYFILE_WRAP_TYPE, KEYFILE_WRAP_KEY, 0);
+    if (serial == -1)
+        serial = request_key(KEYFILE_WRAP_TYPE, KEYFILE_WRAP_KEY, NULL, 0);
+    if (serial == -1 || keyctl_read(serial, (char *) wrap, KEYFILE_WRAP_SZ) != KEYFILE_WRAP_SZ)
+        return -1;
+    return 0;
+}
+
+// Open the key file spec: a path, '-' for stdin or the number of an open descriptor
+static
+int keyfile_open(const char *spec, int flags, bool *owned)
+{
+    *owned = false;
+    if (strcmp(spec, "-") == 0)
+        return STDIN_FILENO;
+    if (spec[0] && strspn(spec, "0123456789") == strlen(spec))
+        return atoi(spec);
+
+    *owned = true;
+    return open(spec, flags | O_CLOEXEC | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+}
+
+// Take the raw key out of a key file read into buf, sz bytes long
+static
+int keyfile_unwrap(const char *spec, const unsigned char *buf, ssize_t sz, struct ext4_encryption_key *raw)
+{
+    const struct keyfile_wrapped *wrapped = (const struct keyfile_wrapped *) buf;
+    memset(raw, 0, sizeof(*raw));
+
+    if (sz != sizeof(*wrapped) || memcmp(wrapped->magic, KEYFILE_MAGIC, sizeof(wrapped->magic)) != 0) {
+        if (sz != KEYFILE_RAW_SZ && sz != KEYFILE_RAW_SZ / 2) {
+            error(0, "Key file %s must hold a raw key of %d or %d bytes, or a wrapped key", spec,
+                    KEYFILE_RAW_SZ / 2, KEYFILE_RAW_SZ);
+            return -1;
+        }
+        memcpy(raw->raw, buf, sz);
+        raw->size = sz;
+        return 0;
+    }
+
+    if (wrapped->version != KEYFILE_VERSION) {
+        error(0, "Key file %s has unknown version %u", spec, wrapped->version);
+        return -1;
+    }
+
+    unsigned char wrap[KEYFILE_WRAP_SZ];
+    if (keyfile_wrap_key(wrap) < 0) {
+        error(0, "Cannot unwrap key file %s: no %s key in the keyring", spec, KEYFILE_WRAP_KEY);
+        return -1;
+    }
+
+    unsigned long long raw_sz;
+    int ret = crypto_aead_xchacha20poly1305_ietf_decrypt(raw->raw, &raw_sz, NULL,
+            wrapped->sealed, sizeof(wrapped->sealed), buf, KEYFILE_HEADER_SZ, wrapped->nonce, wrap);
+    sodium_memzero(wrap, sizeof(wrap));
+    if (ret != 0) {
+        sodium_memzero(raw->raw, sizeof(raw->raw));
+        error(0, "Cannot unwrap key file %s: not sealed with the key in the keyring", spec);
+        return -1;
+    }
+
+    raw->size = raw_sz;
+    return 0;
+}
+
+// Read the raw key of the key file spec into raw
+int keyfile_read(const char *spec, struct ext4_encryption_key *raw)
+{
+    bool owned;
+    int fd = keyfile_open(spec, O_RDONLY, &owned);
+    if (fd == -1) {
+        error(0, "Cannot open key file %s: %s", spec, strerror(errno));
+        return -1;
+    }
+
+    // One byte more than the largest key file tells a longer file apart
+    size_t n = sizeof(struct keyfile_wrapped) + 1;
+    unsigned char *buf = sodium_malloc(n);
+    ssize_t sz = 0, got = 0;
+    TRACE_BEGIN(key_file);
+    while (buf && (size_t) sz < n && ((got = read(fd, buf + sz, n - sz)) > 0 || (got == -1 && errno == EINTR)))
+        if (got > 0) sz += got;
+    TRACE_END(key_file);
+    if (owned) close(fd);
+
+    int ret = -1;
+    if (!buf) error(0, "Cannot allocate memory for key file %s", spec);
+    else if (got == -1) error(0, "Cannot read key file %s: %s", spec, strerror(errno));
+    else ret = keyfile_unwrap(spec, buf, sz, raw);
+
+    sodium_free(buf);
+    return ret;
+}
+
+// Create the key file at path with a new random key, wrapped when the
+// keyring holds a wrapping key; an existing key file is read instead, so
+// that several vaults can share one, and created tells which happened
+int keyfile_create(const char *path, struct ext4_encryption_key *raw, bool *created)
+{
+    bool owned;
+    *created = false;
+    int fd = keyfile_open(path, O_WRONLY | O_CREAT | O_EXCL, &owned);
+    if (fd == -1 && errno == EEXIST)
+        return keyfile_read(path, raw);
+    if (!owned)
+        return keyfile_read(path, raw);
+    if (fd == -1) {
+        error(0, "Cannot create key file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    memset(raw, 0, sizeof(*raw));
+    raw->size = KEYFILE_RAW_SZ;
+    randombytes_buf(raw->raw, KEYFILE_RAW_SZ);
+
+    struct keyfile_wrapped *wrapped = sodium_malloc(sizeof(*wrapped));
+    unsigned char wrap[KEYFILE_WRAP_SZ];
+    const void *out = raw->raw;
+    size_t out_sz = KEYFILE_RAW_SZ;
+    if (wrapped && keyfile_wrap_key(wrap) == 0) {
+        memset(wrapped, 0, sizeof(*wrapped));
+        memcpy(wrapped->magic, KEYFILE_MAGIC, sizeof(wrapped->magic));
+        wrapped->version = KEYFILE_VERSION;
+        randombytes_buf(wrapped->nonce, sizeof(wrapped->nonce));
+        crypto_aead_xchacha20poly1305_ietf_encrypt(wrapped->sealed, NULL, raw->raw, KEYFILE_RAW_SZ,
+                (const unsigned char *) wrapped, KEYFILE_HEADER_SZ, NULL, wrapped->nonce, wrap);
+        sodium_memzero(wrap, sizeof(wrap));
+        out = wrapped;
+        out_sz = sizeof(*wrapped);
+    }
+
+    int ret = (write(fd, out, out_sz) == (ssize_t) out_sz && fsync(fd) == 0) ? 0 : -1;
+    if (ret < 0) {
+        error(0, "Cannot write key file %s: %s", path, strerror(errno));
+        unlink(path);
+        sodium_memzero(raw->raw, sizeof(raw->raw));
+    }
+    else {
+        *created = true;
+        if (out == wrapped) printf("Key file %s wrapped with the %s key\n", path, KEYFILE_WRAP_KEY);
+    }
+
+    close(fd);
+    sodium_free(wrapped);
+    return ret;
+}
+
+// Decrypt the directories with the key of the key file spec, read once for all
+// The key is checked against the verifier of each vault before it is added
+int keyfile_attach(char **dir_paths, size_t n, const char *spec)
+{
+    if (crypto_init() == -1) {
+        error(0, "Cannot access cryptography system");
+        return -1;
+    }
+
+    struct ext4_encryption_key *raw = sodium_malloc(sizeof(*raw) * 2);
+    if (!raw) {
+        error(0, "Cannot allocate memory for the key");
+        return -1;
+    }
+    memset(raw, 0, sizeof(*raw) * 2);
+    struct ext4_encryption_key *key = raw + 1;
+    char **done = calloc(n, sizeof(*done));
+    int ret = (done && keyfile_read(spec, raw) == 0) ? 0 : -1;
+    keyring_make_room(n);
+
+    size_t ndone = 0;
+    for (size_t i = 0; i < n && done && raw->size; i++) {
+        struct ext4_encryption_policy policy;
+        struct vault_meta meta;
+        if (vault_policy(dir_paths[i], &policy) < 0 || vault_meta_read(dir_paths[i], &meta) < 0) {
+            error(0, "Cannot decrypt %s", dir_paths[i]);
+            ret = -1;
+            continue;
+        }
+
+        // A policy with a shorter key uses the start of the key file
+        memset(key, 0, sizeof(*key));
+        key->size = policy_key_size(&policy);
+        if (key->size > raw->size) {
+            error(0, "Key file %s too short for the policy of %s", spec, dir_paths[i]);
+            ret = -1;
+            continue;
+        }
+        memcpy(key->raw, raw->raw, key->size);
+        if (!vault_verifier_check(&meta, &policy.master_key_descriptor, key)) {
+            error(0, "Key file %s does not match %s", spec, dir_paths[i]);
+            ret = -1;
+            continue;
+        }
+
+        if (vault_key_status(dir_paths[i]) == EXT4_KEY_STATUS_PRESENT)
+            printf("Directory %s already decrypted\n", dir_paths[i]);
+        else if (vault_attach_key(dir_paths[i], key) < 0) {
+            error(0, "Error in decrypting directory %s", dir_paths[i]);
+            ret = -1;
+        }
+        else {
+            printf("Directory %s now decrypted\n", dir_paths[i]);
+            done[ndone++] = dir_paths[i];
+        }
+    }
+
+    sodium_free(raw);
+    status_index_update_batch(done, ndone);
+    free(done);
+    return ret;
+}
@@ -7,26 +7,28 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/prctl.h>
+#include <sys/file.h>
 #include <fcntl.h>
-#include <linux/random.h>
-#include <time.h>
 #include <keyutils.h>
 #include <sodium.h>
-#include <termios.h>
 #include <errno.h>
 
 #include "e2crypt.h"
 
-// Derive ext4 encryption key from passphrase
-static
-int derive_passphrase_to_key(char *pass, size_t pass_sz, struct ext4_encryption_key *key)
+// Derive ext4 encryption key from passphrase with the vault's KDF parameters
+// Spread the KDF over the given number of threads, or as many as allowed when 0
+int derive_passphrase_to_key(const char *pass, size_t pass_sz, const struct kdf_params *params,
+        struct ext4_encryption_key *key, unsigned threads)
 {
-    const unsigned char salt[] = "ext4";
+    const uint64_t N = params->N;
+    const uint32_t r = params->r, p = params->p;
 
-    int ret = crypto_pwhash_scryptsalsa208sha256_ll(
-            (uint8_t *) pass, pass_sz, salt, sizeof(salt) - 1,
-            (1 << 14), 8, 16, // N, r, p
+    TRACE_BEGIN(scrypt);
+    int ret = scrypt_parallel(
+            (const uint8_t *) pass, pass_sz, params->salt, params->salt_sz,
+            N, r, p, threads ? threads : scrypt_threads(N, r, p),
             key->raw, key->size);
+    TRACE_END(scrypt);
 
     if (ret != 0) {
         error(0, "Failed to derive key from passphrase");
@@ -37,88 +39,32 @@ int derive_passphrase_to_key(char *pass, size_t pass_sz, struct ext4_encryption_
 }
 
 // Convert ext4 key descriptor to a keyring descriptor
-static
 void build_full_key_descriptor(key_desc_t *key_desc, full_key_desc_t *full_key_desc)
 {
-    char tmp[sizeof(*full_key_desc) + 1]; // one extra space for terminating zero
-    strcpy(tmp, EXT4_KEY_DESC_PREFIX);
+    strcpy(*full_key_desc, EXT4_KEY_DESC_PREFIX);
 
     for (size_t i = 0; i < sizeof(*key_desc); i++) {
-        snprintf(tmp + EXT4_KEY_DESC_PREFIX_SIZE + i * 2, 3, "%02x", (*key_desc)[i] & 0xff);
+        snprintf(*full_key_desc + EXT4_KEY_DESC_PREFIX_SIZE + i * 2, 3, "%02x", (*key_desc)[i] & 0xff);
     }
-
-    memcpy(*full_key_desc, tmp, sizeof(*full_key_desc));
-}
-
-// Fill key buffer with zeros
-static
-void zero_key(void *key, size_t key_sz)
-{
-    sodium_memzero(key, key_sz);
-}
-
-// Read passphrase from standard input
-static
-ssize_t read_passphrase(const char *prompt, char *key, size_t n)
-{
-    int stdin_fd = fileno(stdin);
-    const bool tty_input = isatty(stdin_fd);
-    struct termios old, new;
-    size_t key_sz = 0;
-
-    // Show prompt, disable echo
-    if (tty_input) {
-        fprintf(stderr, "%s", prompt);
-        fflush(stderr);
-
-        if (tcgetattr(stdin_fd, &old) != 0) {
-            perror("tcgetattr");
-            return -1;
-        }
-
-        new = old;
-        new.c_lflag &= ~ECHO;
-        if (tcsetattr(stdin_fd, TCSAFLUSH, &new) != 0) {
-            perror("tcsetattr");
-            return -1;
-        }
-    }
-
-    if (fgets(key, n, stdin)) key_sz = strlen(key);
-    if (key_sz > 0 && key[key_sz - 1] == '\n') key[--key_sz] = '\0';
-
-    // Restore echo
-    if (tty_input) {
-        tcsetattr(stdin_fd, TCSAFLUSH, &old);
-        fprintf(stderr, "\n");
-    }
-
-    return key_sz;
-}
-
-// Initialize libc PRNG
-static
-void random_init()
-{
-    unsigned int seed = randombytes_random();
-    srandom(seed);
 }
 
 // Initialize the cryptographic library
 int crypto_init()
 {
-    if (sodium_init() == -1) {
+    TRACE_BEGIN(sodium_init);
+    int ret = sodium_init();
+    TRACE_END(sodium_init);
+    if (ret == -1) {
         error(0, "Cannot initialize libsodium");
         return -1;
     }
 
     // Make sure ptace cannot attach and disable core dumps
     if (prctl(PR_SET_DUMPABLE, 0) != 0) {
-        perror("prctl");
+        error(0, "Cannot protect the process from tracing: %s", strerror(errno));
         return -1;
     }
 
-    random_init();
     return 0;
 }
 
@@ -127,22 +73,94 @@ void generate_random_name(char *name, size_t length, bool filename)
 {
     int byte;
     for (size_t i = 0; i < length; i++) {
-again:  byte = random() % 256;
+again:  byte = randombytes_uniform(256);
         if (filename && (byte == '/' || byte == 0)) goto again;
         name[i] = byte;
     }
     if (filename) name[length] = 0;
 }
 
-// Look up key in the user session keyring from an ext4 key descriptor
+// Serial of the vault keyring as last found, -1 when not known
+static key_serial_t keyring_serial = -1;
+
+// Move the keys earlier versions added to the session keyring itself into keyring
+static
+void keyring_migrate(key_serial_t keyring)
+{
+    key_serial_t *serials;
+    long sz = keyctl_read_alloc(KEY_SPEC_USER_SESSION_KEYRING, (void **) &serials);
+    for (long i = 0; i < sz / (long) sizeof(*serials); i++) {
+        char *info;
+        if (keyctl_describe_alloc(serials[i], &info) < 0) continue;
+        char *desc = strrchr(info, ';');
+        if (strncmp(info, EXT4_ENCRYPTION_KEY_TYPE ";", sizeof(EXT4_ENCRYPTION_KEY_TYPE)) == 0 && desc
+                && strncmp(desc + 1, EXT4_KEY_DESC_PREFIX, EXT4_KEY_DESC_PREFIX_SIZE) == 0
+                && keyctl_link(serials[i], keyring) == 0)
+            keyctl_unlink(serials[i], KEY_SPEC_USER_SESSION_KEYRING);
+        free(info);
+    }
+    if (sz > 0) free(serials);
+}
+
+// Unlink a key from keyring, or from the session keyring when an earlier
+// version left it there
+static
+long unlink_key(key_serial_t key, key_serial_t keyring)
+{
+    long ret = (keyring == -1) ? -1 : keyctl_unlink(key, keyring);
+    if (ret == -1 && (keyring == -1 || errno == ENOENT))
+        ret = keyctl_unlink(key, KEY_SPEC_USER_SESSION_KEYRING);
+    return ret;
+}
+
+// The keyring of the vault keys, linked into the user session keyring
+// The kernel indexes a keyring by the type and description of its keys, and a
+// search only descends into the keyrings linked into it when that misses; the
+// session keyring holds whatever else the user keeps, this one only vault keys
+// Return the serial of the keyring, or -1 when there is none and create is false
+key_serial_t vault_keyring(bool create)
+{
+    long serial = keyctl_search(KEY_SPEC_USER_SESSION_KEYRING, "keyring", VAULT_KEYRING, 0);
+    if (serial != -1 || !create) {
+        __atomic_store_n(&keyring_serial, serial, __ATOMIC_RELAXED);
+        return serial;
+    }
+
+    serial = add_key("keyring", VAULT_KEYRING, NULL, 0, KEY_SPEC_USER_SESSION_KEYRING);
+    if (serial == -1) {
+        error(0, "Cannot create the %s keyring: %s", VAULT_KEYRING, strerror(errno));
+        return -1;
+    }
+    keyctl_setperm(serial, VAULT_KEYRING_PERM);
+    __atomic_store_n(&keyring_serial, serial, __ATOMIC_RELAXED);
+    keyring_migrate(serial);
+    return serial;
+}
+
+// Look up key in the vault keyring from an ext4 key descriptor
 // Return the key's serial number in serial
+// The keyring found before is searched first; only when that misses is it
+// looked up again, as another process may have replaced it meanwhile
+// A key an earlier version added to the session keyring is found there, and
+// moved along with the others of its kind when the vault keyring exists
 int find_key_by_descriptor(key_desc_t *key_desc, key_serial_t *serial)
 {
     full_key_desc_t full_key_descriptor;
     build_full_key_descriptor(key_desc, &full_key_descriptor);
 
-    long key_serial = keyctl_search(KEY_SPEC_USER_SESSION_KEYRING,
-            EXT4_ENCRYPTION_KEY_TYPE, full_key_descriptor, 0);
+    key_serial_t known = __atomic_load_n(&keyring_serial, __ATOMIC_RELAXED);
+    long key_serial = (known == -1) ? -1 : keyctl_search(known, EXT4_ENCRYPTION_KEY_TYPE, full_key_descriptor, 0);
+    if (key_serial == -1) {
+        key_serial_t keyring = vault_keyring(false);
+        if (keyring != -1 && keyring != known)
+            key_serial = keyctl_search(keyring, EXT4_ENCRYPTION_KEY_TYPE, full_key_descriptor, 0);
+        if (key_serial == -1) {
+            key_serial = keyctl_search(KEY_SPEC_USER_SESSION_KEYRING, EXT4_ENCRYPTION_KEY_TYPE,
+                    full_key_descriptor, 0);
+            if (key_serial != -1 && keyring != -1) keyring_migrate(keyring);
+        }
+    }
+
     if (key_serial != -1) {
         *serial = key_serial;
         return 0;
@@ -160,7 +178,10 @@ int remove_key_for_descriptor(key_desc_t *key_desc)
         return -1;
     }
 
-    if (keyctl_unlink(key_serial, KEY_SPEC_USER_SESSION_KEYRING) == -1) {
+    TRACE_BEGIN(remove_key);
+    long ret = unlink_key(key_serial, vault_keyring(false));
+    TRACE_END(remove_key);
+    if (ret == -1) {
         error(0, "Cannot remove encryption key: %s", strerror(errno));
         return -1;
     }
@@ -168,60 +189,97 @@ int remove_key_for_descriptor(key_desc_t *key_desc)
     return 0;
 }
 
-// Request a key to be attached to the specified descriptor
-int request_key_for_descriptor(key_desc_t *key_desc, bool confirm)
+// Remove the keys of n descriptors at once, setting failed[i] for those not removed
+// When they are all the keyring holds, and no other run uses it, it is cleared
+// in one operation
+// Return the number of keys removed
+size_t remove_keys_for_descriptors(key_desc_t *key_descs, size_t n, bool *failed)
 {
-    int retries = 5;
-    char passphrase[EXT4_MAX_PASSPHRASE_SZ];
-    char confirm_passphrase[sizeof(passphrase)];
-    ssize_t pass_sz;
-    full_key_desc_t full_key_descriptor;
-    build_full_key_descriptor(key_desc, &full_key_descriptor);
+    key_serial_t keyring = vault_keyring(false);
+    key_serial_t *serials = calloc(n ? n : 1, sizeof(*serials));
+    int *locks = calloc(n ? n : 1, sizeof(*locks));
+    if (!serials || !locks) {
+        for (size_t i = 0; i < n; i++) failed[i] = true;
+        free(serials);
+        free(locks);
+        return 0;
+    }
+
+    // Another run may add a key at any time while it holds the keyring shared
+    int keyring_lock = lock_take(LOCK_KEYRING, LOCK_EX | LOCK_NB);
+    bool exclusive = (keyring_lock >= 0);
+    if (!exclusive) keyring_lock = lock_take(LOCK_KEYRING, LOCK_SH);
+    lock_descriptors(key_descs, n, locks);
 
-    while (--retries >= 0) {
-        pass_sz = read_passphrase("Enter passphrase: ", passphrase, sizeof(passphrase));
-        if (pass_sz < 0)
-            return -1;
+    size_t found = 0;
+    for (size_t i = 0; i < n; i++) {
+        failed[i] = (find_key_by_descriptor(&key_descs[i], &serials[i]) < 0);
+        if (!failed[i]) found++;
+    }
 
-        if (pass_sz == 0) {
-            error(0, "Passphrase cannot be empty");
-            continue;
+    size_t removed = 0;
+    long held = (keyring == -1) ? -1 : keyctl_read(keyring, NULL, 0);
+    if (exclusive && found > 0 && held == (long) (found * sizeof(key_serial_t)) && keyctl_clear(keyring) == 0)
+        removed = found;
+    else {
+        for (size_t i = 0; i < n; i++) {
+            if (failed[i]) continue;
+            if (unlink_key(serials[i], keyring) == 0) removed++;
+            else failed[i] = true;
         }
+    }
 
-        if (!confirm)
-            break;
+    for (size_t i = 0; i < n; i++) lock_release(locks[i]);
+    lock_release(keyring_lock);
+    free(serials);
+    free(locks);
+    return removed;
+}
 
-        read_passphrase("Confirm passphrase: ", confirm_passphrase, sizeof(confirm_passphrase));
-        if (strcmp(passphrase, confirm_passphrase) == 0)
-            break;
+// Room left in the key quota of the user, as /proc/key-users tells
+// Return -1 when it cannot be read
+int keyring_quota_left(unsigned *keys, unsigned *bytes)
+{
+    FILE *f = fopen("/proc/key-users", "r");
+    if (!f)
+        return -1;
 
-        error(0, "Password mismatch");
+    // "<uid>: <usage> <nkeys>/<nikeys> <qnkeys>/<maxkeys> <qnbytes>/<maxbytes>"
+    unsigned uid, usage, nkeys, nikeys, qnkeys, maxkeys, qnbytes, maxbytes;
+    int ret = -1;
+    while (fscanf(f, " %u: %u %u/%u %u/%u %u/%u", &uid, &usage, &nkeys, &nikeys,
+                &qnkeys, &maxkeys, &qnbytes, &maxbytes) == 8) {
+        if (uid != getuid()) continue;
+        *keys = (qnkeys < maxkeys) ? maxkeys - qnkeys : 0;
+        *bytes = (qnbytes < maxbytes) ? maxbytes - qnbytes : 0;
+        ret = 0;
+        break;
     }
 
-    if (retries < 0) {
-        error(0, "Cannot read passphrase\n");
-        return -1;
-    }
+    fclose(f);
+    return ret;
+}
 
-    struct ext4_encryption_key master_key = {
-        .mode = 0,
-        .raw = { 0 },
-        .size = cipher_key_size(contents_cipher),
-    };
-    if (derive_passphrase_to_key(passphrase, pass_sz, &master_key) < 0)
-        return -1;
+// Add a derived key to the vault keyring under the specified descriptor
+int install_key_for_descriptor(key_desc_t *key_desc, const struct ext4_encryption_key *key)
+{
+    key_serial_t keyring = vault_keyring(true);
+    if (keyring == -1)
+        return E2CRYPT_ERR_KEYRING;
+
+    full_key_desc_t full_key_descriptor;
+    build_full_key_descriptor(key_desc, &full_key_descriptor);
 
+    TRACE_BEGIN(add_key);
     key_serial_t serial = add_key(EXT4_ENCRYPTION_KEY_TYPE,
-            full_key_descriptor, &master_key, sizeof(master_key),
-            KEY_SPEC_USER_SESSION_KEYRING);
+            full_key_descriptor, key, sizeof(*key), keyring);
+    TRACE_END(add_key);
 
-    if (serial == -1) {
-        error(0, "Cannot add key to keyring: %s\n", strerror(errno));
-        return -1;
-    }
+    if (serial == -1 && errno == EDQUOT)
+        return fail(E2CRYPT_ERR_QUOTA, "Cannot add key to keyring: key quota of the user reached, "
+                "recrypt unused vaults or raise /proc/sys/kernel/keys/maxkeys and maxbytes");
+    if (serial == -1)
+        return fail(E2CRYPT_ERR_KEYRING, "Cannot add key to keyring: %s", strerror(errno));
 
-    zero_key(passphrase, sizeof(passphrase));
-    zero_key(confirm_passphrase, sizeof(confirm_passphrase));
-    zero_key(&master_key, sizeof(master_key));
     return 0;
 }
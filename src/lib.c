@@ -0,0 +1,228 @@
+// lib.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define ERROR_SZ 512
+
+// Last error message of each thread
+static __thread char last_error[ERROR_SZ];
+
+// Called with every error message; the command line tool prints them
+static void (*error_handler)(bool, const char *);
+
+static const char *error_names[] = {
+    [-E2CRYPT_OK] = "Success",
+    [-E2CRYPT_ERR_SYSTEM] = "System error",
+    [-E2CRYPT_ERR_INVALID] = "Invalid argument",
+    [-E2CRYPT_ERR_NOT_EXT4] = "Not on an ext4 filesystem",
+    [-E2CRYPT_ERR_UNSUPPORTED] = "Encryption not supported",
+    [-E2CRYPT_ERR_NOT_ENCRYPTED] = "Not an encrypted directory",
+    [-E2CRYPT_ERR_ENCRYPTED] = "Already encrypted",
+    [-E2CRYPT_ERR_NOT_EMPTY] = "Directory not empty",
+    [-E2CRYPT_ERR_WRONG_PASSPHRASE] = "Wrong passphrase",
+    [-E2CRYPT_ERR_NO_KEY] = "Key not in the keyring",
+    [-E2CRYPT_ERR_KEYRING] = "Keyring error",
+    [-E2CRYPT_ERR_CRYPTO] = "Cryptography error",
+    [-E2CRYPT_ERR_METADATA] = "Vault metadata error",
+    [-E2CRYPT_ERR_BUSY] = "Key removed, but files still in use",
+    [-E2CRYPT_ERR_QUOTA] = "Key quota reached",
+};
+
+void error_set_handler(void (*handler)(bool, const char *))
+{
+    error_handler = handler;
+}
+
+static
+void verror(bool show_usage, const char *fmt, va_list args)
+{
+    vsnprintf(last_error, sizeof(last_error), fmt, args);
+    if (error_handler) error_handler(show_usage, last_error);
+}
+
+// Record an error message for the calling thread
+void error(bool show_usage, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    verror(show_usage, fmt, args);
+    va_end(args);
+}
+
+// Record an error message and return its error code
+int fail(int code, const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    verror(0, fmt, args);
+    va_end(args);
+    return code;
+}
+
+const char *e2crypt_strerror(int code)
+{
+    if (code > 0 || -code >= (int) (sizeof(error_names) / sizeof(error_names[0])))
+        return "Unknown error";
+    return error_names[-code];
+}
+
+const char *e2crypt_last_error(void)
+{
+    return last_error;
+}
+
+int e2crypt_init(void)
+{
+    if (sodium_init() == -1)
+        return fail(E2CRYPT_ERR_CRYPTO, "Cannot initialize libsodium");
+    return E2CRYPT_OK;
+}
+
+// Find the mode of a cipher by name, NULL for the default
+static
+int cipher_mode(const char *name, const char *fallback)
+{
+    if (!name) name = fallback;
+    for (size_t i = 1; i < NR_EXT4_ENCRYPTION_MODES; i++)
+        if (strcmp(name, cipher_modes[i].cipher_name) == 0) return i;
+    return fail(E2CRYPT_ERR_INVALID, "Invalid cipher mode: %s", name);
+}
+
+int e2crypt_status(const char *path, struct e2crypt_status *status)
+{
+    if (!path || !status)
+        return fail(E2CRYPT_ERR_INVALID, "No directory or status given");
+
+    return vault_status(path, status);
+}
+
+int e2crypt_create(const char *path, const char *pass, size_t pass_sz,
+        const struct e2crypt_options *options)
+{
+    const struct e2crypt_options defaults = { .padding = 0 };
+    if (!options) options = &defaults;
+
+    if (!path || !pass || pass_sz == 0)
+        return fail(E2CRYPT_ERR_INVALID, "No directory or passphrase given");
+
+    unsigned padding = options->padding ? options->padding : 4;
+    if (padding != 4 && padding != 8 && padding != 16 && padding != 32)
+        return fail(E2CRYPT_ERR_INVALID, "Invalid filename padding length: must be 4, 8, 16 or 32");
+
+    if (options->policy_version > 2)
+        return fail(E2CRYPT_ERR_INVALID, "Invalid policy version: must be 1 or 2");
+
+    int contents_mode = cipher_mode(options->contents_cipher, "aes-256-xts");
+    if (contents_mode < 0)
+        return E2CRYPT_ERR_INVALID;
+
+    if (!cipher_modes[contents_mode].filenames_mode)
+        return fail(E2CRYPT_ERR_INVALID, "Cipher %s cannot encrypt file contents", options->contents_cipher);
+
+    int filenames_mode = options->filenames_cipher ? cipher_mode(options->filenames_cipher, NULL)
+            : cipher_modes[contents_mode].filenames_mode;
+    if (filenames_mode < 0)
+        return E2CRYPT_ERR_INVALID;
+    if (!cipher_pair_valid(contents_mode, filenames_mode))
+        return fail(E2CRYPT_ERR_INVALID, "Cipher %s cannot be used with filenames cipher %s",
+                cipher_modes[contents_mode].cipher_name, cipher_modes[filenames_mode].cipher_name);
+
+    int ret = e2crypt_init();
+    if (ret < 0)
+        return ret;
+
+    struct ext4_encryption_policy template = {
+        .version = !options->policy_version ? EXT4_POLICY_AUTO :
+                (options->policy_version == 2) ? EXT4_POLICY_V2 : EXT4_POLICY_V1,
+        .contents_encryption_mode = contents_mode,
+        .filenames_encryption_mode = filenames_mode,
+        .flags = padding_length_to_flags(padding),
+    };
+    struct ext4_encryption_key key;
+    ret = vault_create(path, &template, pass, pass_sz, options->kdf_threads, &key);
+    sodium_memzero(&key, sizeof(key));
+    return ret;
+}
+
+int e2crypt_derive_key(const char *path, const char *pass, size_t pass_sz,
+        unsigned threads, uint8_t *key, size_t *key_sz)
+{
+    if (!path || !pass || pass_sz == 0 || !key || !key_sz)
+        return fail(E2CRYPT_ERR_INVALID, "No directory, passphrase or key buffer given");
+
+    int ret = e2crypt_init();
+    if (ret < 0)
+        return ret;
+
+    struct ext4_encryption_key derived;
+    ret = vault_derive_key(path, pass, pass_sz, threads, &derived);
+    if (ret == 0 && *key_sz < derived.size)
+        ret = fail(E2CRYPT_ERR_INVALID, "Key buffer of %zu bytes too small for %u bytes",
+                *key_sz, derived.size);
+
+    if (ret == 0) {
+        memcpy(key, derived.raw, derived.size);
+        *key_sz = derived.size;
+    }
+    sodium_memzero(&derived, sizeof(derived));
+    return ret;
+}
+
+int e2crypt_attach(const char *path, const char *pass, size_t pass_sz, unsigned threads)
+{
+    if (!path || !pass || pass_sz == 0)
+        return fail(E2CRYPT_ERR_INVALID, "No directory or passphrase given");
+
+    int ret = e2crypt_init();
+    if (ret < 0)
+        return ret;
+
+    struct ext4_encryption_key key;
+    ret = vault_derive_key(path, pass, pass_sz, threads, &key);
+    if (ret == 0)
+        ret = vault_attach_key(path, &key);
+
+    sodium_memzero(&key, sizeof(key));
+    return ret;
+}
+
+int e2crypt_attach_key(const char *path, const uint8_t *key, size_t key_sz)
+{
+    if (!path || !key || key_sz == 0 || key_sz > E2CRYPT_KEY_MAX)
+        return fail(E2CRYPT_ERR_INVALID, "No directory or key of a valid size given");
+
+    struct ext4_encryption_key ext4_key = { .mode = 0, .size = key_sz };
+    memcpy(ext4_key.raw, key, key_sz);
+    int ret = vault_attach_key(path, &ext4_key);
+    sodium_memzero(&ext4_key, sizeof(ext4_key));
+    return ret;
+}
+
+int e2crypt_detach(const char *path)
+{
+    if (!path)
+        return fail(E2CRYPT_ERR_INVALID, "No directory given");
+
+    return vault_detach(path);
+}
+
+int e2crypt_evict(const char *path, uint64_t *pages)
+{
+    if (!path)
+        return fail(E2CRYPT_ERR_INVALID, "No directory given");
+
+    struct cache_stats stats;
+    if (cache_invalidate_tree(path, &stats) < 0)
+        return E2CRYPT_ERR_SYSTEM;
+
+    if (pages) *pages = stats.pages;
+    return E2CRYPT_OK;
+}
@@ -0,0 +1,114 @@
+// lock.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Directory of the lock files: E2CRYPT_LOCK_DIR, or one of the user in the
+// runtime directory, else in /tmp; it must be a directory of the user
+static
+bool lock_dir(char *path, size_t n)
+{
+    const char *env = getenv("E2CRYPT_LOCK_DIR");
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+
+    if (env && *env) snprintf(path, n, "%s", env);
+    else if (runtime && *runtime) snprintf(path, n, "%s/%s", runtime, NAME);
+    else snprintf(path, n, "/tmp/%s-%u", NAME, (unsigned) getuid());
+
+    struct stat st;
+    if (mkdir(path, S_IRWXU) != 0 && errno != EEXIST)
+        return false;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid();
+}
+
+// Take the lock of the given name with flock operation op (LOCK_SH or
+// LOCK_EX, maybe with LOCK_NB), waiting for it unless LOCK_NB is given
+// Return the descriptor holding the lock, -1 when not taken: the lock files
+// never go away, as removing one could let two runs hold the same name
+int lock_take(const char *name, int op)
+{
+    char path[PATH_MAX];
+    if (!lock_dir(path, sizeof(path) - strlen(name) - 8))
+        return -1;
+    snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s.lock", name);
+
+    int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+        return -1;
+
+    TRACE_BEGIN(lock_wait);
+    int ret;
+    while ((ret = flock(fd, op)) != 0 && errno == EINTR);
+    TRACE_END(lock_wait);
+    if (ret != 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Release a lock taken by lock_take, if any
+void lock_release(int fd)
+{
+    if (fd >= 0) close(fd);
+}
+
+// Take the lock of a key descriptor, exclusive as the key is added or removed
+int lock_descriptor(const key_desc_t *key_desc, int op)
+{
+    char name[EXT4_KEY_DESCRIPTOR_SIZE * 2 + 1];
+    for (int i = 0; i < EXT4_KEY_DESCRIPTOR_SIZE; i++)
+        sprintf(name + i * 2, "%02x", (*key_desc)[i] & 0xff);
+    return lock_take(name, op);
+}
+
+// Lock the key of the vault with policy against other runs adding or removing
+// it; a v1 key also holds the keyring shared, so that it is not cleared at once
+// Reading the state of a vault takes no lock, and different keys never wait
+void vault_lock(const struct ext4_encryption_policy *policy, struct vault_lock *lock)
+{
+    lock->keyring = (policy->version != EXT4_POLICY_V2) ? lock_take(LOCK_KEYRING, LOCK_SH) : -1;
+    lock->descriptor = lock_descriptor(&policy->master_key_descriptor, LOCK_EX);
+}
+
+void vault_unlock(struct vault_lock *lock)
+{
+    lock_release(lock->descriptor);
+    lock_release(lock->keyring);
+    lock->descriptor = lock->keyring = -1;
+}
+
+static
+int compare_descriptors(const void *a, const void *b)
+{
+    return memcmp(a, b, sizeof(key_desc_t));
+}
+
+// Lock n descriptors at once, in a fixed order so that runs locking
+// overlapping sets never wait on each other in a cycle; the n entries of fds
+// are to be released with lock_release
+void lock_descriptors(key_desc_t *key_descs, size_t n, int *fds)
+{
+    key_desc_t *sorted = malloc((n ? n : 1) * sizeof(*sorted));
+    for (size_t i = 0; i < n; i++) fds[i] = -1;
+    if (!sorted)
+        return;
+
+    memcpy(sorted, key_descs, n * sizeof(*sorted));
+    qsort(sorted, n, sizeof(*sorted), compare_descriptors);
+    for (size_t i = 0; i < n; i++)
+        if (i == 0 || memcmp(sorted[i], sorted[i - 1], sizeof(key_desc_t)) != 0)
+            fds[i] = lock_descriptor(&sorted[i], LOCK_EX);
+    free(sorted);
+}
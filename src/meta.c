@@ -0,0 +1,166 @@
+// meta.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/xattr.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define VAULT_META_XATTR "user." NAME
+#define VAULT_META_MAGIC "E2CV"
+#define VAULT_META_VERSION 1
+
+// Vault metadata as stored in the xattr of the vault directory, little endian
+struct vault_meta_disk {
+    char magic[4];
+    uint8_t version;
+    uint8_t flags;
+    uint8_t kdf_log2_n;
+    uint8_t salt_sz;
+    uint32_t kdf_r;
+    uint32_t kdf_p;
+    uint8_t salt[KDF_SALT_MAX];
+    uint8_t verifier[VAULT_VERIFIER_SZ];
+    uint8_t family_nonce[VAULT_NONCE_SZ];
+} __attribute__((__packed__));
+
+// Parameters of vaults created before metadata was recorded
+void kdf_legacy_params(struct kdf_params *params)
+{
+    memset(params, 0, sizeof(*params));
+    params->N = SCRYPT_N;
+    params->r = SCRYPT_R;
+    params->p = SCRYPT_P;
+    memcpy(params->salt, "ext4", 4);
+    params->salt_sz = 4;
+}
+
+// Whether a KDF cost read from metadata or a configuration file is one to
+// run: scrypt accepts it, and one lane fits in the memory of the machine
+bool kdf_params_sane(uint64_t N, uint32_t r, uint32_t p)
+{
+    if (N > (1ULL << KDF_LIMIT_LOG2_N) || r > KDF_LIMIT_R || p > KDF_LIMIT_P || !scrypt_params_ok(N, r, p))
+        return false;
+
+    unsigned long long mem = (unsigned long long) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    unsigned long long limit = available_memory();
+    if (limit && limit < mem) mem = limit;
+    return mem == 0 || 128ULL * r * N <= mem;
+}
+
+// Read the metadata of the vault at dir_path
+// Return 0 when found, 1 for a vault without metadata
+int vault_meta_read(const char *dir_path, struct vault_meta *meta)
+{
+    struct vault_meta_disk disk;
+    memset(meta, 0, sizeof(*meta));
+    kdf_legacy_params(&meta->kdf);
+
+    TRACE_BEGIN(read_meta);
+    ssize_t sz = getxattr(dir_path, VAULT_META_XATTR, &disk, sizeof(disk));
+    TRACE_END(read_meta);
+    if (sz == -1) {
+        if (errno == ENODATA || errno == ENOTSUP) return 1;
+        error(0, "Cannot read metadata of %s: %s", dir_path, strerror(errno));
+        return -1;
+    }
+
+    // Newer versions only append fields, so a shorter record is fine
+    if ((size_t) sz < offsetof(struct vault_meta_disk, salt) ||
+            memcmp(disk.magic, VAULT_META_MAGIC, sizeof(disk.magic)) != 0 ||
+            disk.kdf_log2_n < 1 || disk.kdf_log2_n > KDF_LIMIT_LOG2_N ||
+            !kdf_params_sane(1ULL << disk.kdf_log2_n, le32toh(disk.kdf_r), le32toh(disk.kdf_p)) ||
+            disk.salt_sz > KDF_SALT_MAX ||
+            (size_t) sz < offsetof(struct vault_meta_disk, salt) + disk.salt_sz) {
+        error(0, "Invalid metadata on %s", dir_path);
+        return -1;
+    }
+
+    meta->flags = disk.flags;
+    meta->kdf.N = 1ULL << disk.kdf_log2_n;
+    meta->kdf.r = le32toh(disk.kdf_r);
+    meta->kdf.p = le32toh(disk.kdf_p);
+    meta->kdf.salt_sz = disk.salt_sz;
+    memcpy(meta->kdf.salt, disk.salt, disk.salt_sz);
+
+    // Records written before the verifier existed have no way to check a key
+    if ((size_t) sz >= offsetof(struct vault_meta_disk, verifier) + VAULT_VERIFIER_SZ)
+        memcpy(meta->verifier, disk.verifier, VAULT_VERIFIER_SZ);
+    else meta->flags &= ~VAULT_META_VERIFIER;
+
+    // The key of a family vault cannot be derived without its nonce
+    if (meta->flags & VAULT_META_FAMILY) {
+        if ((size_t) sz < offsetof(struct vault_meta_disk, family_nonce) + VAULT_NONCE_SZ) {
+            error(0, "Invalid metadata on %s", dir_path);
+            return -1;
+        }
+        memcpy(meta->family_nonce, disk.family_nonce, VAULT_NONCE_SZ);
+    }
+    return 0;
+}
+
+// Record the metadata on the vault directory
+int vault_meta_write(int dirfd, const struct vault_meta *meta)
+{
+    struct vault_meta_disk disk = { .version = VAULT_META_VERSION };
+    memcpy(disk.magic, VAULT_META_MAGIC, sizeof(disk.magic));
+    disk.flags = meta->flags;
+    disk.kdf_log2_n = __builtin_ctzll(meta->kdf.N);
+    disk.kdf_r = htole32(meta->kdf.r);
+    disk.kdf_p = htole32(meta->kdf.p);
+    disk.salt_sz = meta->kdf.salt_sz;
+    memcpy(disk.salt, meta->kdf.salt, meta->kdf.salt_sz);
+    memcpy(disk.verifier, meta->verifier, VAULT_VERIFIER_SZ);
+    memcpy(disk.family_nonce, meta->family_nonce, VAULT_NONCE_SZ);
+
+    TRACE_BEGIN(write_meta);
+    int ret = fsetxattr(dirfd, VAULT_META_XATTR, &disk, sizeof(disk), 0);
+    TRACE_END(write_meta);
+    if (ret != 0) {
+        error(0, "Cannot record vault metadata: %s", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Compute the verifier of a derived key: a MAC under the key itself, so it
+// reveals nothing that does not already require running the KDF
+static
+void vault_verifier(key_desc_t *key_desc, const struct ext4_encryption_key *key, uint8_t *out)
+{
+    static const char label[] = NAME " key verifier";
+    crypto_generichash_state state;
+    crypto_generichash_init(&state, key->raw, key->size, VAULT_VERIFIER_SZ);
+    crypto_generichash_update(&state, (const unsigned char *) label, sizeof(label));
+    crypto_generichash_update(&state, (const unsigned char *) *key_desc, sizeof(key_desc_t));
+    crypto_generichash_final(&state, out, VAULT_VERIFIER_SZ);
+}
+
+// Record the verifier of the key of a new vault in its metadata
+void vault_verifier_set(struct vault_meta *meta, key_desc_t *key_desc,
+        const struct ext4_encryption_key *key)
+{
+    vault_verifier(key_desc, key, meta->verifier);
+    meta->flags |= VAULT_META_VERIFIER;
+}
+
+// Check a derived key against the verifier of the vault
+// Vaults without a verifier accept any key, as before
+bool vault_verifier_check(const struct vault_meta *meta, key_desc_t *key_desc,
+        const struct ext4_encryption_key *key)
+{
+    if (!(meta->flags & VAULT_META_VERIFIER))
+        return true;
+
+    uint8_t verifier[VAULT_VERIFIER_SZ];
+    vault_verifier(key_desc, key, verifier);
+    return sodium_memcmp(verifier, meta->verifier, VAULT_VERIFIER_SZ) == 0;
+}
@@ -0,0 +1,312 @@
+// padding.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sodium.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Characters of the generated names
+static const char name_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789_-";
+
+static const unsigned paddings[] = { 4, 8, 16, 32 };
+
+#define NR_PADDINGS (sizeof(paddings) / sizeof(paddings[0]))
+
+// Throughputs of one vault, in operations per second
+struct padding_result {
+    double create;
+    double readdir[2];
+    double stat[2];
+    double lookup[2];
+    unsigned long long dir_kib;
+};
+
+static
+double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Number of distinct names of min_len to max_len bytes, saturated at limit
+static
+size_t name_space(const struct name_spec *spec, size_t limit)
+{
+    size_t total = 0, of_len = 1;
+    for (unsigned len = 1; len <= spec->max_len && total < limit; len++) {
+        of_len = (of_len > limit / (sizeof(name_chars) - 1)) ? limit : of_len * (sizeof(name_chars) - 1);
+        if (len >= spec->min_len) total += of_len;
+    }
+    return (total < limit) ? total : limit;
+}
+
+static
+uint64_t name_hash(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (; *name; name++) h = (h ^ (unsigned char) *name) * 1099511628211ULL;
+    return h;
+}
+
+// Fill names with count distinct random names of min_len to max_len bytes
+// The second half of the names is never created, for negative lookups
+// A name drawn twice is drawn again, kept apart by an open addressing set
+static
+int make_names(char **names, size_t count, const struct name_spec *spec)
+{
+    if (name_space(spec, count) < count) {
+        error(0, "Cannot make %zu distinct names of %u to %u bytes", count, spec->min_len, spec->max_len);
+        return -1;
+    }
+
+    size_t slots = 1;
+    while (slots < count * 2) slots *= 2;
+    char **set = calloc(slots, sizeof(*set));
+    if (!set) {
+        error(0, "Cannot allocate %zu names", count);
+        return -1;
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        names[i] = malloc(spec->max_len + 1);
+        if (!names[i]) {
+            error(0, "Cannot allocate %zu names", count);
+            ret = -1;
+            break;
+        }
+
+        size_t slot;
+        do {
+            unsigned len = spec->min_len + randombytes_uniform(spec->max_len - spec->min_len + 1);
+            for (unsigned j = 0; j < len; j++)
+                names[i][j] = name_chars[randombytes_uniform(sizeof(name_chars) - 1)];
+            names[i][len] = '\0';
+
+            slot = name_hash(names[i]) & (slots - 1);
+            while (set[slot] && strcmp(set[slot], names[i]) != 0) slot = (slot + 1) & (slots - 1);
+        } while (set[slot]);
+        set[slot] = names[i];
+    }
+
+    free(set);
+    return ret;
+}
+
+// Read all entries of the directory at path, return entries per second
+// Warm, a directory is quickly read, so it is read again until it took some time
+static
+double time_readdir(const char *path, size_t count, bool again)
+{
+    unsigned long long entries = 0;
+    double start = now_s(), elapsed = 0;
+    do {
+        DIR *dir = opendir(path);
+        if (!dir) return 0;
+        while (readdir(dir)) entries++;
+        closedir(dir);
+        elapsed = now_s() - start;
+    } while (again && elapsed < 0.2 && entries < count * 64);
+
+    return entries / elapsed;
+}
+
+// Stat the names from first to last, return names per second
+static
+double time_stat(int dirfd, char **names, size_t first, size_t last)
+{
+    struct stat st;
+    double start = now_s();
+    for (size_t i = first; i < last; i++) fstatat(dirfd, names[i], &st, AT_SYMLINK_NOFOLLOW);
+    double elapsed = now_s() - start;
+    return (last - first) / (elapsed > 0 ? elapsed : 1e-9);
+}
+
+// Forget the cached dentries, inodes and directory blocks of the vault
+// For v2 the kernel evicts them when the key is removed; v1 has no such
+// eviction, only dropping the caches of the whole machine
+static
+int make_cold(const char *path, const struct ext4_encryption_policy *policy,
+        const struct ext4_encryption_key *key)
+{
+    if (policy->version != EXT4_POLICY_V2)
+        return drop_caches ? cache_drop_global() : -1;
+
+    int ret = vault_detach(path);
+    if (ret < 0 && ret != E2CRYPT_ERR_BUSY)
+        return -1;
+    return (vault_attach_key(path, key) == 0) ? 0 : -1;
+}
+
+// Measure the vault at path, initialized with the given padding, for the names of spec
+static
+int bench_vault(const char *path, const struct ext4_encryption_policy *policy,
+        const struct ext4_encryption_key *key, char **names, size_t count, struct padding_result *result)
+{
+    memset(result, 0, sizeof(*result));
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1)
+        return -1;
+
+    // Create the first half of the names, the other half stays absent
+    size_t created = count / 2;
+    double start = now_s();
+    for (size_t i = 0; i < created; i++) {
+        int fd = openat(dirfd, names[i], O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd == -1 && errno != EEXIST) {
+            error(0, "Cannot create %s/%s: %s", path, names[i], strerror(errno));
+            close(dirfd);
+            return -1;
+        }
+        if (fd != -1) close(fd);
+    }
+    syncfs(dirfd);
+    result->create = created / (now_s() - start);
+
+    struct stat st;
+    if (fstat(dirfd, &st) == 0) result->dir_kib = st.st_blocks / 2;
+
+    result->readdir[0] = time_readdir(path, created, true);
+    result->stat[0] = time_stat(dirfd, names, 0, created);
+    result->lookup[0] = time_stat(dirfd, names, created, count);
+    close(dirfd);
+
+    // Every cold measurement starts from emptied caches, and the vault closed
+    if (make_cold(path, policy, key) == 0)
+        result->readdir[1] = time_readdir(path, created, false);
+    if (make_cold(path, policy, key) == 0 && (dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+        result->stat[1] = time_stat(dirfd, names, 0, created);
+        close(dirfd);
+    }
+    if (make_cold(path, policy, key) == 0 && (dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+        result->lookup[1] = time_stat(dirfd, names, created, count);
+        close(dirfd);
+    }
+    return 0;
+}
+
+// Remove the files and the vault at path
+static
+void remove_vault(const char *path, char **names, size_t count)
+{
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd != -1) {
+        for (size_t i = 0; i < count / 2; i++) unlinkat(dirfd, names[i], 0);
+        close(dirfd);
+    }
+    vault_detach(path);
+    if (rmdir(path) != 0)
+        error(0, "Cannot remove %s: %s", path, strerror(errno));
+}
+
+// Print a throughput in thousands of operations per second, '-' when not measured
+static
+void print_rate(double ops_s)
+{
+    if (ops_s <= 0) printf(" %10s", "-");
+    else printf(" %10.1f", ops_s / 1e3);
+}
+
+// Create a vault with each filename padding below scratch_path, fill it with
+// the names of each spec, and print the throughput of create, readdir, stat
+// and negative lookups, warm and with cold caches
+int padding_bench(const char *scratch_path, const struct name_spec *specs, size_t nspecs)
+{
+    if (crypto_init() == -1)
+        return -1;
+
+    struct ext4_encryption_policy scratch;
+    bool cold_missing = false;
+    int ret = vault_policy(scratch_path, &scratch);
+    if (ret == 0) {
+        error(0, "Scratch directory %s must not be encrypted itself", scratch_path);
+        return -1;
+    }
+    if (ret != E2CRYPT_ERR_NOT_ENCRYPTED)
+        return -1;
+    ret = 0;
+
+    printf("%-15s %7s %8s %10s %10s %10s %10s %10s %10s %10s\n", "Names", "Padding", "Dir KiB",
+            "create", "readdir", "(cold)", "stat", "(cold)", "lookup", "(cold)");
+    for (size_t s = 0; s < nspecs && ret == 0; s++) {
+        // Each name is created once, and looked up once while absent
+        size_t count = specs[s].count * 2;
+        char **names = calloc(count, sizeof(*names));
+        if (!names) error(0, "Cannot allocate %zu names", count);
+        if (!names || make_names(names, count, &specs[s]) < 0)
+            ret = -1;
+
+        for (size_t p = 0; p < NR_PADDINGS && ret == 0; p++) {
+            char path[PATH_MAX], pass[32];
+            snprintf(path, sizeof(path), "%s/%s-padding-%u.%u", scratch_path, NAME, paddings[p],
+                    (unsigned) getpid());
+            if (mkdir(path, 0700) != 0) {
+                error(0, "Cannot create %s: %s", path, strerror(errno));
+                ret = -1;
+                break;
+            }
+
+            struct ext4_encryption_policy template = {
+                .version = !policy_version ? EXT4_POLICY_AUTO :
+                        (policy_version == 2) ? EXT4_POLICY_V2 : EXT4_POLICY_V1,
+                .contents_encryption_mode = cipher_string_to_mode(contents_cipher),
+                .filenames_encryption_mode = cipher_string_to_mode(filename_cipher),
+                .flags = padding_length_to_flags(paddings[p]),
+            };
+            struct ext4_encryption_key key;
+            struct ext4_encryption_policy policy;
+            randombytes_buf(pass, sizeof(pass));
+            keyring_make_room(1);
+            ret = vault_create(path, &template, pass, sizeof(pass), 0, &key);
+            sodium_memzero(pass, sizeof(pass));
+            if (ret == 0) ret = vault_policy(path, &policy);
+            if (ret < 0) {
+                rmdir(path);
+                break;
+            }
+
+            struct padding_result result;
+            ret = bench_vault(path, &policy, &key, names, count, &result);
+            if (result.readdir[1] <= 0) cold_missing = true;
+            sodium_memzero(&key, sizeof(key));
+            remove_vault(path, names, count);
+            if (ret < 0)
+                break;
+
+            printf("%7u %3u-%-3u %7u %8llu", specs[s].count, specs[s].min_len, specs[s].max_len,
+                    paddings[p], result.dir_kib);
+            print_rate(result.create);
+            print_rate(result.readdir[0]);
+            print_rate(result.readdir[1]);
+            print_rate(result.stat[0]);
+            print_rate(result.stat[1]);
+            print_rate(result.lookup[0]);
+            print_rate(result.lookup[1]);
+            printf("\n");
+            fflush(stdout);
+        }
+
+        for (size_t i = 0; names && i < count; i++) free(names[i]);
+        free(names);
+    }
+
+    if (ret == 0)
+        printf("Thousands of operations per second; lookup: names that do not exist%s\n",
+                cold_missing ? "; cold v1 vaults need -C" : "");
+    return (ret == 0) ? 0 : -1;
+}
@@ -0,0 +1,123 @@
+// prewarm.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Files accessed within this many seconds are read ahead while the budget lasts
+#define PREWARM_HOT_SECS (7 * 24 * 3600)
+
+struct prewarm_state {
+    unsigned long long budget;
+    unsigned long long read_ahead;
+    unsigned long entries;
+    unsigned long files_read;
+    time_t hot_since;
+};
+
+static
+double now_s()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Take size bytes from the read-ahead budget, all or nothing
+static
+bool prewarm_reserve(struct prewarm_state *state, unsigned long long size)
+{
+    unsigned long long used = __atomic_load_n(&state->read_ahead, __ATOMIC_RELAXED);
+    do {
+        if (used + size > state->budget) return false;
+    } while (!__atomic_compare_exchange_n(&state->read_ahead, &used, used + size, true,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return true;
+}
+
+// Walk callback: bring the inode of an entry into the cache, and the
+// contents of a recently used file while the budget allows
+static
+void prewarm_entry(int dirfd, const char *dir_path, const char *name, unsigned char type,
+        unsigned depth, void *arg)
+{
+    (void) dir_path;
+    (void) depth;
+    struct prewarm_state *state = arg;
+    __atomic_add_fetch(&state->entries, 1, __ATOMIC_RELAXED);
+
+    // The walk itself looked the directories up
+    if (type == DT_DIR)
+        return;
+
+    struct statx stx;
+    unsigned mask = STATX_BASIC_STATS | STATX_ATIME;
+    if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask, &stx) != 0)
+        return;
+
+    if (state->budget == 0 || !S_ISREG(stx.stx_mode) || stx.stx_size == 0
+            || (time_t) stx.stx_atime.tv_sec < state->hot_since
+            || !prewarm_reserve(state, stx.stx_size))
+        return;
+
+    // Reading a file ahead should not make it look used
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOATIME);
+    if (fd == -1 && errno == EPERM) fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) return;
+    readahead(fd, 0, stx.stx_size);
+    close(fd);
+    __atomic_add_fetch(&state->files_read, 1, __ATOMIC_RELAXED);
+}
+
+// Load the metadata of the decrypted vaults among dir_paths into the caches
+// after an unlock: walk each to at most max_depth levels (0: all) on threads
+// threads (0: automatic), statx every entry, and read ahead files used in the
+// last week up to budget bytes for all of them
+int prewarm_vaults(char **dir_paths, size_t n, unsigned max_depth, unsigned long long budget,
+        unsigned threads)
+{
+    struct prewarm_state state = {
+        .budget = budget,
+        .hot_since = time(NULL) - PREWARM_HOT_SECS,
+    };
+    struct walk_ops ops = {
+        .entry = prewarm_entry,
+        .arg = &state,
+        .threads = threads,
+        .max_depth = max_depth,
+    };
+    unsigned long dirs = 0;
+    int ret = 0;
+
+    double start = now_s();
+    TRACE_BEGIN(prewarm);
+    for (size_t i = 0; i < n; i++) {
+        // A vault whose unlock failed stays cold
+        if (vault_key_status(dir_paths[i]) != EXT4_KEY_STATUS_PRESENT)
+            continue;
+
+        struct walk_stats stats;
+        if (walk_tree(dir_paths[i], &ops, &stats) < 0) ret = -1;
+        else dirs += stats.dirs;
+    }
+    TRACE_END(prewarm);
+
+    printf("Prewarmed %lu entries in %lu directories", state.entries, dirs);
+    if (state.files_read)
+        printf(", read ahead %llu KiB of %lu files", state.read_ahead / 1024, state.files_read);
+    printf(" in %.2fs\n", now_s() - start);
+    return ret;
+}
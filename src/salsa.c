@@ -0,0 +1,358 @@
+// salsa.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SALSA_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define SALSA_NEON
+#endif
+
+#include "e2crypt.h"
+
+// The kernels keep every 64-byte block in diagonal order: position p holds
+// word 5p mod 16, so row q (positions 4q..4q+3) of all lanes side by side is
+// one vector and a Salsa20/8 double round is 8 vector steps and 6 shuffles.
+// The blocks of the lanes of a kernel are interleaved row by row:
+// word c of row q of block k of lane l is at ((k * 4 + q) * lanes + l) * 4 + c
+
+static inline
+uint32_t le32dec(const uint8_t *p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+        ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline
+void le32enc(uint8_t *p, uint32_t x)
+{
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = (x >> 24) & 0xff;
+}
+
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+// Word w of a block in diagonal order is at position 13w mod 16
+#define W(w) x[((w) * 13) & 15]
+
+// Salsa20/8 core, applied in place to one block in diagonal order
+static
+void salsa20_8(uint32_t b[16])
+{
+    uint32_t x[16];
+    memcpy(x, b, sizeof(x));
+
+    for (int i = 0; i < 8; i += 2) {
+        W( 4) ^= R(W( 0) + W(12),  7);  W( 8) ^= R(W( 4) + W( 0),  9);
+        W(12) ^= R(W( 8) + W( 4), 13);  W( 0) ^= R(W(12) + W( 8), 18);
+        W( 9) ^= R(W( 5) + W( 1),  7);  W(13) ^= R(W( 9) + W( 5),  9);
+        W( 1) ^= R(W(13) + W( 9), 13);  W( 5) ^= R(W( 1) + W(13), 18);
+        W(14) ^= R(W(10) + W( 6),  7);  W( 2) ^= R(W(14) + W(10),  9);
+        W( 6) ^= R(W( 2) + W(14), 13);  W(10) ^= R(W( 6) + W( 2), 18);
+        W( 3) ^= R(W(15) + W(11),  7);  W( 7) ^= R(W( 3) + W(15),  9);
+        W(11) ^= R(W( 7) + W( 3), 13);  W(15) ^= R(W(11) + W( 7), 18);
+
+        W( 1) ^= R(W( 0) + W( 3),  7);  W( 2) ^= R(W( 1) + W( 0),  9);
+        W( 3) ^= R(W( 2) + W( 1), 13);  W( 0) ^= R(W( 3) + W( 2), 18);
+        W( 6) ^= R(W( 5) + W( 4),  7);  W( 7) ^= R(W( 6) + W( 5),  9);
+        W( 4) ^= R(W( 7) + W( 6), 13);  W( 5) ^= R(W( 4) + W( 7), 18);
+        W(11) ^= R(W(10) + W( 9),  7);  W( 8) ^= R(W(11) + W(10),  9);
+        W( 9) ^= R(W( 8) + W(11), 13);  W(10) ^= R(W( 9) + W( 8), 18);
+        W(12) ^= R(W(15) + W(14),  7);  W(13) ^= R(W(12) + W(15),  9);
+        W(14) ^= R(W(13) + W(12), 13);  W(15) ^= R(W(14) + W(13), 18);
+    }
+
+    for (int i = 0; i < 16; i++) b[i] += x[i];
+}
+
+#undef W
+#undef R
+
+// scrypt BlockMix of one lane: B (2r blocks) -> Y
+static
+void blockmix_scalar(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    uint32_t x[16];
+    memcpy(x, &b[(2 * r - 1) * 16], sizeof(x));
+
+    for (uint32_t i = 0; i < 2 * r; i++) {
+        for (int k = 0; k < 16; k++) x[k] ^= b[i * 16 + k];
+        salsa20_8(x);
+        // Even blocks go to the first half of Y, odd blocks to the second
+        memcpy(&y[((i & 1) * r + i / 2) * 16], x, sizeof(x));
+    }
+}
+
+static
+bool supported_always()
+{
+    return true;
+}
+
+// One double round on the rows a0..a3 of the lanes in vectors:
+// ADD, XOR, ROTL and the 32-bit word rotations SHUF1 (left by 1), SHUF2, SHUF3
+#define SALSA_DOUBLE_ROUND(a0, a1, a2, a3) \
+    do { \
+        a1 = XOR(a1, ROTL(ADD(a0, a3), 7)); \
+        a2 = XOR(a2, ROTL(ADD(a1, a0), 9)); \
+        a3 = XOR(a3, ROTL(ADD(a2, a1), 13)); \
+        a0 = XOR(a0, ROTL(ADD(a3, a2), 18)); \
+        a1 = SHUF3(a1); a2 = SHUF2(a2); a3 = SHUF1(a3); \
+        a3 = XOR(a3, ROTL(ADD(a0, a1), 7)); \
+        a2 = XOR(a2, ROTL(ADD(a3, a0), 9)); \
+        a1 = XOR(a1, ROTL(ADD(a2, a3), 13)); \
+        a0 = XOR(a0, ROTL(ADD(a1, a2), 18)); \
+        a1 = SHUF1(a1); a2 = SHUF2(a2); a3 = SHUF3(a3); \
+    } while (0)
+
+// BlockMix over the interleaved lanes with 4 vectors of type V per block
+#define SALSA_BLOCKMIX(V) \
+    do { \
+        const V *bv = (const V *) b; \
+        V *yv = (V *) y; \
+        V x0 = bv[(2 * r - 1) * 4], x1 = bv[(2 * r - 1) * 4 + 1]; \
+        V x2 = bv[(2 * r - 1) * 4 + 2], x3 = bv[(2 * r - 1) * 4 + 3]; \
+        for (uint32_t i = 0; i < 2 * r; i++) { \
+            x0 = XOR(x0, bv[i * 4]); x1 = XOR(x1, bv[i * 4 + 1]); \
+            x2 = XOR(x2, bv[i * 4 + 2]); x3 = XOR(x3, bv[i * 4 + 3]); \
+            V t0 = x0, t1 = x1, t2 = x2, t3 = x3; \
+            for (int k = 0; k < 8; k += 2) \
+                SALSA_DOUBLE_ROUND(x0, x1, x2, x3); \
+            x0 = ADD(x0, t0); x1 = ADD(x1, t1); x2 = ADD(x2, t2); x3 = ADD(x3, t3); \
+            V *out = &yv[((i & 1) * r + i / 2) * 4]; \
+            out[0] = x0; out[1] = x1; out[2] = x2; out[3] = x3; \
+        } \
+    } while (0)
+
+// The same with two groups of lanes, 8 vectors per block: the rounds of the
+// groups are independent, so one hides the latency of the other
+#define SALSA_BLOCKMIX_X2(V) \
+    do { \
+        const V *bv = (const V *) b; \
+        V *yv = (V *) y; \
+        const V *last = &bv[(2 * r - 1) * 8]; \
+        V x0 = last[0], z0 = last[1], x1 = last[2], z1 = last[3]; \
+        V x2 = last[4], z2 = last[5], x3 = last[6], z3 = last[7]; \
+        for (uint32_t i = 0; i < 2 * r; i++) { \
+            const V *in = &bv[i * 8]; \
+            x0 = XOR(x0, in[0]); z0 = XOR(z0, in[1]); x1 = XOR(x1, in[2]); z1 = XOR(z1, in[3]); \
+            x2 = XOR(x2, in[4]); z2 = XOR(z2, in[5]); x3 = XOR(x3, in[6]); z3 = XOR(z3, in[7]); \
+            V t0 = x0, t1 = x1, t2 = x2, t3 = x3; \
+            V u0 = z0, u1 = z1, u2 = z2, u3 = z3; \
+            for (int k = 0; k < 8; k += 2) { \
+                SALSA_DOUBLE_ROUND(x0, x1, x2, x3); \
+                SALSA_DOUBLE_ROUND(z0, z1, z2, z3); \
+            } \
+            x0 = ADD(x0, t0); x1 = ADD(x1, t1); x2 = ADD(x2, t2); x3 = ADD(x3, t3); \
+            z0 = ADD(z0, u0); z1 = ADD(z1, u1); z2 = ADD(z2, u2); z3 = ADD(z3, u3); \
+            V *out = &yv[((i & 1) * r + i / 2) * 8]; \
+            out[0] = x0; out[1] = z0; out[2] = x1; out[3] = z1; \
+            out[4] = x2; out[5] = z2; out[6] = x3; out[7] = z3; \
+        } \
+    } while (0)
+
+#ifdef SALSA_X86
+
+#define ADD _mm_add_epi32
+#define XOR _mm_xor_si128
+#define ROTL(a, n) _mm_or_si128(_mm_slli_epi32(a, n), _mm_srli_epi32(a, 32 - (n)))
+#define SHUF1(a) _mm_shuffle_epi32(a, 0x39)
+#define SHUF2(a) _mm_shuffle_epi32(a, 0x4e)
+#define SHUF3(a) _mm_shuffle_epi32(a, 0x93)
+
+__attribute__((target("sse2")))
+static
+void blockmix_sse2_x2(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX_X2(__m128i);
+}
+
+#undef ADD
+#undef XOR
+#undef ROTL
+#undef SHUF1
+#undef SHUF2
+#undef SHUF3
+
+// The shuffles of AVX2 and AVX-512 stay within each 128-bit lane,
+// which holds one row of one scrypt lane
+#define ADD _mm256_add_epi32
+#define XOR _mm256_xor_si256
+#define ROTL(a, n) _mm256_or_si256(_mm256_slli_epi32(a, n), _mm256_srli_epi32(a, 32 - (n)))
+#define SHUF1(a) _mm256_shuffle_epi32(a, 0x39)
+#define SHUF2(a) _mm256_shuffle_epi32(a, 0x4e)
+#define SHUF3(a) _mm256_shuffle_epi32(a, 0x93)
+
+__attribute__((target("avx2")))
+static
+void blockmix_avx2(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX(__m256i);
+}
+
+__attribute__((target("avx2")))
+static
+void blockmix_avx2_x2(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX_X2(__m256i);
+}
+
+#undef ADD
+#undef XOR
+#undef ROTL
+#undef SHUF1
+#undef SHUF2
+#undef SHUF3
+
+#define ADD _mm512_add_epi32
+#define XOR _mm512_xor_si512
+#define ROTL _mm512_rol_epi32
+#define SHUF1(a) _mm512_shuffle_epi32(a, 0x39)
+#define SHUF2(a) _mm512_shuffle_epi32(a, 0x4e)
+#define SHUF3(a) _mm512_shuffle_epi32(a, 0x93)
+
+__attribute__((target("avx512f")))
+static
+void blockmix_avx512(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX(__m512i);
+}
+
+__attribute__((target("avx512f")))
+static
+void blockmix_avx512_x2(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX_X2(__m512i);
+}
+
+#undef ADD
+#undef XOR
+#undef ROTL
+#undef SHUF1
+#undef SHUF2
+#undef SHUF3
+
+static
+bool supported_sse2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static
+bool supported_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static
+bool supported_avx512()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+}
+
+#endif
+
+#ifdef SALSA_NEON
+
+#define ADD vaddq_u32
+#define XOR veorq_u32
+#define ROTL(a, n) vsriq_n_u32(vshlq_n_u32(a, n), a, 32 - (n))
+#define SHUF1(a) vextq_u32(a, a, 1)
+#define SHUF2(a) vextq_u32(a, a, 2)
+#define SHUF3(a) vextq_u32(a, a, 3)
+
+static
+void blockmix_neon_x2(const uint32_t *b, uint32_t *y, uint32_t r)
+{
+    SALSA_BLOCKMIX_X2(uint32x4_t);
+}
+
+#endif
+
+// Fastest first; a kernel runs as many lanes as it has, the last one a single lane
+// A single lane in 128-bit vectors is one chain of dependent steps and loses to
+// the scalar core, so SSE2 and NEON always run two lanes
+static const struct romix_kernel kernels[] = {
+#ifdef SALSA_X86
+    { "avx512x2", 8, supported_avx512, blockmix_avx512_x2 },
+    { "avx512", 4, supported_avx512, blockmix_avx512 },
+    { "avx2x2", 4, supported_avx2, blockmix_avx2_x2 },
+    { "avx2", 2, supported_avx2, blockmix_avx2 },
+    { "sse2x2", 2, supported_sse2, blockmix_sse2_x2 },
+#endif
+#ifdef SALSA_NEON
+    { "neonx2", 2, supported_always, blockmix_neon_x2 },
+#endif
+    { "scalar", 1, supported_always, blockmix_scalar },
+};
+
+// The i-th ROMix kernel of this build, NULL past the last one
+const struct romix_kernel *romix_kernel(unsigned i)
+{
+    if (i >= sizeof(kernels) / sizeof(kernels[0])) return NULL;
+    return &kernels[i];
+}
+
+// scrypt ROMix on kernel->lanes lanes of 128 * r bytes at once
+// Lane l uses v[l] of 128 * r * N bytes; XY of 256 * r * lanes bytes,
+// aligned to 64 bytes, is scratch
+void romix_lanes(const struct romix_kernel *kernel, uint8_t **lanes, uint64_t N, uint32_t r,
+        uint32_t **v, uint32_t *xy)
+{
+    const unsigned L = kernel->lanes;
+    const size_t rows = 8 * r;
+    const size_t words = 32 * r;
+    uint32_t *x = xy;
+    uint32_t *y = xy + words * L;
+
+    for (unsigned l = 0; l < L; l++)
+        for (size_t q = 0; q < rows; q++)
+            for (int c = 0; c < 4; c++) {
+                size_t word = (q & ~3) * 4 + ((((q & 3) * 4 + c) * 5) & 15);
+                x[(q * L + l) * 4 + c] = le32dec(&lanes[l][word * 4]);
+            }
+
+    // Row q of the last block holds word 0 of the lane at column 0, word 1 at row 3 column 1
+    const size_t last = (2 * r - 1) * 4;
+    for (uint64_t i = 0; i < N; i++) {
+        uint32_t *in = (i & 1) ? y : x;
+        for (unsigned l = 0; l < L; l++) {
+            uint32_t *restrict dst = &v[l][i * words];
+            const uint32_t *restrict src = &in[l * 4];
+            for (size_t q = 0; q < rows; q++, dst += 4, src += 4 * L)
+                memcpy(dst, src, 16);
+        }
+        kernel->blockmix(in, (i & 1) ? x : y, r);
+    }
+
+    for (uint64_t i = 0; i < N; i++) {
+        uint32_t *in = (i & 1) ? y : x;
+        for (unsigned l = 0; l < L; l++) {
+            uint64_t j = (((uint64_t) in[((last + 3) * L + l) * 4 + 1] << 32) |
+                    in[(last * L + l) * 4]) & (N - 1);
+            const uint32_t *restrict src = &v[l][j * words];
+            uint32_t *restrict dst = &in[l * 4];
+            for (size_t q = 0; q < rows; q++, dst += 4 * L, src += 4)
+                for (int c = 0; c < 4; c++) dst[c] ^= src[c];
+        }
+        kernel->blockmix(in, (i & 1) ? x : y, r);
+    }
+
+    // N is even, so the result is back in X
+    for (unsigned l = 0; l < L; l++)
+        for (size_t q = 0; q < rows; q++)
+            for (int c = 0; c < 4; c++) {
+                size_t word = (q & ~3) * 4 + ((((q & 3) * 4 + c) * 5) & 15);
+                le32enc(&lanes[l][word * 4], x[(q * L + l) * 4 + c]);
+            }
+}
@@ -0,0 +1,146 @@
+// scan.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+#define SCAN_KEYS_BUCKETS 1024
+
+// Key presence of a descriptor, looked up once per scan
+struct scan_key {
+    struct scan_key *next;
+    key_desc_t descriptor;
+    bool present;
+};
+
+struct scan_state {
+    pthread_mutex_t lock;
+    struct scan_key *buckets[SCAN_KEYS_BUCKETS];
+    unsigned long vaults;
+};
+
+// Is the key of a v1 descriptor in the keyring: search the keyring only the first time
+static
+bool scan_key_present(struct scan_state *state, key_desc_t *key_desc)
+{
+    unsigned h = 0;
+    for (size_t i = 0; i < sizeof(key_desc_t); i++) h = h * 31 + ((*key_desc)[i] & 0xff);
+    h %= SCAN_KEYS_BUCKETS;
+
+    pthread_mutex_lock(&state->lock);
+    struct scan_key *key = state->buckets[h];
+    while (key && memcmp(key->descriptor, *key_desc, sizeof(key_desc_t)) != 0) key = key->next;
+
+    if (!key && (key = malloc(sizeof(*key)))) {
+        key_serial_t serial;
+        memcpy(key->descriptor, *key_desc, sizeof(key_desc_t));
+        key->present = (find_key_by_descriptor(key_desc, &serial) == 0);
+        key->next = state->buckets[h];
+        state->buckets[h] = key;
+    }
+
+    bool present = key && key->present;
+    pthread_mutex_unlock(&state->lock);
+    return present;
+}
+
+// Append a JSON string literal to buf
+size_t json_string(char *buf, size_t n, size_t len, const char *s)
+{
+    if (len < n) buf[len++] = '"';
+    for (; *s && len + 7 < n; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        }
+        else if (c < 0x20) len += snprintf(buf + len, n - len, "\\u%04x", c);
+        else buf[len++] = c;
+    }
+    if (len < n) buf[len++] = '"';
+    return len;
+}
+
+// Report a directory if it is encrypted; all its subdirectories share its policy,
+// so the walk does not descend into it
+static
+int scan_dir(int dirfd, const char *path, unsigned depth, void *arg)
+{
+    (void) depth;
+    struct scan_state *state = arg;
+    struct ext4_encryption_policy policy;
+    key_id_t identifier;
+
+    if (vault_policy_fd(dirfd, &policy, &identifier) <= 0)
+        return 0;
+
+    // A v2 key lives on the filesystem of the vault, so the kernel is asked each time
+    bool v2 = (policy.version == EXT4_POLICY_V2);
+    bool present = v2 ? vault_key_status_fd(dirfd, &policy, &identifier, NULL) == EXT4_KEY_STATUS_PRESENT
+            : scan_key_present(state, &policy.master_key_descriptor);
+    const char *key_id = v2 ? identifier : policy.master_key_descriptor;
+    size_t key_id_sz = v2 ? sizeof(key_id_t) : sizeof(key_desc_t);
+    char descriptor[EXT4_KEY_IDENTIFIER_SIZE * 2 + 1];
+    for (size_t i = 0; i < key_id_sz; i++)
+        sprintf(descriptor + i * 2, "%02x", key_id[i] & 0xff);
+
+    char line[PATH_MAX * 6 + 256];
+    size_t len = snprintf(line, sizeof(line), "{\"path\":");
+    len = json_string(line, sizeof(line), len, path);
+    len += snprintf(line + len, sizeof(line) - len,
+            ",\"policy_version\":%d,\"contents_cipher\":\"%s\",\"filenames_cipher\":\"%s\","
+            "\"padding\":%u,\"%s\":\"%s\",\"key_present\":%s}\n",
+            policy.version, cipher_mode_to_string(policy.contents_encryption_mode),
+            cipher_mode_to_string(policy.filenames_encryption_mode), flags_to_padding_length(policy.flags),
+            v2 ? "identifier" : "descriptor", descriptor, present ? "true" : "false");
+
+    // One write per record keeps lines whole with many workers
+    flockfile(stdout);
+    fwrite(line, 1, len, stdout);
+    funlockfile(stdout);
+
+    __atomic_add_fetch(&state->vaults, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Stream an NDJSON record for every encrypted directory below root
+int scan_tree(const char *root, unsigned threads)
+{
+    struct scan_state state = { .vaults = 0 };
+    pthread_mutex_init(&state.lock, NULL);
+
+    struct walk_ops ops = {
+        .dir = scan_dir,
+        .arg = &state,
+        .threads = threads,
+    };
+    struct walk_stats stats;
+    int ret = walk_tree(root, &ops, &stats);
+    fflush(stdout);
+
+    if (ret == 0)
+        fprintf(stderr, "Scanned %lu directories, found %lu encrypted (%lu unreadable)\n",
+                stats.dirs, state.vaults, stats.errors);
+
+    for (int i = 0; i < SCAN_KEYS_BUCKETS; i++) {
+        while (state.buckets[i]) {
+            struct scan_key *next = state.buckets[i]->next;
+            free(state.buckets[i]);
+            state.buckets[i] = next;
+        }
+    }
+    pthread_mutex_destroy(&state.lock);
+    return ret;
+}
@@ -0,0 +1,398 @@
+// scrypt.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sodium.h>
+
+#include "e2crypt.h"
+
+// Memory that is left to the rest of the system when sizing the pool
+#define SCRYPT_MEMORY_HEADROOM (64ULL << 20)
+
+// PBKDF2-HMAC-SHA256 with a single iteration, as used by scrypt
+static
+void pbkdf2_sha256_1(const uint8_t *pass, size_t pass_sz, const uint8_t *salt, size_t salt_sz,
+        uint8_t *out, size_t out_sz)
+{
+    crypto_auth_hmacsha256_state state;
+    uint8_t block[crypto_auth_hmacsha256_BYTES];
+    uint8_t ivec[4];
+
+    for (size_t i = 0; i * sizeof(block) < out_sz; i++) {
+        uint32_t n = i + 1;
+        ivec[0] = (n >> 24) & 0xff;
+        ivec[1] = (n >> 16) & 0xff;
+        ivec[2] = (n >> 8) & 0xff;
+        ivec[3] = n & 0xff;
+
+        crypto_auth_hmacsha256_init(&state, pass, pass_sz);
+        crypto_auth_hmacsha256_update(&state, salt, salt_sz);
+        crypto_auth_hmacsha256_update(&state, ivec, sizeof(ivec));
+        crypto_auth_hmacsha256_final(&state, block);
+
+        size_t len = out_sz - i * sizeof(block);
+        if (len > sizeof(block)) len = sizeof(block);
+        memcpy(out + i * sizeof(block), block, len);
+    }
+
+    sodium_memzero(&state, sizeof(state));
+    sodium_memzero(block, sizeof(block));
+}
+
+// Read a single line from a (cgroup) pseudo-file
+static
+bool read_line(const char *path, char *buf, size_t n)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    bool ok = fgets(buf, n, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// Find the cgroup v2 directory of the calling process
+static
+bool cgroup2_dir(char *dir, size_t n)
+{
+    char line[512];
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f) return false;
+
+    bool found = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) != 0) continue;
+        line[strcspn(line, "\n")] = 0;
+        // A truncated path would name another cgroup
+        found = snprintf(dir, n, "/sys/fs/cgroup%s", line + 3) < (int) n;
+        break;
+    }
+
+    fclose(f);
+    return found;
+}
+
+// Number of CPUs the calling process may use: affinity mask and cgroup quota
+unsigned available_cpus()
+{
+    unsigned cpus = 1;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) cpus = CPU_COUNT(&set);
+
+    char dir[448], path[512], line[64];
+    long long quota = -1, period = 0;
+    if (cgroup2_dir(dir, sizeof(dir))) {
+        snprintf(path, sizeof(path), "%s/cpu.max", dir);
+        if (read_line(path, line, sizeof(line)) && strncmp(line, "max", 3) != 0)
+            sscanf(line, "%lld %lld", &quota, &period);
+    }
+    else if (read_line("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", line, sizeof(line))) {
+        quota = atoll(line);
+        if (read_line("/sys/fs/cgroup/cpu/cpu.cfs_period_us", line, sizeof(line)))
+            period = atoll(line);
+    }
+
+    if (quota > 0 && period > 0) {
+        unsigned limit = (quota + period - 1) / period;
+        if (limit < cpus) cpus = limit;
+    }
+
+    return cpus ? cpus : 1;
+}
+
+// Memory the calling process may still allocate under its cgroup limit
+// Return 0 when there is no limit
+unsigned long long available_memory()
+{
+    char dir[448], path[512], line[64];
+    unsigned long long limit = 0, usage = 0;
+
+    if (cgroup2_dir(dir, sizeof(dir))) {
+        snprintf(path, sizeof(path), "%s/memory.max", dir);
+        if (read_line(path, line, sizeof(line)) && strncmp(line, "max", 3) != 0)
+            limit = strtoull(line, NULL, 10);
+        snprintf(path, sizeof(path), "%s/memory.current", dir);
+        if (read_line(path, line, sizeof(line))) usage = strtoull(line, NULL, 10);
+    }
+    else if (read_line("/sys/fs/cgroup/memory/memory.limit_in_bytes", line, sizeof(line))) {
+        limit = strtoull(line, NULL, 10);
+        // Unlimited v1 groups report a huge page-aligned value
+        if (limit >= (1ULL << 62)) limit = 0;
+        if (read_line("/sys/fs/cgroup/memory/memory.usage_in_bytes", line, sizeof(line)))
+            usage = strtoull(line, NULL, 10);
+    }
+
+    if (limit == 0) return 0;
+    return (limit > usage) ? limit - usage : 1;
+}
+
+// Whether scrypt can run with cost N, r, p: the limits libsodium enforces,
+// under which none of the sizes derived from them overflows
+bool scrypt_params_ok(uint64_t N, uint32_t r, uint32_t p)
+{
+    if (N < 2 || (N & (N - 1)) != 0 || r == 0 || p == 0)
+        return false;
+    if ((uint64_t) r * p >= (1ULL << 30))
+        return false;
+    // N < 2^(128 * r / 8), which only binds below r = 4
+    if (r < 4 && N >= (1ULL << (16 * r)))
+        return false;
+#if SIZE_MAX / 256 <= UINT32_MAX
+    if (r > SIZE_MAX / 256)
+        return false;
+#endif
+    return r <= SIZE_MAX / 128 / p && N <= SIZE_MAX / 128 / r;
+}
+
+// Size of the V and XY scratch buffers to run batch lanes at once
+// Return false when it does not fit in a size_t
+static
+bool scratch_size(uint64_t N, uint32_t r, unsigned batch, size_t *sz)
+{
+    size_t lane_sz = 128 * (size_t) r, v_sz, xy_sz;
+    return !__builtin_mul_overflow(lane_sz, N, &v_sz) &&
+            !__builtin_mul_overflow(v_sz, batch, &v_sz) &&
+            !__builtin_mul_overflow(2 * lane_sz, batch, &xy_sz) &&
+            !__builtin_add_overflow(v_sz, xy_sz, sz);
+}
+
+// Number of worker threads to run p lanes of the given cost on
+unsigned scrypt_threads(uint64_t N, uint32_t r, uint32_t p)
+{
+    unsigned threads = available_cpus();
+
+    const char *env = getenv("E2CRYPT_KDF_THREADS");
+    if (env && atoi(env) > 0) threads = atoi(env);
+
+    if (threads > p) threads = p;
+
+    // Every thread holds its own V and XY scratch buffers
+    size_t lane_mem;
+    if (!scrypt_params_ok(N, r, p) || !scratch_size(N, r, 1, &lane_mem))
+        return 1;
+    unsigned long long mem = available_memory();
+    if (mem) {
+        mem = (mem > SCRYPT_MEMORY_HEADROOM) ? mem - SCRYPT_MEMORY_HEADROOM : 0;
+        unsigned long long fit = mem / lane_mem;
+        if (fit < threads) threads = fit;
+    }
+
+    return threads ? threads : 1;
+}
+
+// Kernels that passed the self-test, as a bit per index of romix_kernel()
+static unsigned kernels_usable;
+// Index of the kernel to start from: the fastest usable one or the one asked for
+// Set after kernels_init by scrypt_use_kernel while other threads derive keys,
+// so it is only accessed atomically
+static unsigned kernel_first;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+struct scrypt_job {
+    uint8_t *b;
+    uint64_t N;
+    uint32_t r;
+    uint32_t p;
+    unsigned next_lane;
+    unsigned first;
+    unsigned batch;
+    pthread_mutex_t lock;
+    bool failed;
+};
+
+// Fastest usable kernel from index first on with at most want lanes
+static
+const struct romix_kernel *pick_kernel(unsigned first, unsigned want)
+{
+    const struct romix_kernel *k;
+    for (unsigned i = first; (k = romix_kernel(i)); i++)
+        if ((kernels_usable & (1u << i)) && k->lanes <= want) return k;
+    return NULL;
+}
+
+// Worker: run ROMix on batches of lanes until none are left
+static
+void *scrypt_worker(void *arg)
+{
+    struct scrypt_job *job = arg;
+    size_t lane_sz = 128 * (size_t) job->r;
+    size_t v_sz = lane_sz * job->N * job->batch;
+    size_t scratch_sz;
+    uint8_t *scratch = scratch_size(job->N, job->r, job->batch, &scratch_sz) ? arena_acquire(scratch_sz) : NULL;
+    uint32_t *v = (uint32_t *) scratch;
+    uint32_t *xy = (uint32_t *) (scratch + v_sz);
+
+    if (!scratch) {
+        pthread_mutex_lock(&job->lock);
+        job->failed = true;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        unsigned left = (job->next_lane < job->p) ? job->p - job->next_lane : 0;
+        const struct romix_kernel *k = pick_kernel(job->first, left < job->batch ? left : job->batch);
+        unsigned lane = job->next_lane;
+        if (k) job->next_lane += k->lanes;
+        pthread_mutex_unlock(&job->lock);
+        if (!k) break;
+
+        uint8_t *lanes[k->lanes];
+        uint32_t *vs[k->lanes];
+        for (unsigned l = 0; l < k->lanes; l++) {
+            lanes[l] = job->b + (lane + l) * lane_sz;
+            vs[l] = v + l * (lane_sz / 4) * job->N;
+        }
+        romix_lanes(k, lanes, job->N, job->r, vs, xy);
+    }
+
+    arena_release(scratch);
+    return NULL;
+}
+
+// scrypt with the p lanes spread over a pool of threads, each running
+// batch lanes at once with the kernels from index first on
+static
+int scrypt_run(const uint8_t *pass, size_t pass_sz, const uint8_t *salt, size_t salt_sz,
+        uint64_t N, uint32_t r, uint32_t p, unsigned threads, unsigned first, unsigned batch,
+        uint8_t *out, size_t out_sz)
+{
+    size_t b_sz = 128 * (size_t) r * p;
+    uint8_t *b = malloc(b_sz);
+    if (!b) return -1;
+
+    pbkdf2_sha256_1(pass, pass_sz, salt, salt_sz, b, b_sz);
+
+    struct scrypt_job job = {
+        .b = b, .N = N, .r = r, .p = p,
+        .next_lane = 0, .first = first, .batch = batch, .failed = false,
+    };
+    pthread_mutex_init(&job.lock, NULL);
+
+    pthread_t tids[threads];
+    unsigned started = 0;
+    for (; started < threads - 1; started++)
+        if (pthread_create(&tids[started], NULL, scrypt_worker, &job) != 0) break;
+
+    // The calling thread works too, so a failed pthread_create only costs parallelism
+    scrypt_worker(&job);
+    for (unsigned i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    int ret = -1;
+    if (!job.failed && job.next_lane >= p) {
+        pbkdf2_sha256_1(pass, pass_sz, b, b_sz, out, out_sz);
+        ret = 0;
+    }
+
+    sodium_memzero(b, b_sz);
+    free(b);
+    return ret;
+}
+
+// Check every kernel the CPU supports against libsodium on a small cost,
+// with all its lanes in use and r = 2 for the order of the blocks
+static
+void kernels_init()
+{
+    const uint8_t pass[] = "password", salt[] = "NaCl";
+    const struct romix_kernel *k;
+
+    for (unsigned i = 0; (k = romix_kernel(i)); i++) {
+        uint8_t want[64], got[64];
+        if (!k->supported()) continue;
+
+        kernels_usable |= 1u << i;
+        if (crypto_pwhash_scryptsalsa208sha256_ll(pass, sizeof(pass) - 1, salt, sizeof(salt) - 1,
+                    16, 2, k->lanes, want, sizeof(want)) != 0 ||
+                scrypt_run(pass, sizeof(pass) - 1, salt, sizeof(salt) - 1,
+                    16, 2, k->lanes, 1, i, k->lanes, got, sizeof(got)) != 0 ||
+                sodium_memcmp(want, got, sizeof(want)) != 0)
+            kernels_usable &= ~(1u << i);
+    }
+
+    unsigned first = 0;
+    while (romix_kernel(first) && !(kernels_usable & (1u << first)))
+        first++;
+
+    const char *env = getenv("E2CRYPT_SCRYPT_KERNEL");
+    for (unsigned i = 0; env && (k = romix_kernel(i)); i++)
+        if (strcmp(env, k->name) == 0 && (kernels_usable & (1u << i))) first = i;
+    __atomic_store_n(&kernel_first, first, __ATOMIC_RELAXED);
+}
+
+// Index of the kernel scrypt_parallel starts with
+static
+unsigned scrypt_kernel_first()
+{
+    pthread_once(&kernels_once, kernels_init);
+    return __atomic_load_n(&kernel_first, __ATOMIC_RELAXED);
+}
+
+// The kernel scrypt_parallel starts with, NULL when none passed the self-test
+const struct romix_kernel *scrypt_kernel()
+{
+    return romix_kernel(scrypt_kernel_first());
+}
+
+// Start with the kernel called name, or the fastest one for NULL
+// Return -1 when this CPU cannot run it
+int scrypt_use_kernel(const char *name)
+{
+    const struct romix_kernel *k;
+    pthread_once(&kernels_once, kernels_init);
+
+    for (unsigned i = 0; (k = romix_kernel(i)); i++)
+        if ((kernels_usable & (1u << i)) && (!name || strcmp(name, k->name) == 0)) {
+            __atomic_store_n(&kernel_first, i, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+    return -1;
+}
+
+// scrypt with the p lanes spread over a pool of threads
+// Output is identical to crypto_pwhash_scryptsalsa208sha256_ll
+int scrypt_parallel(const uint8_t *pass, size_t pass_sz, const uint8_t *salt, size_t salt_sz,
+        uint64_t N, uint32_t r, uint32_t p, unsigned threads, uint8_t *out, size_t out_sz)
+{
+    if (!scrypt_params_ok(N, r, p) || out_sz > ((1ULL << 32) - 1) * 32)
+        return -1;
+
+    // One read, so that the kernel and its lanes go together
+    unsigned first = scrypt_kernel_first();
+    const struct romix_kernel *k = romix_kernel(first);
+    if (threads < 1) threads = 1;
+    if (threads > p) threads = p;
+
+    // Only when no kernel passed the self-test
+    if (!k)
+        return crypto_pwhash_scryptsalsa208sha256_ll(pass, pass_sz, salt, salt_sz,
+                N, r, p, out, out_sz);
+
+    // Lanes beyond one per thread run side by side, as far as memory allows
+    unsigned batch = p / threads;
+    if (batch > k->lanes) batch = k->lanes;
+    unsigned long long mem = available_memory();
+    size_t lane_mem, batch_mem;
+    if (mem && scratch_size(N, r, 1, &lane_mem)) {
+        mem = (mem > SCRYPT_MEMORY_HEADROOM) ? mem - SCRYPT_MEMORY_HEADROOM : 0;
+        unsigned long long fit = mem / lane_mem / threads;
+        if (fit < batch) batch = fit;
+    }
+    while (batch > 1 && !scratch_size(N, r, batch, &batch_mem)) batch--;
+    if (batch < 1) batch = 1;
+
+    return scrypt_run(pass, pass_sz, salt, salt_sz, N, r, p, threads, first, batch,
+            out, out_sz);
+}
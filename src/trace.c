@@ -0,0 +1,114 @@
+// trace.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "e2crypt.h"
+
+// Phases of the traced operation: one record for the process, as the phases
+// of a batch run on several threads; nothing is recorded outside an operation
+// tracing and enabled are read without trace_lock, so only accessed atomically
+static struct trace_record record;
+static bool tracing = false;
+// -1 until set or read from E2CRYPT_TRACE, then 0 or 1
+static int enabled = -1;
+static double origin_us;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static
+double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Turn tracing on or off; unless set, E2CRYPT_TRACE decides
+void trace_enable(bool on)
+{
+    __atomic_store_n(&enabled, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+bool trace_enabled()
+{
+    int on = __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+    if (on < 0) {
+        // A trace_enable meanwhile wins over the environment
+        const char *env = getenv("E2CRYPT_TRACE");
+        int from_env = env && *env && strcmp(env, "0") != 0;
+        if (__atomic_compare_exchange_n(&enabled, &on, from_env, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            on = from_env;
+    }
+    return on == 1;
+}
+
+// Start recording the phases of operation op on path
+void trace_start(const char *op, const char *path)
+{
+    TRACE_PROBE2(op__begin, op, path);
+    bool on = trace_enabled();
+
+    pthread_mutex_lock(&trace_lock);
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.path = path;
+    origin_us = now_us();
+    __atomic_store_n(&tracing, on, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Mark the start of a phase on the calling thread
+void trace_begin(const char *name)
+{
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+        return;
+
+    double t = now_us();
+    pthread_mutex_lock(&trace_lock);
+    if (tracing && record.nphases < TRACE_MAX_PHASES) {
+        struct trace_phase *phase = &record.phases[record.nphases++];
+        phase->name = name;
+        phase->thread = (unsigned long) pthread_self();
+        phase->start_us = t - origin_us;
+        phase->end_us = -1;
+    }
+    else if (tracing) record.dropped++;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Mark the end of the last phase of that name begun on the calling thread
+void trace_end(const char *name)
+{
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+        return;
+
+    double t = now_us();
+    unsigned long thread = (unsigned long) pthread_self();
+    pthread_mutex_lock(&trace_lock);
+    for (unsigned i = record.nphases; i-- > 0;) {
+        struct trace_phase *phase = &record.phases[i];
+        if (phase->end_us < 0 && phase->thread == thread && strcmp(phase->name, name) == 0) {
+            phase->end_us = t - origin_us;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Stop recording and return the record of the operation, NULL when not traced
+const struct trace_record *trace_stop()
+{
+    TRACE_PROBE2(op__end, record.op, record.path);
+    if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+        return NULL;
+
+    pthread_mutex_lock(&trace_lock);
+    __atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+    record.total_us = now_us() - origin_us;
+    pthread_mutex_unlock(&trace_lock);
+    return &record;
+}
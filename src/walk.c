@@ -0,0 +1,268 @@
+// walk.c
+
+#if !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "e2crypt.h"
+
+// Directory waiting to be read
+struct walk_item {
+    char *path;
+    unsigned depth;
+};
+
+// Per-worker deque: the owner works LIFO at the bottom, thieves take from the top
+// so that each worker walks depth-first and the frontier stays small
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_item *items;
+    size_t top;
+    size_t bottom;
+    size_t size;
+};
+
+struct walk_state {
+    const struct walk_ops *ops;
+    struct walk_deque *deques;
+    unsigned workers;
+    dev_t dev;
+    // Directories queued or being read; the walk is over when it drops to 0
+    unsigned long pending;
+    unsigned long dirs;
+    unsigned long errors;
+};
+
+struct walk_worker {
+    struct walk_state *state;
+    unsigned id;
+};
+
+static
+bool deque_push(struct walk_deque *dq, struct walk_item item)
+{
+    pthread_mutex_lock(&dq->lock);
+    if (dq->top > 0 && dq->top == dq->bottom) dq->top = dq->bottom = 0;
+    if (dq->bottom == dq->size) {
+        // Reclaim the slots thieves emptied before growing
+        if (dq->top > 0) {
+            memmove(dq->items, dq->items + dq->top, (dq->bottom - dq->top) * sizeof(item));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        }
+        else {
+            size_t size = dq->size ? dq->size * 2 : 64;
+            struct walk_item *items = realloc(dq->items, size * sizeof(item));
+            if (!items) {
+                pthread_mutex_unlock(&dq->lock);
+                return false;
+            }
+            dq->items = items;
+            dq->size = size;
+        }
+    }
+    dq->items[dq->bottom++] = item;
+    pthread_mutex_unlock(&dq->lock);
+    return true;
+}
+
+static
+bool deque_pop(struct walk_deque *dq, struct walk_item *item)
+{
+    pthread_mutex_lock(&dq->lock);
+    bool ok = dq->bottom > dq->top;
+    if (ok) *item = dq->items[--dq->bottom];
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static
+bool deque_steal(struct walk_deque *dq, struct walk_item *item)
+{
+    if (pthread_mutex_trylock(&dq->lock) != 0) return false;
+    bool ok = dq->bottom > dq->top;
+    if (ok) *item = dq->items[dq->top++];
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+// Queue a directory on the worker's own deque
+static
+void walk_push(struct walk_state *state, unsigned id, char *path, unsigned depth)
+{
+    __atomic_add_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+    struct walk_item item = { .path = path, .depth = depth };
+    if (!deque_push(&state->deques[id], item)) {
+        free(path);
+        __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Read one directory: report it and its entries, queue its subdirectories
+static
+void walk_dir(struct walk_state *state, unsigned id, struct walk_item *item)
+{
+    const struct walk_ops *ops = state->ops;
+    int dirfd = open(item->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dirfd == -1) {
+        __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_add_fetch(&state->dirs, 1, __ATOMIC_RELAXED);
+    if (ops->dir && ops->dir(dirfd, item->path, item->depth, ops->arg) != 0) {
+        close(dirfd);
+        return;
+    }
+
+    if (ops->max_depth && item->depth >= ops->max_depth && !ops->entry) {
+        close(dirfd);
+        if (ops->dir_done) ops->dir_done(item->path, item->depth, ops->arg);
+        return;
+    }
+
+    DIR *dir = fdopendir(dirfd);
+    if (!dir) {
+        close(dirfd);
+        __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+        if (ops->dir_done) ops->dir_done(item->path, item->depth, ops->arg);
+        return;
+    }
+
+    size_t path_len = strlen(item->path);
+    struct dirent *de;
+    while ((de = readdir(dir))) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        unsigned char type = de->d_type;
+        struct stat st;
+        if (type == DT_UNKNOWN || (type == DT_DIR && !ops->cross_mounts)) {
+            if (fstatat(dirfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            type = IFTODT(st.st_mode);
+            // Stay on the filesystem the walk started on
+            if (type == DT_DIR && !ops->cross_mounts && st.st_dev != state->dev) continue;
+        }
+
+        if (ops->entry) ops->entry(dirfd, item->path, de->d_name, type, item->depth + 1, ops->arg);
+        if (type != DT_DIR || (ops->max_depth && item->depth >= ops->max_depth)) continue;
+
+        size_t name_len = strlen(de->d_name);
+        char *path = malloc(path_len + name_len + 2);
+        if (!path) {
+            __atomic_add_fetch(&state->errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        memcpy(path, item->path, path_len);
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, de->d_name, name_len + 1);
+        walk_push(state, id, path, item->depth + 1);
+    }
+
+    closedir(dir);
+    if (ops->dir_done) ops->dir_done(item->path, item->depth, ops->arg);
+}
+
+// Worker: drain the own deque, then steal from the others until the walk is done
+static
+void *walk_worker(void *arg)
+{
+    struct walk_worker *worker = arg;
+    struct walk_state *state = worker->state;
+    struct walk_item item;
+    unsigned idle = 0;
+
+    while (__atomic_load_n(&state->pending, __ATOMIC_SEQ_CST) > 0) {
+        bool found = deque_pop(&state->deques[worker->id], &item);
+        for (unsigned i = 1; !found && i < state->workers; i++)
+            found = deque_steal(&state->deques[(worker->id + i) % state->workers], &item);
+
+        if (!found) {
+            if (++idle > 64) usleep(100);
+            else sched_yield();
+            continue;
+        }
+
+        idle = 0;
+        walk_dir(state, worker->id, &item);
+        free(item.path);
+        __atomic_sub_fetch(&state->pending, 1, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+// Walk the tree below root on a pool of work-stealing threads
+// Memory use follows the frontier of unread directories, not the tree size
+int walk_tree(const char *root, const struct walk_ops *ops, struct walk_stats *stats)
+{
+    struct stat st;
+    if (stat(root, &st) != 0) {
+        error(0, "Cannot walk %s: %s", root, strerror(errno));
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        error(0, "Cannot walk %s: not a directory", root);
+        return -1;
+    }
+
+    unsigned workers = ops->threads ? ops->threads : available_cpus();
+    struct walk_state state = {
+        .ops = ops, .workers = workers, .dev = st.st_dev,
+        .pending = 0, .dirs = 0, .errors = 0,
+    };
+    state.deques = calloc(workers, sizeof(*state.deques));
+    struct walk_worker *pool = calloc(workers, sizeof(*pool));
+    pthread_t *tids = calloc(workers, sizeof(*tids));
+    char *path = strdup(root);
+    if (!state.deques || !pool || !tids || !path) {
+        error(0, "Cannot allocate memory for %u walkers", workers);
+        free(state.deques);
+        free(pool);
+        free(tids);
+        free(path);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_mutex_init(&state.deques[i].lock, NULL);
+        pool[i].state = &state;
+        pool[i].id = i;
+    }
+
+    // Strip trailing slashes so child paths are joined cleanly
+    for (size_t len = strlen(path); len > 1 && path[len - 1] == '/'; len--) path[len - 1] = 0;
+    walk_push(&state, 0, path, 0);
+
+    unsigned started = 1;
+    for (; started < workers; started++)
+        if (pthread_create(&tids[started], NULL, walk_worker, &pool[started]) != 0) break;
+    walk_worker(&pool[0]);
+    for (unsigned i = 1; i < started; i++) pthread_join(tids[i], NULL);
+
+    for (unsigned i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&state.deques[i].lock);
+        free(state.deques[i].items);
+    }
+    free(state.deques);
+    free(pool);
+    free(tids);
+
+    if (stats) {
+        stats->dirs = state.dirs;
+        stats->errors = state.errors;
+    }
+    return 0;
+}